@@ -17,6 +17,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
 #ifdef CONFIG_EPOLL
 #include <sys/epoll.h>
 #endif
@@ -26,6 +28,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -243,6 +246,9 @@ void aio_set_fd_handler(AioContext *ctx,
             is_new = true;
         }
         /* Update handler with latest information */
+        if (node->io_read != io_read || node->opaque != opaque) {
+            node->io_poll = NULL;
+        }
         node->io_read = io_read;
         node->io_write = io_write;
         node->opaque = opaque;
@@ -268,6 +274,21 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -400,12 +421,115 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Polling is only worth it if every event we would sleep on can be polled
+ * for; aio_notify() (and thus BHs) ends the polling window by itself.
+ */
+static bool aio_can_poll(AioContext *ctx)
+{
+    AioHandler *node;
+    bool can_poll = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !aio_node_check(ctx, node->is_external) ||
+            node->opaque == &ctx->notifier) {
+            continue;
+        }
+        if (!node->io_poll) {
+            if (node->io_read || node->io_write) {
+                return false;
+            }
+            continue;
+        }
+        can_poll = true;
+    }
+    return can_poll;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+/* Busy poll the handlers for up to @max_ns nanoseconds.  Stops early if a
+ * handler makes progress or aio_notify() is called.  Must be called with
+ * walking_handlers incremented.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+
+    do {
+        if (run_poll_handlers_once(ctx)) {
+            return true;
+        }
+    } while (!atomic_read(&ctx->notified) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return false;
+}
+
+/* Adjust the polling window from the time a blocking aio_poll() spent
+ * waiting: grow it if a slightly longer window would have avoided sleeping,
+ * shrink it if even the longest window would not have helped.
+ */
+static void aio_adjust_poll_window(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * grow : 4000;
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -425,6 +549,28 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    /* Compute the timeout first: a scheduled bottom half or an expired
+     * timer must not wait for the polling window to run out.
+     */
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    if (timeout && ctx->poll_max_ns && aio_can_poll(ctx)) {
+        int64_t poll_ns = ctx->poll_ns;
+
+        if (timeout > 0) {
+            poll_ns = MIN(poll_ns, timeout);
+        }
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (poll_ns && run_poll_handlers(ctx, poll_ns)) {
+            progress = true;
+            timeout = 0;
+            ctx->poll_hits++;
+        } else if (poll_ns) {
+            /* Part of the timeout has been spent polling */
+            timeout = aio_compute_timeout(ctx);
+        }
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
@@ -434,8 +580,6 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
-
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
@@ -458,6 +602,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
         aio_context_acquire(ctx);
     }
 
+    if (start && !progress) {
+        ctx->poll_misses++;
+        aio_adjust_poll_window(ctx,
+                               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     aio_notify_accept(ctx);
 
     /* if we have any readable fds, dispatch event */
@@ -16,9 +16,11 @@
 #include "qapi-visit.h"
 #include "qemu/config-file.h"
 #include "qom/object_interfaces.h"
+#include "qapi-event.h"
 
 #ifdef CONFIG_NUMA
 #include <numaif.h>
+#include <sched.h>
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_BIND != MPOL_BIND);
@@ -185,6 +187,95 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+static void host_memory_backend_prealloc_progress(uint64_t done,
+                                                 uint64_t total,
+                                                 void *opaque)
+{
+    HostMemoryBackend *backend = opaque;
+    gchar *id = object_get_canonical_path_component(OBJECT(backend));
+
+    qapi_event_send_mem_prealloc_progress(id ? id : "", done, total,
+                                          &error_abort);
+    g_free(id);
+}
+
+#ifdef CONFIG_NUMA
+/*
+ * Runs preallocation thread @index on the CPUs of one of the host nodes,
+ * round robin.  The pages are then zeroed by a local CPU and, with the
+ * bind policy, spread evenly over the nodes.
+ */
+static void host_memory_backend_prealloc_thread_init(int index, void *opaque)
+{
+    HostMemoryBackend *backend = opaque;
+    unsigned long node;
+    int nr_nodes = 0;
+    gchar *path, *cpulist, **ranges;
+    cpu_set_t cpus;
+    int i;
+
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        nr_nodes++;
+    }
+    if (!nr_nodes) {
+        return;
+    }
+
+    node = find_first_bit(backend->host_nodes, MAX_NODES);
+    for (i = index % nr_nodes; i > 0; i--) {
+        node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1);
+    }
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist", node);
+    if (!g_file_get_contents(path, &cpulist, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    ranges = g_strsplit(g_strstrip(cpulist), ",", 0);
+    for (i = 0; ranges[i]; i++) {
+        unsigned long first, last;
+        char *end;
+
+        first = last = strtoul(ranges[i], &end, 10);
+        if (*end == '-') {
+            last = strtoul(end + 1, NULL, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &cpus);
+        }
+    }
+    if (CPU_COUNT(&cpus)) {
+        /* Only a hint, so failure is not an error */
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+
+    g_strfreev(ranges);
+    g_free(cpulist);
+    g_free(path);
+}
+#endif
+
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz)
+{
+    MemPreallocParams params = {
+        .threads = backend->prealloc_threads,
+        .progress = host_memory_backend_prealloc_progress,
+        .opaque = backend,
+    };
+
+#ifdef CONFIG_NUMA
+    if (backend->policy != MPOL_DEFAULT) {
+        params.thread_init = host_memory_backend_prealloc_thread_init;
+    }
+#endif
+    os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz, &params);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -211,15 +302,48 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz);
+        host_memory_backend_prealloc(backend, ptr, sz);
         backend->prealloc = true;
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, &backend->prealloc_threads, name, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value > MEM_PREALLOC_MAX_THREADS) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRIu32 "', maximum is %d", object_get_typename(obj),
+                   name, value, MEM_PREALLOC_MAX_THREADS);
+        goto out;
+    }
+    backend->prealloc_threads = value;
+out:
+    error_propagate(errp, local_err);
+}
+
 static void host_memory_backend_init(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -238,6 +362,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "int",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -325,7 +453,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            host_memory_backend_prealloc(backend, ptr, sz);
         }
     }
 }
@@ -68,6 +68,7 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool persistent;            /* Stored in the image by the format driver */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -3343,6 +3344,7 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
         info->status = bdrv_dirty_bitmap_status(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -3451,6 +3453,85 @@ int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
     return hbitmap_count(bitmap->bitmap);
 }
 
+const char *bdrv_dirty_bitmap_name(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->size;
+}
+
+/**
+ * Iterate over the dirty bitmaps of a BDS; pass NULL to get the first one.
+ */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    return bitmap ? QLIST_NEXT(bitmap, list) :
+                    QLIST_FIRST(&bs->dirty_bitmaps);
+}
+
+void bdrv_dirty_bitmap_set_persistance(BdrvDirtyBitmap *bitmap,
+                                       bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_get_persistance(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+bool bdrv_has_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm;
+
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->persistent) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bdrv_can_store_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    return drv && drv->bdrv_can_store_persistent_dirty_bitmaps &&
+           drv->bdrv_can_store_persistent_dirty_bitmaps(bs);
+}
+
+/**
+ * Write the persistent dirty bitmaps of @bs to the image now, rather than
+ * waiting for the image to be closed.
+ */
+int bdrv_store_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    if (!bdrv_can_store_persistent_dirty_bitmaps(bs)) {
+        return -ENOTSUP;
+    }
+    return bs->drv->bdrv_store_persistent_dirty_bitmaps(bs);
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_size(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize(const BdrvDirtyBitmap *bitmap, uint8_t *buf)
+{
+    hbitmap_serialize(bitmap->bitmap, buf);
+}
+
+void bdrv_dirty_bitmap_deserialize(BdrvDirtyBitmap *bitmap,
+                                   const uint8_t *buf)
+{
+    hbitmap_deserialize(bitmap->bitmap, buf);
+}
+
 /* Get a reference to bs */
 void bdrv_ref(BlockDriverState *bs)
 {
@@ -0,0 +1,494 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (C) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Submission queue size (per-device).  The completion queue is twice as
+ * large, and no more than MAX_EVENTS requests are in flight at a time, so
+ * completions can never overflow.  Requests beyond that wait in io_q and are
+ * submitted as completions come in.
+ */
+#define MAX_EVENTS 128
+
+struct qemu_luringcb {
+    BlockAIOCB common;
+    struct qemu_luring_state *ctx;
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(qemu_luringcb) next;
+};
+
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, qemu_luringcb) pending;
+} LuringQueue;
+
+/* The rings are shared with the kernel; head and tail pointers point into
+ * the mapped memory.
+ */
+typedef struct {
+    unsigned *khead;
+    unsigned *ktail;
+    unsigned *kring_mask;
+    unsigned *kring_entries;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+    void *ring;
+    size_t ring_size;
+} LuringSQ;
+
+typedef struct {
+    unsigned *khead;
+    unsigned *ktail;
+    unsigned *kring_mask;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ring_size;
+} LuringCQ;
+
+struct qemu_luring_state {
+    int fd;
+    LuringSQ sq;
+    LuringCQ cq;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+
+    /* Reap completions from the event loop instead of waiting for the
+     * eventfd while requests are in flight.
+     */
+    bool poll;
+};
+
+static void ioq_submit(struct qemu_luring_state *s);
+
+/* Entries that are in the submission ring but not consumed by the kernel
+ * yet, for example because io_uring_enter() failed with EAGAIN.
+ */
+static unsigned ioq_unsubmitted(struct qemu_luring_state *s)
+{
+    return *s->sq.ktail - atomic_read(s->sq.khead);
+}
+
+/* Retry submission of queued and unsubmitted requests, if any */
+static void ioq_resubmit(struct qemu_luring_state *s)
+{
+    if (!s->io_q.plugged &&
+        (!QSIMPLEQ_EMPTY(&s->io_q.pending) || ioq_unsubmitted(s))) {
+        ioq_submit(s);
+    }
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void qemu_luring_process_completion(struct qemu_luring_state *s,
+    struct qemu_luringcb *luringcb)
+{
+    int ret;
+
+    ret = luringcb->ret;
+    if (ret >= 0 && luringcb->qiov) {
+        if (ret == luringcb->nbytes) {
+            ret = 0;
+        } else {
+            /* Short reads mean EOF, pad with zeros. */
+            if (luringcb->is_read) {
+                qemu_iovec_memset(luringcb->qiov, ret, 0,
+                    luringcb->qiov->size - ret);
+                ret = 0;
+            } else {
+                ret = -EINVAL;
+            }
+        }
+    } else if (ret > 0) {
+        ret = 0;
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/* The completion BH reaps completed requests straight from the completion
+ * ring and invokes their callbacks.
+ *
+ * The ring head is advanced before each callback runs, so a nested event
+ * loop started by a callback picks up where we left off.  The BH reschedules
+ * itself as long as there are completions pending, as in linux-aio.c.  In
+ * polling mode it also stays scheduled while requests are in flight.
+ */
+static void qemu_luring_completion_bh(void *opaque)
+{
+    struct qemu_luring_state *s = opaque;
+    unsigned head, tail;
+
+    head = *s->cq.khead;
+    tail = atomic_read(s->cq.ktail);
+    smp_rmb();
+
+    if (head == tail) {
+        ioq_resubmit(s);
+        if (s->poll && s->io_q.in_flight) {
+            qemu_bh_schedule(s->completion_bh);
+        }
+        return; /* no more events */
+    }
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    /* Process completion events */
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &s->cq.cqes[head & *s->cq.kring_mask];
+        struct qemu_luringcb *luringcb =
+                (struct qemu_luringcb *)(uintptr_t)cqe->user_data;
+
+        luringcb->ret = cqe->res;
+        head++;
+        atomic_mb_set(s->cq.khead, head);
+        s->io_q.in_flight--;
+
+        qemu_luring_process_completion(s, luringcb);
+
+        head = *s->cq.khead;
+        tail = atomic_read(s->cq.ktail);
+        smp_rmb();
+    }
+
+    ioq_resubmit(s);
+}
+
+static void qemu_luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+/* Polling callback: reap completions if the completion ring is not empty */
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (*s->cq.khead == atomic_read(s->cq.ktail)) {
+        return false;
+    }
+
+    event_notifier_test_and_clear(&s->e);
+    qemu_luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/* Move as many pending requests as fit into the submission ring, and hand
+ * everything the kernel has not consumed yet to it with one system call.
+ */
+static void ioq_submit(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+    unsigned mask = *s->sq.kring_mask;
+    unsigned entries = *s->sq.kring_entries;
+    unsigned tail = *s->sq.ktail;
+    unsigned to_submit;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           s->io_q.in_flight < MAX_EVENTS &&
+           tail - atomic_read(s->sq.khead) < entries) {
+        unsigned idx = tail & mask;
+
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->sq.sqes[idx] = luringcb->sqe;
+        s->sq.array[idx] = idx;
+        s->io_q.in_queue--;
+        s->io_q.in_flight++;
+        tail++;
+    }
+
+    /* Publish the new entries before the tail */
+    atomic_mb_set(s->sq.ktail, tail);
+
+    to_submit = tail - atomic_read(s->sq.khead);
+    if (to_submit) {
+        do {
+            ret = io_uring_enter(s->fd, to_submit, 0, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0 && errno != EAGAIN && errno != EBUSY) {
+            abort();
+        }
+    }
+
+    to_submit = tail - atomic_read(s->sq.khead);
+    s->io_q.blocked = !QSIMPLEQ_EMPTY(&s->io_q.pending) || to_submit;
+
+    /* Completions trigger the next attempt to submit.  If the kernel has
+     * nothing in flight, none will come, so retry from the completion BH.
+     */
+    if ((s->poll && s->io_q.in_flight) ||
+        (to_submit && s->io_q.in_flight == to_submit)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!s->io_q.blocked &&
+        (!QSIMPLEQ_EMPTY(&s->io_q.pending) || ioq_unsubmitted(s))) {
+        ioq_submit(s);
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+    struct io_uring_sqe *sqe;
+    off_t offset = sector_num * 512;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->ctx = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+
+    sqe = &luringcb->sqe;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)luringcb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = offset;
+        break;
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = offset;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        goto out_free_aiocb;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_EVENTS)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+
+out_free_aiocb:
+    qemu_aio_unref(luringcb);
+    return NULL;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           qemu_luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_luring_poll_cb);
+}
+
+static void luring_unmap_rings(struct qemu_luring_state *s)
+{
+    if (s->sq.sqes) {
+        munmap(s->sq.sqes, *s->sq.kring_entries * sizeof(struct io_uring_sqe));
+    }
+    if (s->sq.ring) {
+        munmap(s->sq.ring, s->sq.ring_size);
+    }
+    if (s->cq.ring) {
+        munmap(s->cq.ring, s->cq.ring_size);
+    }
+}
+
+static int luring_map_rings(struct qemu_luring_state *s,
+                            struct io_uring_params *p)
+{
+    void *ptr;
+
+    s->sq.ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ptr = mmap(NULL, s->sq.ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, s->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+    s->sq.ring = ptr;
+    s->sq.khead = ptr + p->sq_off.head;
+    s->sq.ktail = ptr + p->sq_off.tail;
+    s->sq.kring_mask = ptr + p->sq_off.ring_mask;
+    s->sq.kring_entries = ptr + p->sq_off.ring_entries;
+    s->sq.array = ptr + p->sq_off.array;
+
+    ptr = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, s->fd,
+               IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+    s->sq.sqes = ptr;
+
+    s->cq.ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    ptr = mmap(NULL, s->cq.ring_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, s->fd, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+    s->cq.ring = ptr;
+    s->cq.khead = ptr + p->cq_off.head;
+    s->cq.ktail = ptr + p->cq_off.tail;
+    s->cq.kring_mask = ptr + p->cq_off.ring_mask;
+    s->cq.cqes = ptr + p->cq_off.cqes;
+
+    return 0;
+}
+
+void *luring_init(bool poll)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params p;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    memset(&p, 0, sizeof(p));
+    s->fd = io_uring_setup(MAX_EVENTS, &p);
+    if (s->fd < 0) {
+        goto out_close_efd;
+    }
+
+    if (luring_map_rings(s, &p) < 0) {
+        goto out_unmap;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        goto out_unmap;
+    }
+
+    ioq_init(&s->io_q);
+    s->poll = poll;
+
+    return s;
+
+out_unmap:
+    luring_unmap_rings(s);
+    close(s->fd);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->fd);
+    g_free(s);
+}
@@ -29,37 +29,35 @@
 #include "nbd-client.h"
 #include "qemu/sockets.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(conn, handle) ((handle) ^ ((uint64_t)(intptr_t)conn))
+#define INDEX_TO_HANDLE(conn, index)  ((index)  ^ ((uint64_t)(intptr_t)conn))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+static void nbd_recv_coroutines_enter_all(NbdConnection *s)
 {
     int i;
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->session->max_requests; i++) {
         if (s->recv_coroutine[i]) {
             qemu_coroutine_enter(s->recv_coroutine[i], NULL);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(NbdConnection *conn)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
-
     /* finish any pending coroutines */
-    shutdown(client->sock, 2);
-    nbd_recv_coroutines_enter_all(client);
+    shutdown(conn->sock, 2);
+    nbd_recv_coroutines_enter_all(conn);
 
-    nbd_client_detach_aio_context(bs);
-    closesocket(client->sock);
-    client->sock = -1;
+    aio_set_fd_handler(bdrv_get_aio_context(conn->bs), conn->sock,
+                       false, NULL, NULL, NULL);
+    closesocket(conn->sock);
+    conn->sock = -1;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdConnection *s = opaque;
     uint64_t i;
     int ret;
 
@@ -82,7 +80,7 @@ static void nbd_reply_ready(void *opaque)
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
     i = HANDLE_TO_INDEX(s, s->reply.handle);
-    if (i >= MAX_NBD_REQUESTS) {
+    if (i >= s->session->max_requests) {
         goto fail;
     }
 
@@ -92,42 +90,41 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdConnection *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine, NULL);
+    qemu_coroutine_enter(s->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdConnection *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
 
-    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+    for (i = 0; i < s->session->max_requests; i++) {
         if (s->recv_coroutine[i] == NULL) {
             s->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
-    assert(i < MAX_NBD_REQUESTS);
+    assert(i < s->session->max_requests);
     request->handle = INDEX_TO_HANDLE(s, i);
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sock, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
-        if (!s->is_unix) {
+        if (!s->session->is_unix) {
             socket_set_cork(s->sock, 1);
         }
         rc = nbd_send_request(s->sock, request);
@@ -138,67 +135,226 @@ static int nbd_co_send_request(BlockDriverState *bs,
                 rc = -EIO;
             }
         }
-        if (!s->is_unix) {
+        if (!s->session->is_unix) {
             socket_set_cork(s->sock, 0);
         }
     } else {
         rc = nbd_send_request(s->sock, request);
     }
     aio_set_fd_handler(aio_context, s->sock, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_drop(NbdConnection *s, uint32_t len)
+{
+    uint8_t buf[512];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+
+        if (qemu_co_recv(s->sock, buf, n) != n) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read the payload of one structured reply chunk.  Returns the number of
+ * bytes of the request that the chunk describes, or a negative errno if
+ * the server reported an error or sent something unexpected.
+ */
+static int64_t nbd_co_receive_chunk(NbdConnection *s,
     struct nbd_request *request, struct nbd_reply *reply,
-    QEMUIOVector *qiov, int offset)
+    QEMUIOVector *qiov, int offset, NBDExtent *extent)
 {
-    int ret;
+    uint32_t len = reply->length;
+    uint8_t buf[12];
+    uint64_t from;
+    uint32_t size;
+    int err;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (len) {
+            break;
+        }
+        return 0;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || len < 8) {
+            break;
+        }
+        if (qemu_co_recv(s->sock, buf, 8) != 8) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        size = len - 8;
+        if (from < request->from ||
+            from + size > request->from + request->len) {
+            nbd_co_drop(s, size);
+            return -EIO;
+        }
+        if (qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                          offset + (from - request->from), size) != size) {
+            return -EIO;
+        }
+        return size;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || len != 12) {
+            break;
+        }
+        if (qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        size = be32_to_cpup((uint32_t *)(buf + 8));
+        if (from < request->from ||
+            from + size > request->from + request->len) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset + (from - request->from), 0, size);
+        return size;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || len < 12 || (len - 4) % sizeof(NBDExtent)) {
+            break;
+        }
+        if (qemu_co_recv(s->sock, buf, 12) != 12) {
+            return -EIO;
+        }
+        /* Only the first extent is of interest */
+        if (nbd_co_drop(s, len - 12) < 0 ||
+            be32_to_cpup((uint32_t *)buf) != s->meta_context_id) {
+            return -EIO;
+        }
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return extent->length;
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(reply->type) || len < 6) {
+            break;
+        }
+        if (qemu_co_recv(s->sock, buf, 6) != 6) {
+            return -EIO;
+        }
+        /* Skip the message and, for NBD_REPLY_TYPE_ERROR_OFFSET, the
+         * offset that follows it */
+        nbd_co_drop(s, len - 6);
+        err = nbd_errno_to_system_errno(be32_to_cpup((uint32_t *)buf));
+        return -(err ? err : EIO);
+    }
+
+    nbd_co_drop(s, len);
+    return -EIO;
+}
+
+static void nbd_co_receive_reply(NbdConnection *s,
+    struct nbd_request *request, struct nbd_reply *reply,
+    QEMUIOVector *qiov, int offset, NBDExtent *extent)
+{
+    uint64_t covered = 0;
+    int64_t ret;
+    int error = 0;
+
+    while (1) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = s->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (!reply->structured) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+            if (extent && reply->error == 0) {
+                /* Block status needs a structured reply */
                 reply->error = EIO;
             }
+
+            /* Tell the read handler to read another header.  */
+            s->reply.handle = 0;
+            return;
         }
 
-        /* Tell the read handler to read another header.  */
+        /* The server may send any number of chunks for a request, the
+         * last of which carries NBD_REPLY_FLAG_DONE.  */
+        ret = nbd_co_receive_chunk(s, request, reply, qiov, offset, extent);
+        if (ret < 0) {
+            error = error ? error : -ret;
+        } else {
+            covered += ret;
+        }
         s->reply.handle = 0;
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            break;
+        }
+    }
+
+    if (!error && (qiov || extent) &&
+        (extent ? covered == 0 : covered != request->len)) {
+        error = EIO;
     }
+    reply->error = error;
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+/* Pick the connection for a new request, going round-robin over those
+ * that have room in their window.  Returns NULL if every connection to
+ * the server is gone.
+ */
+static NbdConnection *nbd_coroutine_start(NbdClientSession *s,
    struct nbd_request *request)
 {
-    /* Poor man semaphore.  The free_sema is locked when no other request
-     * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
-    }
-    s->in_flight++;
+    NbdConnection *conn;
+    bool alive;
+    int i;
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    while (1) {
+        alive = false;
+        for (i = 0; i < s->num_conns; i++) {
+            conn = &s->conns[(s->next_conn + i) % s->num_conns];
+            if (conn->sock == -1) {
+                continue;
+            }
+            alive = true;
+            if (conn->in_flight < s->max_requests) {
+                s->next_conn = (conn - s->conns + 1) % s->num_conns;
+                conn->in_flight++;
+
+                /* conn->recv_coroutine[i] is set as soon as we get the
+                 * send_mutex.  */
+                return conn;
+            }
+        }
+        if (!alive) {
+            /* Let the other waiters fail too */
+            qemu_co_queue_next(&s->free_sema);
+            return NULL;
+        }
+        qemu_co_queue_wait(&s->free_sema);
+    }
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdConnection *conn,
     struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
-    }
+    int i = HANDLE_TO_INDEX(conn, request->handle);
+    conn->recv_coroutine[i] = NULL;
+    conn->in_flight--;
+    qemu_co_queue_next(&conn->session->free_sema);
 }
 
 static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
@@ -206,6 +362,7 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_READ };
     struct nbd_reply reply;
     ssize_t ret;
@@ -213,14 +370,17 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov, offset);
+        nbd_co_receive_reply(conn, &request, &reply, qiov, offset, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
@@ -230,6 +390,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
                            int offset)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_WRITE };
     struct nbd_reply reply;
     ssize_t ret;
@@ -242,14 +403,17 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov, offset);
+    conn = nbd_coroutine_start(client, &request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(conn, &request, qiov, offset);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -257,43 +421,104 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
  * remain aligned to 4K. */
 #define NBD_MAX_SECTORS 2040
 
+typedef struct NbdSplitRequest {
+    BlockDriverState *bs;
+    Coroutine *co;
+    QEMUIOVector *qiov;
+    bool is_write;
+
+    int64_t sector_num;         /* start of the next piece */
+    int nb_sectors;             /* sectors not yet handed out */
+    int offset;                 /* offset of the next piece in qiov */
+    int workers;
+    bool waiting;
+    int ret;
+} NbdSplitRequest;
+
+static void coroutine_fn nbd_co_split_worker(void *opaque)
+{
+    NbdSplitRequest *req = opaque;
+    int64_t sector_num;
+    int n, offset, ret;
+
+    while (req->nb_sectors > 0 && req->ret == 0) {
+        n = MIN(req->nb_sectors, NBD_MAX_SECTORS);
+        sector_num = req->sector_num;
+        offset = req->offset;
+        req->sector_num += n;
+        req->nb_sectors -= n;
+        req->offset += n * 512;
+
+        if (req->is_write) {
+            ret = nbd_co_writev_1(req->bs, sector_num, n, req->qiov, offset);
+        } else {
+            ret = nbd_co_readv_1(req->bs, sector_num, n, req->qiov, offset);
+        }
+        if (ret < 0 && req->ret == 0) {
+            req->ret = ret;
+        }
+    }
+
+    if (--req->workers == 0 && req->waiting) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+/* Requests larger than NBD_MAX_SECTORS are split, and the pieces are kept
+ * in flight together on all connections instead of one after another.  */
+static int coroutine_fn nbd_co_rw_split(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        QEMUIOVector *qiov, bool is_write)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdSplitRequest req = {
+        .bs         = bs,
+        .co         = qemu_coroutine_self(),
+        .qiov       = qiov,
+        .is_write   = is_write,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+    int pieces = DIV_ROUND_UP(nb_sectors, NBD_MAX_SECTORS);
+    int workers = MIN(pieces, client->num_conns * client->max_requests);
+    int i;
+
+    req.workers = workers;
+    for (i = 0; i < workers; i++) {
+        Coroutine *co = qemu_coroutine_create(nbd_co_split_worker);
+        qemu_coroutine_enter(co, &req);
+    }
+
+    while (req.workers > 0) {
+        req.waiting = true;
+        qemu_coroutine_yield();
+        req.waiting = false;
+    }
+    return req.ret;
+}
+
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_readv_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+    if (nb_sectors > NBD_MAX_SECTORS) {
+        return nbd_co_rw_split(bs, sector_num, nb_sectors, qiov, false);
     }
-    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, offset);
+    return nbd_co_readv_1(bs, sector_num, nb_sectors, qiov, 0);
 }
 
 int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov)
 {
-    int offset = 0;
-    int ret;
-    while (nb_sectors > NBD_MAX_SECTORS) {
-        ret = nbd_co_writev_1(bs, sector_num, NBD_MAX_SECTORS, qiov, offset);
-        if (ret < 0) {
-            return ret;
-        }
-        offset += NBD_MAX_SECTORS * 512;
-        sector_num += NBD_MAX_SECTORS;
-        nb_sectors -= NBD_MAX_SECTORS;
+    if (nb_sectors > NBD_MAX_SECTORS) {
+        return nbd_co_rw_split(bs, sector_num, nb_sectors, qiov, true);
     }
-    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, offset);
+    return nbd_co_writev_1(bs, sector_num, nb_sectors, qiov, 0);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -309,14 +534,17 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 }
 
@@ -324,6 +552,7 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
     struct nbd_request request = { .type = NBD_CMD_TRIM };
     struct nbd_reply reply;
     ssize_t ret;
@@ -334,30 +563,112 @@ int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL, 0);
+    conn = nbd_coroutine_start(client, &request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL, 0);
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, NULL);
     }
-    nbd_coroutine_end(client, &request);
+    nbd_coroutine_end(conn, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdConnection *conn;
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0, 0 };
+    int64_t ret;
+
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+
+    nb_sectors = MIN(nb_sectors, UINT32_MAX >> BDRV_SECTOR_BITS);
+    request.from = sector_num * 512;
+    request.len = nb_sectors * 512;
+
+    conn = nbd_coroutine_start(client, &request);
+    if (!conn) {
+        return -EIO;
+    }
+    ret = nbd_co_send_request(conn, &request, NULL, 0);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(conn, &request, &reply, NULL, 0, &extent);
+    }
+    nbd_coroutine_end(conn, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    /* A hole that does not read as zeroes may still hold anything */
+    ret = (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+          (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
+    if (ret == 0) {
+        ret = BDRV_BLOCK_DATA;
+    }
+
+    *pnum = MIN(MAX(extent.length >> BDRV_SECTOR_BITS, 1), nb_sectors);
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        ret = BDRV_BLOCK_DATA;
+    }
+    return ret | BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sock,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sock != -1) {
+            aio_set_fd_handler(bdrv_get_aio_context(bs),
+                               client->conns[i].sock,
+                               false, NULL, NULL, NULL);
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sock,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sock != -1) {
+            aio_set_fd_handler(new_context, client->conns[i].sock,
+                               false, nbd_reply_ready, NULL,
+                               &client->conns[i]);
+        }
+    }
+}
+
+static void nbd_client_free_conns(NbdClientSession *client)
+{
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        g_free(client->conns[i].recv_coroutine);
+    }
+    g_free(client->conns);
+    client->conns = NULL;
+    client->num_conns = 0;
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -368,42 +679,98 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->sock == -1) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NbdConnection *conn = &client->conns[i];
 
-    nbd_send_request(client->sock, &request);
+        if (conn->sock == -1) {
+            continue;
+        }
 
-    nbd_teardown_connection(bs);
+        nbd_send_request(conn->sock, &request);
+
+        nbd_teardown_connection(conn);
+    }
+    nbd_client_free_conns(client);
 }
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export,
-                    Error **errp)
+int nbd_client_init(BlockDriverState *bs, int *socks, int num_socks,
+                    const char *export, int max_requests,
+                    bool extensions, Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
-    int ret;
-
-    /* NBD handshake */
-    logout("session init %s\n", export);
-    qemu_set_block(sock);
-    ret = nbd_receive_negotiate(sock, export,
-                                &client->nbdflags, &client->size, errp);
-    if (ret < 0) {
-        logout("Failed to negotiate with the NBD server\n");
-        closesocket(sock);
-        return ret;
+    int i, ret;
+
+    client->conns = g_new0(NbdConnection, num_socks);
+    client->num_conns = num_socks;
+    client->next_conn = 0;
+    client->max_requests = max_requests;
+    qemu_co_queue_init(&client->free_sema);
+
+    for (i = 0; i < num_socks; i++) {
+        NbdConnection *conn = &client->conns[i];
+        NBDExtensions ext;
+        uint32_t nbdflags;
+        off_t size;
+
+        conn->session = client;
+        conn->bs = bs;
+        conn->sock = -1;
+        conn->recv_coroutine = g_new0(Coroutine *, max_requests);
+        qemu_co_mutex_init(&conn->send_mutex);
+
+        /* NBD handshake */
+        logout("session init %s (connection %d)\n", export, i);
+        qemu_set_block(socks[i]);
+        memset(&ext, 0, sizeof(ext));
+        ret = nbd_receive_negotiate(socks[i], export, &nbdflags, &size,
+                                    extensions ? &ext : NULL, errp);
+        if (ret < 0) {
+            logout("Failed to negotiate with the NBD server\n");
+            goto fail;
+        }
+        conn->meta_context_id = ext.meta_context_id;
+
+        if (i == 0) {
+            client->nbdflags = nbdflags;
+            client->size = size;
+            client->ext = ext;
+
+            /* Writes completed on one connection must be visible on all
+             * others and covered by a flush sent on any of them.  */
+            if (num_socks > 1 &&
+                !(nbdflags & (NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN))) {
+                error_setg(errp, "Server does not support multiple "
+                           "connections to this export");
+                ret = -EINVAL;
+                goto fail;
+            }
+        } else if (nbdflags != client->nbdflags || size != client->size ||
+                   ext.structured_reply != client->ext.structured_reply ||
+                   ext.base_allocation != client->ext.base_allocation) {
+            error_setg(errp, "Server negotiated a different export on "
+                       "connection %d", i);
+            ret = -EINVAL;
+            goto fail;
+        }
     }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sock = sock;
-
-    /* Now that we're connected, set the socket to be non-blocking and
+    /* Now that we're connected, set the sockets to be non-blocking and
      * kick the reply mechanism.  */
-    qemu_set_nonblock(sock);
+    for (i = 0; i < num_socks; i++) {
+        client->conns[i].sock = socks[i];
+        qemu_set_nonblock(socks[i]);
+    }
     nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
-    logout("Established connection with NBD server\n");
+    logout("Established %d connection(s) with NBD server\n", num_socks);
     return 0;
+
+fail:
+    for (i = 0; i < num_socks; i++) {
+        closesocket(socks[i]);
+    }
+    nbd_client_free_conns(client);
+    return ret;
 }
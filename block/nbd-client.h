@@ -14,28 +14,49 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
+/* Default window of in-flight requests on each connection */
 #define MAX_NBD_REQUESTS    16
 
-typedef struct NbdClientSession {
+/* Limits for the "connections" and "max-requests" options */
+#define NBD_MAX_CONNECTIONS         16
+#define NBD_MAX_REQUESTS_LIMIT      256
+
+typedef struct NbdClientSession NbdClientSession;
+
+/* One socket to the server, with its own window of in-flight requests */
+typedef struct NbdConnection {
+    NbdClientSession *session;
+    BlockDriverState *bs;
     int sock;
-    uint32_t nbdflags;
-    off_t size;
+    uint32_t meta_context_id;       /* chosen by the server per connection */
 
     CoMutex send_mutex;
-    CoMutex free_sema;
     Coroutine *send_coroutine;
     int in_flight;
 
-    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    Coroutine **recv_coroutine;     /* max_requests entries */
     struct nbd_reply reply;
+} NbdConnection;
+
+struct NbdClientSession {
+    uint32_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+
+    NbdConnection *conns;
+    int num_conns;
+    int next_conn;
+    int max_requests;
+    CoQueue free_sema;              /* requests waiting for a free slot */
 
     bool is_unix;
-} NbdClientSession;
+};
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
-int nbd_client_init(BlockDriverState *bs, int sock, const char *export_name,
-                    Error **errp);
+int nbd_client_init(BlockDriverState *bs, int *socks, int num_socks,
+                    const char *export_name, int max_requests,
+                    bool extensions, Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -45,6 +66,9 @@ int nbd_client_co_writev(BlockDriverState *bs, int64_t sector_num,
                          int nb_sectors, QEMUIOVector *qiov);
 int nbd_client_co_readv(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors, QEMUIOVector *qiov);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
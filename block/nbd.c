@@ -41,10 +41,31 @@
 
 #define EN_OPTSTR ":exportname="
 
+#define NBD_OPT_CONNECTIONS     "connections"
+#define NBD_OPT_MAX_REQUESTS    "max-requests"
+
 typedef struct BDRVNBDState {
     NbdClientSession client;
 } BDRVNBDState;
 
+static QemuOptsList runtime_opts = {
+    .name = "nbd",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NBD_OPT_CONNECTIONS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the export",
+        },
+        {
+            .name = NBD_OPT_MAX_REQUESTS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of requests in flight per connection",
+        },
+        { /* end of list */ }
+    },
+};
+
 static int nbd_parse_uri(const char *filename, QDict *options)
 {
     URI *uri;
@@ -260,13 +281,61 @@ static int nbd_establish_connection(BlockDriverState *bs,
     return sock;
 }
 
+static int nbd_establish_connections(BlockDriverState *bs,
+                                     SocketAddress *saddr,
+                                     int *socks, int num_socks,
+                                     Error **errp)
+{
+    int i;
+
+    for (i = 0; i < num_socks; i++) {
+        socks[i] = nbd_establish_connection(bs, saddr, errp);
+        if (socks[i] < 0) {
+            int ret = socks[i];
+
+            while (i-- > 0) {
+                closesocket(socks[i]);
+            }
+            return ret;
+        }
+    }
+    return 0;
+}
+
 static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
                     Error **errp)
 {
     BDRVNBDState *s = bs->opaque;
     char *export = NULL;
-    int result, sock;
+    int result;
+    int socks[NBD_MAX_CONNECTIONS];
+    uint64_t num_conns, max_requests;
     SocketAddress *saddr;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    num_conns = qemu_opt_get_number(opts, NBD_OPT_CONNECTIONS, 1);
+    max_requests = qemu_opt_get_number(opts, NBD_OPT_MAX_REQUESTS,
+                                       MAX_NBD_REQUESTS);
+    qemu_opts_del(opts);
+
+    if (num_conns < 1 || num_conns > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "'" NBD_OPT_CONNECTIONS "' must be between 1 "
+                   "and %d", NBD_MAX_CONNECTIONS);
+        return -EINVAL;
+    }
+    if (max_requests < 1 || max_requests > NBD_MAX_REQUESTS_LIMIT) {
+        error_setg(errp, "'" NBD_OPT_MAX_REQUESTS "' must be between 1 "
+                   "and %d", NBD_MAX_REQUESTS_LIMIT);
+        return -EINVAL;
+    }
 
     /* Pop the config into our state object. Exit if invalid. */
     saddr = nbd_config(s, options, &export, errp);
@@ -274,18 +343,37 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -EINVAL;
     }
 
-    /* establish TCP connection, return error if it fails
+    /* establish TCP connections, return error if any fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
-    sock = nbd_establish_connection(bs, saddr, errp);
-    qapi_free_SocketAddress(saddr);
-    if (sock < 0) {
-        g_free(export);
-        return sock;
+    result = nbd_establish_connections(bs, saddr, socks, num_conns, errp);
+    if (result < 0) {
+        goto out;
     }
 
     /* NBD handshake */
-    result = nbd_client_init(bs, sock, export, errp);
+    result = nbd_client_init(bs, socks, num_conns, export, max_requests,
+                             true, &local_err);
+    if (result == -ECONNRESET) {
+        /* The server hung up after turning down structured replies, like
+         * older servers do with any option they don't know.  Connect again
+         * and do without them.
+         */
+        error_free(local_err);
+        local_err = NULL;
+        result = nbd_establish_connections(bs, saddr, socks, num_conns, errp);
+        if (result < 0) {
+            goto out;
+        }
+        result = nbd_client_init(bs, socks, num_conns, export, max_requests,
+                                 false, &local_err);
+    }
+    if (local_err) {
+        error_propagate(errp, local_err);
+    }
+
+out:
+    qapi_free_SocketAddress(saddr);
     g_free(export);
     return result;
 }
@@ -307,6 +395,13 @@ static int nbd_co_flush(BlockDriverState *bs)
     return nbd_client_co_flush(bs);
 }
 
+static int64_t coroutine_fn nbd_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    return nbd_client_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+}
+
 static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     bs->bl.max_discard = UINT32_MAX >> BDRV_SECTOR_BITS;
@@ -384,6 +479,20 @@ static void nbd_refresh_filename(BlockDriverState *bs)
         qdict_put_obj(opts, "export", QOBJECT(qstring_from_str(export)));
     }
 
+    /* A plain URI cannot carry these, so fall back to a json: file name */
+    if (qdict_haskey(bs->options, NBD_OPT_CONNECTIONS)) {
+        QObject *obj = qdict_get(bs->options, NBD_OPT_CONNECTIONS);
+        qobject_incref(obj);
+        qdict_put_obj(opts, NBD_OPT_CONNECTIONS, obj);
+        bs->exact_filename[0] = '\0';
+    }
+    if (qdict_haskey(bs->options, NBD_OPT_MAX_REQUESTS)) {
+        QObject *obj = qdict_get(bs->options, NBD_OPT_MAX_REQUESTS);
+        qobject_incref(obj);
+        qdict_put_obj(opts, NBD_OPT_MAX_REQUESTS, obj);
+        bs->exact_filename[0] = '\0';
+    }
+
     bs->full_open_options = opts;
 }
 
@@ -398,6 +507,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -416,6 +526,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -434,6 +545,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_discard            = nbd_co_discard,
+    .bdrv_co_get_block_status   = nbd_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
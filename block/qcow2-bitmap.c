@@ -0,0 +1,492 @@
+/*
+ * Persistent dirty bitmaps for the QCOW2 format
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+
+/*
+ * The bitmap directory is a list of variable-sized entries, each followed
+ * by the bitmap name padded to a multiple of 8 bytes.  The bitmap data is
+ * the output of hbitmap_serialize, stored in contiguous clusters.
+ *
+ * While an image is opened read-write, the directory entries are marked
+ * in use and point to no data: the in-memory bitmaps are the only valid
+ * copy until they are written back when the image is closed.
+ */
+
+#define BME_FLAG_IN_USE     (1U << 0)
+#define BME_FLAG_ENABLED    (1U << 1)
+#define BME_FLAGS_MASK      (BME_FLAG_IN_USE | BME_FLAG_ENABLED)
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint8_t reserved;
+    uint16_t name_size;
+    /* name follows */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+static inline size_t dir_entry_size(size_t name_size)
+{
+    return sizeof(Qcow2BitmapDirEntry) + align_offset(name_size, 8);
+}
+
+void qcow2_free_bitmap_directory(Qcow2BitmapInfo *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    if (!bitmaps) {
+        return;
+    }
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Reads and checks the bitmap directory of the image.
+ *
+ * Returns the number of entries stored in *pbitmaps, or -errno.
+ */
+int qcow2_read_bitmap_directory(BlockDriverState *bs,
+                                Qcow2BitmapInfo **pbitmaps, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapInfo *bitmaps = NULL;
+    uint8_t *dir;
+    uint64_t pos = 0;
+    int i, ret;
+
+    *pbitmaps = NULL;
+    if (!s->nb_bitmaps) {
+        return 0;
+    }
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (!dir) {
+        error_setg(errp, "Could not allocate bitmap directory");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap directory");
+        goto fail;
+    }
+
+    bitmaps = g_new0(Qcow2BitmapInfo, s->nb_bitmaps);
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry e;
+        Qcow2BitmapInfo *info = &bitmaps[i];
+
+        if (s->bitmap_directory_size - pos < sizeof(e)) {
+            goto corrupt;
+        }
+        memcpy(&e, dir + pos, sizeof(e));
+        be64_to_cpus(&e.data_offset);
+        be64_to_cpus(&e.data_size);
+        be32_to_cpus(&e.flags);
+        be16_to_cpus(&e.name_size);
+
+        if (e.name_size == 0 || e.name_size > QCOW_MAX_BITMAP_NAME_SIZE ||
+            s->bitmap_directory_size - pos < dir_entry_size(e.name_size) ||
+            e.granularity_bits < BDRV_SECTOR_BITS ||
+            e.granularity_bits > 31 ||
+            (e.flags & ~BME_FLAGS_MASK) ||
+            offset_into_cluster(s, e.data_offset)) {
+            goto corrupt;
+        }
+
+        info->name = g_strndup((char *)dir + pos + sizeof(e), e.name_size);
+        info->data_offset = e.data_offset;
+        info->data_size = e.data_size;
+        info->flags = e.flags;
+        info->granularity_bits = e.granularity_bits;
+        pos += dir_entry_size(e.name_size);
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return s->nb_bitmaps;
+
+corrupt:
+    error_setg(errp, "Bitmap directory entry %d is invalid", i);
+    ret = -EINVAL;
+fail:
+    qcow2_free_bitmap_directory(bitmaps, s->nb_bitmaps);
+    g_free(dir);
+    return ret;
+}
+
+/*
+ * Creates the in-memory dirty bitmaps from the bitmap directory; if the
+ * image is writable, the on-disk copies are then marked in use.
+ */
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    Qcow2BitmapInfo *bitmaps;
+    int nb_bitmaps, i, ret = 0;
+
+    nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps, errp);
+    if (nb_bitmaps < 0) {
+        return nb_bitmaps;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2BitmapInfo *info = &bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+        uint8_t *buf;
+
+        if (bdrv_find_dirty_bitmap(bs, info->name)) {
+            /* Brought over by migration, and newer than what we have */
+            continue;
+        }
+
+        if (info->flags & BME_FLAG_IN_USE) {
+            error_report("qcow2: dirty bitmap '%s' was not stored properly "
+                         "and has been dropped", info->name);
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1U << info->granularity_bits,
+                                          info->name, errp);
+        if (!bitmap) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        if (info->data_size != bdrv_dirty_bitmap_serialization_size(bitmap)) {
+            error_report("qcow2: dirty bitmap '%s' does not match the image "
+                         "size and has been dropped", info->name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            continue;
+        }
+
+        buf = info->data_size <= INT_MAX ? g_try_malloc(info->data_size)
+                                         : NULL;
+        if (!buf) {
+            error_setg(errp, "Could not allocate dirty bitmap '%s'",
+                       info->name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        ret = bdrv_pread(bs->file->bs, info->data_offset, buf,
+                         info->data_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read dirty bitmap '%s'",
+                             info->name);
+            bdrv_release_dirty_bitmap(bs, bitmap);
+            g_free(buf);
+            goto out;
+        }
+
+        bdrv_dirty_bitmap_deserialize(bitmap, buf);
+        g_free(buf);
+
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+        if (!(info->flags & BME_FLAG_ENABLED)) {
+            bdrv_disable_dirty_bitmap(bitmap);
+        }
+    }
+
+    if (!bs->read_only && nb_bitmaps) {
+        ret = qcow2_store_bitmaps(bs, true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not mark dirty bitmaps as "
+                             "in use");
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    return ret;
+}
+
+static int write_bitmap_data(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                             Qcow2BitmapInfo *info)
+{
+    uint64_t size = bdrv_dirty_bitmap_serialization_size(bitmap);
+    int64_t offset;
+    uint8_t *buf;
+    int ret;
+
+    if (size > INT_MAX) {
+        return -EFBIG;
+    }
+
+    buf = g_try_malloc(size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    bdrv_dirty_bitmap_serialize(bitmap, buf);
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    info->data_offset = offset;
+    info->data_size = size;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, offset, buf, size);
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static uint8_t *build_bitmap_directory(Qcow2BitmapInfo *bitmaps,
+                                       int nb_bitmaps, uint64_t *psize)
+{
+    uint64_t size = 0, pos = 0;
+    uint8_t *dir;
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        size += dir_entry_size(strlen(bitmaps[i].name));
+    }
+
+    dir = g_malloc0(size);
+    for (i = 0; i < nb_bitmaps; i++) {
+        size_t name_size = strlen(bitmaps[i].name);
+        Qcow2BitmapDirEntry e = {
+            .data_offset        = cpu_to_be64(bitmaps[i].data_offset),
+            .data_size          = cpu_to_be64(bitmaps[i].data_size),
+            .flags              = cpu_to_be32(bitmaps[i].flags),
+            .granularity_bits   = bitmaps[i].granularity_bits,
+            .name_size          = cpu_to_be16(name_size),
+        };
+
+        memcpy(dir + pos, &e, sizeof(e));
+        memcpy(dir + pos + sizeof(e), bitmaps[i].name, name_size);
+        pos += dir_entry_size(name_size);
+    }
+
+    *psize = size;
+    return dir;
+}
+
+/*
+ * Replaces the bitmap directory with the persistent dirty bitmaps of @bs.
+ * With @in_use, only the directory is written and the entries are marked
+ * in use; otherwise the bitmap data is written too.  The clusters of the
+ * old directory are freed once the header points to the new one.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_bitmaps(BlockDriverState *bs, bool in_use)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapInfo *old_bitmaps, *bitmaps = NULL;
+    int nb_old_bitmaps, nb_bitmaps = 0, i, ret;
+    uint64_t old_dir_offset, old_dir_size, old_autoclear_features;
+    uint32_t old_nb_bitmaps;
+    uint64_t dir_size = 0;
+    int64_t dir_offset = 0;
+    uint8_t *dir = NULL;
+    Error *local_err = NULL;
+
+    if (s->qcow_version < 3) {
+        return bdrv_has_persistent_dirty_bitmaps(bs) ? -ENOTSUP : 0;
+    }
+
+    /* If the old directory cannot be read, leak its clusters rather than
+     * fail to store the bitmaps */
+    nb_old_bitmaps = qcow2_read_bitmap_directory(bs, &old_bitmaps,
+                                                 &local_err);
+    if (nb_old_bitmaps < 0) {
+        error_report_err(local_err);
+        nb_old_bitmaps = 0;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        Qcow2BitmapInfo *info;
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            continue;
+        }
+        assert(name);
+        if (strlen(name) > QCOW_MAX_BITMAP_NAME_SIZE ||
+            nb_bitmaps == QCOW_MAX_BITMAPS) {
+            error_report("qcow2: cannot store dirty bitmap '%s'", name);
+            continue;
+        }
+
+        bitmaps = g_renew(Qcow2BitmapInfo, bitmaps, nb_bitmaps + 1);
+        info = &bitmaps[nb_bitmaps++];
+        *info = (Qcow2BitmapInfo) {
+            .name               = g_strdup(name),
+            .granularity_bits   =
+                ctz32(bdrv_dirty_bitmap_granularity(bitmap)),
+        };
+        if (bdrv_dirty_bitmap_status(bitmap) != DIRTY_BITMAP_STATUS_DISABLED) {
+            info->flags |= BME_FLAG_ENABLED;
+        }
+
+        if (in_use) {
+            info->flags |= BME_FLAG_IN_USE;
+        } else {
+            ret = write_bitmap_data(bs, bitmap, info);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    if (!nb_bitmaps && !s->nb_bitmaps) {
+        ret = 0;
+        goto out;
+    }
+
+    if (nb_bitmaps) {
+        dir = build_bitmap_directory(bitmaps, nb_bitmaps, &dir_size);
+        dir_offset = qcow2_alloc_clusters(bs, dir_size);
+        if (dir_offset < 0) {
+            ret = dir_offset;
+            dir_offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The new clusters must be allocated and written before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    old_nb_bitmaps = s->nb_bitmaps;
+    old_dir_offset = s->bitmap_directory_offset;
+    old_dir_size = s->bitmap_directory_size;
+    old_autoclear_features = s->autoclear_features;
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        goto fail;
+    }
+    s->bitmaps_in_use = in_use && nb_bitmaps;
+
+    for (i = 0; i < nb_old_bitmaps; i++) {
+        if (old_bitmaps[i].data_size) {
+            qcow2_free_clusters(bs, old_bitmaps[i].data_offset,
+                                old_bitmaps[i].data_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (old_dir_size) {
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmaps[i].data_size) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size, QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (dir_offset) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+out:
+    g_free(dir);
+    qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    qcow2_free_bitmap_directory(old_bitmaps, nb_old_bitmaps);
+    return ret;
+}
+
+bool qcow2_can_store_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->qcow_version >= 3;
+}
+
+/*
+ * Writes the bitmaps out without marking them in use, so that another
+ * process (e.g. the destination of a migration) can open them.  Nothing is
+ * written again on close unless the bitmaps are still persistent then.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs)
+{
+    int ret;
+
+    if (bs->read_only) {
+        return -EACCES;
+    }
+
+    ret = qcow2_store_bitmaps(bs, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_flush(bs);
+}
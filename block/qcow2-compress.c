@@ -0,0 +1,213 @@
+/*
+ * Cluster compression for the QCOW2 format
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "block/thread-pool.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+/*
+ * Compressed clusters hold either a raw deflate stream (the default), or an
+ * LZ4 block if the image has the compression type header extension.
+ *
+ * Neither format records the size of the compressed data, and the sectors
+ * read for a compressed cluster may contain the start of the next one, so
+ * decompression stops as soon as a full cluster has been produced.
+ */
+
+static ssize_t zlib_compress(uint8_t *dest, size_t dest_size,
+                             const uint8_t *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = strm.next_out - dest;
+    } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+        ret = -ENOSPC;
+    } else {
+        ret = -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static int zlib_decompress(uint8_t *dest, size_t dest_size,
+                           const uint8_t *src, size_t src_size)
+{
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+        strm.next_out - dest != dest_size) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_LZ4
+
+static ssize_t lz4_compress(uint8_t *dest, size_t dest_size,
+                            const uint8_t *src, size_t src_size)
+{
+    int ret;
+
+    ret = LZ4_compress_default((const char *)src, (char *)dest,
+                               src_size, dest_size);
+    return ret > 0 ? ret : -ENOSPC;
+}
+
+static int lz4_decompress(uint8_t *dest, size_t dest_size,
+                          const uint8_t *src, size_t src_size)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe_partial((const char *)src, (char *)dest,
+                                      src_size, dest_size, dest_size);
+    return ret == dest_size ? 0 : -EIO;
+}
+
+#else
+
+static ssize_t lz4_compress(uint8_t *dest, size_t dest_size,
+                            const uint8_t *src, size_t src_size)
+{
+    return qcow2_lz4_compress(dest, dest_size, src, src_size);
+}
+
+static int lz4_decompress(uint8_t *dest, size_t dest_size,
+                          const uint8_t *src, size_t src_size)
+{
+    return qcow2_lz4_decompress(dest, dest_size, src, src_size);
+}
+
+#endif /* CONFIG_LZ4 */
+
+/*
+ * Compress @src into @dest.  Returns the compressed size, -ENOSPC if the
+ * result does not fit into @dest_size bytes, or another negative errno.
+ */
+ssize_t qcow2_compress(int compression_type, void *dest, size_t dest_size,
+                       const void *src, size_t src_size)
+{
+    switch (compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return zlib_compress(dest, dest_size, src, src_size);
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return lz4_compress(dest, dest_size, src, src_size);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+/*
+ * Decompress exactly @dest_size bytes into @dest.  @src_size may be larger
+ * than the compressed data.  Returns 0 on success, -EIO if @src is corrupt.
+ */
+int qcow2_decompress(int compression_type, void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    switch (compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return zlib_decompress(dest, dest_size, src, src_size);
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return lz4_decompress(dest, dest_size, src, src_size);
+    default:
+        return -ENOTSUP;
+    }
+}
+
+typedef struct Qcow2CompressData {
+    int compression_type;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->compression_type, data->dest,
+                               data->dest_size, data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * Like qcow2_compress(), but runs in a worker thread so that several
+ * clusters can be compressed at the same time.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .compression_type = s->compression_type,
+        .dest = dest,
+        .dest_size = dest_size,
+        .src = src,
+        .src_size = src_size,
+    };
+
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    return data.ret;
+}
@@ -0,0 +1,201 @@
+/*
+ * Built-in LZ4 block codec for the QCOW2 format
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/qcow2.h"
+
+/*
+ * Built-in implementation of the LZ4 block format, for hosts without
+ * liblz4.  It produces streams that liblz4 can decode and vice versa,
+ * with a somewhat lower compression ratio than the library.
+ */
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5   /* the block ends with at least 5 literals */
+#define LZ4_MF_LIMIT        12  /* and no match starts in the last 12 bytes */
+#define LZ4_HASH_BITS       12
+#define LZ4_MAX_DISTANCE    65535
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Write the extra bytes of a literal or match length of at least 15 */
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Emit a sequence of @lit literals from @anchor followed by a match of
+ * @mlen bytes at distance @offset, or by nothing if @offset is 0.  Returns
+ * NULL if it does not fit before @oend. */
+static uint8_t *lz4_put_sequence(uint8_t *op, uint8_t *oend,
+                                 const uint8_t *anchor, size_t lit,
+                                 size_t mlen, size_t offset)
+{
+    size_t need = 1 + lit + (lit >= 15 ? lit / 255 + 1 : 0);
+
+    if (offset) {
+        mlen -= LZ4_MIN_MATCH;
+        need += 2 + (mlen >= 15 ? mlen / 255 + 1 : 0);
+    }
+    if (need > oend - op) {
+        return NULL;
+    }
+
+    *op++ = (MIN(lit, 15) << 4) | (offset ? MIN(mlen, 15) : 0);
+    if (lit >= 15) {
+        op = lz4_put_length(op, lit);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (offset) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        if (mlen >= 15) {
+            op = lz4_put_length(op, mlen);
+        }
+    }
+    return op;
+}
+
+ssize_t qcow2_lz4_compress(uint8_t *dest, size_t dest_size,
+                           const uint8_t *src, size_t src_size)
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + src_size;
+    const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+    uint8_t *op = dest, *oend = dest + dest_size;
+
+    memset(table, 0, sizeof(table));
+    while (src_size > LZ4_MF_LIMIT && ip <= mflimit) {
+        uint32_t seq = lz4_read32(ip);
+        uint32_t h = lz4_hash(seq);
+        const uint8_t *ref = src + table[h];
+        const uint8_t *mend;
+
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+            lz4_read32(ref) != seq) {
+            /* Skip faster through data that does not compress */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        for (mend = ip + LZ4_MIN_MATCH, ref += LZ4_MIN_MATCH;
+             mend < matchlimit && *mend == *ref; mend++, ref++) {
+            /* extend the match */
+        }
+
+        op = lz4_put_sequence(op, oend, anchor, ip - anchor, mend - ip,
+                              mend - ref);
+        if (!op) {
+            return -ENOSPC;
+        }
+        ip = anchor = mend;
+    }
+
+    op = lz4_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (!op) {
+        return -ENOSPC;
+    }
+    return op - dest;
+}
+
+int qcow2_lz4_decompress(uint8_t *dest, size_t dest_size,
+                         const uint8_t *src, size_t src_size)
+{
+    const uint8_t *ip = src, *iend = src + src_size;
+    uint8_t *op = dest, *oend = dest + dest_size;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15, offset;
+        uint8_t b;
+
+        if (lit == 15) {
+            do {
+                if (ip == iend) {
+                    return -EIO;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op) {
+            return -EIO;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (op == oend) {
+            return 0;
+        }
+
+        if (iend - ip < 2) {
+            return -EIO;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dest) {
+            return -EIO;
+        }
+        if (mlen == 15) {
+            do {
+                if (ip == iend) {
+                    return -EIO;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > oend - op) {
+            return -EIO;
+        }
+        /* The match may overlap the bytes it produces: copy one by one */
+        for (; mlen; mlen--, op++) {
+            *op = op[-offset];
+        }
+        if (op == oend) {
+            return 0;
+        }
+    }
+    return -EIO;
+}
@@ -916,6 +916,97 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates nb_clusters contiguous clusters for guest data.
+ *
+ * Allocating a cluster means updating its refcount, which is the expensive
+ * part of the allocation path that all allocating writes go through under
+ * s->lock.  While other allocating writes are in flight, clusters are
+ * therefore reserved in chunks of ALLOC_RESERVE_SIZE: the refcounts of the
+ * whole chunk are updated at once, and the following requests are served
+ * from the reservation without touching any refcount block.
+ *
+ * With no concurrent allocations, clusters are allocated one request at a
+ * time as before, so that the image layout of sequential writes doesn't
+ * change.  Reserved clusters are returned by qcow2_release_alloc_reserve();
+ * should QEMU crash before that, they are merely leaked.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = nb_clusters << s->cluster_bits;
+    uint64_t reserve_size;
+    int64_t offset;
+
+    if (s->alloc_reserve_end - s->alloc_reserve_offset >= size) {
+        offset = s->alloc_reserve_offset;
+        s->alloc_reserve_offset += size;
+        return offset;
+    }
+
+    if (QLIST_EMPTY(&s->cluster_allocs)) {
+        return qcow2_alloc_clusters(bs, size);
+    }
+
+    /* Start a new reservation; what is left of the old one is too small */
+    qcow2_release_alloc_reserve(bs);
+
+    reserve_size = MAX(size, ROUND_UP(ALLOC_RESERVE_SIZE, s->cluster_size));
+    offset = qcow2_alloc_clusters(bs, reserve_size);
+    if (offset < 0) {
+        /* Maybe there is still room for the request itself */
+        return qcow2_alloc_clusters(bs, size);
+    }
+
+    s->alloc_reserve_offset = offset + size;
+    s->alloc_reserve_end = offset + reserve_size;
+    return offset;
+}
+
+/*
+ * Like qcow2_alloc_clusters_at(), but also takes clusters from the
+ * reservation of qcow2_alloc_data_clusters() if it starts at offset, so
+ * that the allocation of a request can be extended contiguously.
+ */
+int64_t qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                                     int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t reserved;
+
+    if (offset == s->alloc_reserve_offset &&
+        s->alloc_reserve_end > s->alloc_reserve_offset)
+    {
+        reserved = (s->alloc_reserve_end - s->alloc_reserve_offset)
+                   >> s->cluster_bits;
+        nb_clusters = MIN(nb_clusters, reserved);
+        s->alloc_reserve_offset += nb_clusters << s->cluster_bits;
+        return nb_clusters;
+    }
+
+    return qcow2_alloc_clusters_at(bs, offset, nb_clusters);
+}
+
+/*
+ * Frees the clusters that qcow2_alloc_data_clusters() reserved, but that
+ * haven't been used yet.  Must be called before anything that expects all
+ * allocated clusters to be referenced, like checking the image or closing it.
+ */
+void qcow2_release_alloc_reserve(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->alloc_reserve_offset;
+    uint64_t end = s->alloc_reserve_end;
+
+    s->alloc_reserve_offset = 0;
+    s->alloc_reserve_end = 0;
+
+    if (end > offset) {
+        /* Nothing was written to these clusters, no need to discard them */
+        qcow2_free_clusters(bs, offset, end - offset, QCOW2_DISCARD_NEVER);
+    }
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1051,11 +1142,14 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors;
+    unsigned slice, slice_size2, n_slices;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
     l2_table = NULL;
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1099,93 +1193,98 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, abs(addend), addend < 0,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
+
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s, offset &
+                                                       L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                    "Data cluster offset %#llx unaligned "
+                                    "(L2 offset: %#" PRIx64 ", L2 index: %#x)",
+                                    offset & L2E_OFFSET_MASK, l2_offset,
+                                    slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, abs(addend), addend < 0,
-                                    QCOW2_DISCARD_SNAPSHOT);
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                ret = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, abs(addend), addend < 0,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+
+                            ret = qcow2_get_refcount(bs, cluster_index,
+                                                     &refcount);
                             if (ret < 0) {
                                 goto fail;
                             }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1785,6 +1884,38 @@ resize_fail:
     return 0;
 }
 
+/*
+ * Increases the refcount for the bitmap directory and the bitmap data that
+ * it references.
+ */
+static int check_refcounts_bitmaps(BlockDriverState *bs, BdrvCheckResult *res,
+                                   void **refcount_table,
+                                   int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapInfo *bitmaps;
+    Error *local_err = NULL;
+    int nb_bitmaps, i, ret;
+
+    nb_bitmaps = qcow2_read_bitmap_directory(bs, &bitmaps, &local_err);
+    if (nb_bitmaps < 0) {
+        fprintf(stderr, "ERROR: %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                        s->bitmap_directory_offset, s->bitmap_directory_size);
+    for (i = 0; ret >= 0 && i < nb_bitmaps; i++) {
+        ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                            bitmaps[i].data_offset, bitmaps[i].data_size);
+    }
+
+    qcow2_free_bitmap_directory(bitmaps, nb_bitmaps);
+    return ret;
+}
+
 /*
  * Calculates an in-memory refcount table.
  */
@@ -1836,6 +1967,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* persistent dirty bitmaps */
+    ret = check_refcounts_bitmaps(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
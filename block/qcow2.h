@@ -52,6 +52,11 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Persistent dirty bitmaps; bitmap names are at most 1023 bytes long */
+#define QCOW_MAX_BITMAPS 65535
+#define QCOW_MAX_BITMAP_NAME_SIZE 1023
+#define QCOW_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -63,7 +68,7 @@
 #define MAX_CLUSTER_BITS 21
 
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -76,6 +81,9 @@
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
+/* Clusters reserved at once for concurrent allocating writes */
+#define ALLOC_RESERVE_SIZE 8388608 /* bytes */
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 
@@ -95,6 +103,7 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
 
@@ -170,6 +179,18 @@ typedef struct Qcow2UnknownHeaderExtension {
     uint8_t data[];
 } Qcow2UnknownHeaderExtension;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
+typedef struct Qcow2CompressionHeaderExt {
+    uint8_t compression_type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionHeaderExt;
+
 enum {
     QCOW2_FEAT_TYPE_INCOMPATIBLE    = 0,
     QCOW2_FEAT_TYPE_COMPATIBLE      = 1,
@@ -180,11 +201,20 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_COMPRESSION,
+};
+
+/* Compression types, stored in the compression type header extension */
+enum {
+    QCOW2_COMPRESSION_TYPE_ZLIB = 0,
+    QCOW2_COMPRESSION_TYPE_LZ4  = 1,
 };
 
 /* Compatible feature bits */
@@ -195,6 +225,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -228,6 +266,7 @@ typedef struct BDRVQcow2State {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_size; /* entries per L2 table slice in the L2 cache */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -254,6 +293,11 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Clusters whose refcount was already increased, but that are not used
+     * yet; handed out to allocating writes by qcow2_alloc_data_clusters() */
+    uint64_t alloc_reserve_offset;
+    uint64_t alloc_reserve_end;
+
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
@@ -263,6 +307,19 @@ typedef struct BDRVQcow2State {
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    /* Persistent dirty bitmaps, see qcow2-bitmap.c */
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+    bool bitmaps_in_use; /* the directory entries are marked in use */
+
+    /* Compressed writes are compressed concurrently, but allocate their
+     * clusters in the order of their tickets, see qcow2_co_write_compressed */
+    int compression_type;
+    uint64_t compress_ticket_next;
+    uint64_t compress_ticket_done;
+    CoQueue compress_queue;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -295,6 +352,14 @@ typedef struct BDRVQcow2State {
     char *image_backing_format;
 } BDRVQcow2State;
 
+typedef struct Qcow2BitmapInfo {
+    char *name;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+} Qcow2BitmapInfo;
+
 typedef struct Qcow2COWRegion {
     /**
      * Offset of the COW region in bytes from the start of the first cluster
@@ -429,6 +494,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -510,6 +580,10 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t nb_clusters);
+int64_t qcow2_alloc_data_clusters_at(BlockDriverState *bs, uint64_t offset,
+                                     int64_t nb_clusters);
+void qcow2_release_alloc_reserve(BlockDriverState *bs);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type);
@@ -571,8 +645,33 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_directory(BlockDriverState *bs,
+                                Qcow2BitmapInfo **pbitmaps, Error **errp);
+void qcow2_free_bitmap_directory(Qcow2BitmapInfo *bitmaps, int nb_bitmaps);
+int qcow2_load_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_bitmaps(BlockDriverState *bs, bool in_use);
+bool qcow2_can_store_persistent_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs);
+
+/* qcow2-compress.c functions */
+ssize_t qcow2_compress(int compression_type, void *dest, size_t dest_size,
+                       const void *src, size_t src_size);
+int qcow2_decompress(int compression_type, void *dest, size_t dest_size,
+                     const void *src, size_t src_size);
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+
+/* qcow2-lz4.c functions, used when liblz4 is not available */
+ssize_t qcow2_lz4_compress(uint8_t *dest, size_t dest_size,
+                           const uint8_t *src, size_t src_size);
+int qcow2_lz4_decompress(uint8_t *dest, size_t dest_size,
+                         const uint8_t *src, size_t src_size);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -0,0 +1,1381 @@
+/*
+ * vhost-user switch
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A learning Ethernet switch between guests, entirely in userspace: every
+ * port is a vhost-user socket that one QEMU connects to, e.g.
+ *
+ *   vhost-user-switch -q 2 /tmp/vm0.sock /tmp/vm1.sock
+ *
+ *   qemu ... -chardev socket,id=chr0,path=/tmp/vm0.sock,reconnect=1 \
+ *            -netdev vhost-user,id=net0,chardev=chr0,queues=2 \
+ *            -device virtio-net-pci,netdev=net0,mq=on,vectors=6
+ *
+ * Frames are copied once, straight from the descriptors of the sending
+ * guest into those of the receiving one; there is no intermediate buffer.
+ * Each kick is processed in batches: the used ring index is published and
+ * the guest interrupted once per batch and per queue, and guest kicks are
+ * suppressed while a queue is being drained.  Queue pair N of a port
+ * delivers to queue pair N of the destination, falling back to the first
+ * one if that is not enabled.
+ *
+ * When QEMU goes away the port is reset and waits for the next connection,
+ * so a guest can resume after either side restarts.  Guest memory must be
+ * shared (memory-backend-file with share=on).
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <linux/vhost.h>
+
+#include "qemu/atomic.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define DPRINT(...) \
+    do { \
+        if (vus_verbose) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
+
+static bool vus_verbose;
+
+/* Based on qemu/hw/virtio/vhost-user.c */
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_LOG_PAGE 4096
+
+enum VhostUserProtocolFeature {
+    VHOST_USER_PROTOCOL_F_MQ = 0,
+    VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
+    VHOST_USER_PROTOCOL_F_RARP = 2,
+
+    VHOST_USER_PROTOCOL_F_MAX
+};
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserLog {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} VhostUserLog;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1<<2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1<<8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+        VhostUserLog log;
+    } payload;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num;
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, payload.u64)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+#define VUS_MAX_PORTS           16
+#define VUS_MAX_QUEUE_PAIRS     8
+#define VUS_MAX_VQ              (2 * VUS_MAX_QUEUE_PAIRS)
+#define VUS_DEFAULT_BATCH       32
+#define VUS_MAX_BATCH           256
+#define VUS_MAX_IOV             64
+#define VUS_MAC_TABLE_SIZE      256
+
+/* Every virtqueue that may have unpublished used entries after a batch. */
+#define VUS_MAX_PENDING         (VUS_MAX_PORTS * VUS_MAX_VQ)
+
+typedef struct VusSwitch VusSwitch;
+typedef struct VusPort VusPort;
+
+typedef void (*CallbackFunc)(int sock, void *ctx);
+
+typedef struct Event {
+    void *ctx;
+    CallbackFunc callback;
+} Event;
+
+typedef struct Dispatcher {
+    int max_sock;
+    fd_set fdset;
+    Event events[FD_SETSIZE];
+} Dispatcher;
+
+typedef struct VusVirtq {
+    VusPort *port;
+    int call_fd;
+    int kick_fd;
+    uint32_t size;
+    uint16_t last_avail_index;
+    uint16_t last_used_index;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint64_t log_guest_addr;
+    bool enabled;
+    /* used entries written since used->idx was last published */
+    unsigned pending;
+} VusVirtq;
+
+typedef struct VusRegion {
+    /* Guest Physical address. */
+    uint64_t gpa;
+    /* Memory region size. */
+    uint64_t size;
+    /* QEMU virtual address (userspace). */
+    uint64_t qva;
+    /* Starting offset in our mmaped space. */
+    uint64_t mmap_offset;
+    /* Start address of mmaped space. */
+    uint64_t mmap_addr;
+} VusRegion;
+
+struct VusPort {
+    VusSwitch *sw;
+    int index;
+    const char *path;
+    int listen_sock;
+    int conn_sock;
+    uint32_t nregions;
+    VusRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+    VusVirtq vq[VUS_MAX_VQ];
+    uint64_t features;
+    uint64_t protocol_features;
+    int log_call_fd;
+    uint64_t log_size;
+    uint8_t *log_table;
+    bool log_dirty;
+    uint64_t tx_packets;
+    uint64_t rx_packets;
+    uint64_t rx_dropped;
+};
+
+typedef struct VusMacEntry {
+    uint8_t mac[6];
+    int port;
+} VusMacEntry;
+
+struct VusSwitch {
+    Dispatcher dispatcher;
+    int nports;
+    VusPort ports[VUS_MAX_PORTS];
+    unsigned queue_pairs;
+    unsigned batch;
+    VusMacEntry mac_table[VUS_MAC_TABLE_SIZE];
+    VusVirtq *pending[VUS_MAX_PENDING];
+    int npending;
+};
+
+static void
+vus_die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+static void
+dispatcher_init(Dispatcher *dispr)
+{
+    FD_ZERO(&dispr->fdset);
+    dispr->max_sock = -1;
+}
+
+static int
+dispatcher_add(Dispatcher *dispr, int sock, void *ctx, CallbackFunc cb)
+{
+    if (sock >= FD_SETSIZE) {
+        fprintf(stderr,
+                "Error: Failed to add new event. sock %d should be less than %d\n",
+                sock, FD_SETSIZE);
+        return -1;
+    }
+
+    dispr->events[sock].ctx = ctx;
+    dispr->events[sock].callback = cb;
+
+    FD_SET(sock, &dispr->fdset);
+    if (sock > dispr->max_sock) {
+        dispr->max_sock = sock;
+    }
+    return 0;
+}
+
+static void
+dispatcher_remove(Dispatcher *dispr, int sock)
+{
+    if (sock < 0 || sock >= FD_SETSIZE) {
+        return;
+    }
+    FD_CLR(sock, &dispr->fdset);
+    dispr->events[sock].callback = NULL;
+}
+
+/* timeout in us */
+static void
+dispatcher_wait(Dispatcher *dispr, uint32_t timeout)
+{
+    struct timeval tv;
+    fd_set fdset = dispr->fdset;
+    int sock, rc;
+
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+
+    rc = select(dispr->max_sock + 1, &fdset, 0, 0, &tv);
+    if (rc == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        vus_die("select");
+    }
+
+    /* A callback may remove other sockets, so check that they are still
+     * being watched before calling them. */
+    for (sock = 0; rc > 0 && sock < dispr->max_sock + 1; sock++) {
+        if (FD_ISSET(sock, &fdset)) {
+            Event *e = &dispr->events[sock];
+
+            rc--;
+            if (FD_ISSET(sock, &dispr->fdset) && e->callback) {
+                e->callback(sock, e->ctx);
+            }
+        }
+    }
+}
+
+/* Guest memory */
+
+/* Translate a guest physical range to our virtual address, or NULL if it
+ * is not entirely inside one region.  */
+static void *
+gpa_to_va(VusPort *port, uint64_t guest_addr, uint64_t len)
+{
+    int i;
+
+    for (i = 0; i < port->nregions; i++) {
+        VusRegion *r = &port->regions[i];
+
+        if (guest_addr >= r->gpa && guest_addr - r->gpa < r->size &&
+            len <= r->size - (guest_addr - r->gpa)) {
+            return (void *)(uintptr_t)(guest_addr - r->gpa + r->mmap_addr +
+                                       r->mmap_offset);
+        }
+    }
+    return NULL;
+}
+
+/* Translate qemu virtual address to our virtual address.  */
+static void *
+qva_to_va(VusPort *port, uint64_t qemu_addr)
+{
+    int i;
+
+    for (i = 0; i < port->nregions; i++) {
+        VusRegion *r = &port->regions[i];
+
+        if (qemu_addr >= r->qva && qemu_addr - r->qva < r->size) {
+            return (void *)(uintptr_t)(qemu_addr - r->qva + r->mmap_addr +
+                                       r->mmap_offset);
+        }
+    }
+    return NULL;
+}
+
+static void
+vus_unmap_regions(VusPort *port)
+{
+    int i;
+
+    for (i = 0; i < port->nregions; i++) {
+        VusRegion *r = &port->regions[i];
+
+        munmap((void *)(uintptr_t)r->mmap_addr, r->size + r->mmap_offset);
+    }
+    port->nregions = 0;
+}
+
+/* Dirty logging, for migration */
+
+static void
+vus_log_write(VusPort *port, uint64_t address, uint64_t length)
+{
+    uint64_t page, last;
+
+    if (!(port->features & (1ULL << VHOST_F_LOG_ALL)) ||
+        !port->log_table || !length) {
+        return;
+    }
+
+    page = address / VHOST_LOG_PAGE;
+    last = (address + length - 1) / VHOST_LOG_PAGE;
+    if (last / 8 >= port->log_size) {
+        fprintf(stderr, "port %d: dirty log too small for 0x%" PRIx64 "\n",
+                port->index, address);
+        return;
+    }
+    for (; page <= last; page++) {
+        atomic_or(&port->log_table[page / 8], 1 << (page % 8));
+    }
+    port->log_dirty = true;
+}
+
+static void
+vus_log_kick(VusPort *port)
+{
+    if (port->log_dirty && port->log_call_fd != -1) {
+        eventfd_write(port->log_call_fd, 1);
+    }
+    port->log_dirty = false;
+}
+
+static void
+vus_close_log(VusPort *port)
+{
+    if (port->log_table) {
+        munmap(port->log_table, port->log_size);
+        port->log_table = NULL;
+    }
+    if (port->log_call_fd != -1) {
+        close(port->log_call_fd);
+        port->log_call_fd = -1;
+    }
+}
+
+/* Virtqueues */
+
+static bool
+vus_vq_ready(VusVirtq *vq)
+{
+    return vq->enabled && vq->desc && vq->kick_fd != -1;
+}
+
+/* Map the descriptor chain starting at HEAD, which must be all readable
+ * or all writable according to WRITE.  Returns the number of elements in
+ * IOV, or -1 for a chain we cannot handle.  */
+static int
+vus_map_chain(VusPort *port, VusVirtq *vq, uint16_t head, bool write,
+              struct iovec *iov, uint64_t *gpa, size_t *total)
+{
+    unsigned i = head, n = 0, seen = 0;
+    struct vring_desc *d;
+
+    *total = 0;
+    do {
+        if (i >= vq->size || seen++ >= vq->size || n >= VUS_MAX_IOV) {
+            return -1;
+        }
+        d = &vq->desc[i];
+        if (!!(d->flags & VRING_DESC_F_WRITE) != write ||
+            (d->flags & VRING_DESC_F_INDIRECT)) {
+            return -1;
+        }
+        iov[n].iov_base = gpa_to_va(port, d->addr, d->len);
+        if (!iov[n].iov_base) {
+            return -1;
+        }
+        iov[n].iov_len = d->len;
+        if (gpa) {
+            gpa[n] = d->addr;
+        }
+        *total += d->len;
+        n++;
+
+        i = d->next;
+    } while (d->flags & VRING_DESC_F_NEXT);
+
+    return n;
+}
+
+static void
+vus_vq_add_pending(VusSwitch *sw, VusVirtq *vq)
+{
+    if (vq->pending++ == 0) {
+        assert(sw->npending < VUS_MAX_PENDING);
+        sw->pending[sw->npending++] = vq;
+    }
+}
+
+/* Return the descriptor HEAD to the guest, without publishing it yet.  */
+static void
+vus_vq_push(VusSwitch *sw, VusVirtq *vq, uint16_t head, uint32_t len)
+{
+    uint16_t u_index = vq->last_used_index % vq->size;
+
+    vq->used->ring[u_index].id = head;
+    vq->used->ring[u_index].len = len;
+    vus_log_write(vq->port, vq->log_guest_addr +
+                  offsetof(struct vring_used, ring[u_index]),
+                  sizeof(vq->used->ring[u_index]));
+    vq->last_avail_index++;
+    vq->last_used_index++;
+    vus_vq_add_pending(sw, vq);
+}
+
+/* Publish the used entries of every queue touched by the last batch, and
+ * interrupt each guest at most once per queue.  */
+static void
+vus_flush(VusSwitch *sw)
+{
+    int i;
+
+    for (i = 0; i < sw->npending; i++) {
+        VusVirtq *vq = sw->pending[i];
+
+        atomic_mb_set(&vq->used->idx, vq->last_used_index);
+        vus_log_write(vq->port, vq->log_guest_addr +
+                      offsetof(struct vring_used, idx),
+                      sizeof(vq->used->idx));
+        vq->pending = 0;
+
+        if (!(atomic_mb_read(&vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT)
+            && vq->call_fd != -1) {
+            eventfd_write(vq->call_fd, 1);
+        }
+        vus_log_kick(vq->port);
+    }
+    sw->npending = 0;
+}
+
+static void
+vus_vq_set_notify(VusVirtq *vq, bool enable)
+{
+    if (enable) {
+        vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    } else {
+        vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+    vus_log_write(vq->port, vq->log_guest_addr +
+                  offsetof(struct vring_used, flags),
+                  sizeof(vq->used->flags));
+    smp_mb();
+}
+
+/* Copy BYTES bytes from SRC at offset SOFF to DST at offset DOFF.  Returns
+ * the number of bytes copied, which is less if either side is too short. */
+static size_t
+vus_iov_copy(const struct iovec *dst, int dcnt, size_t doff,
+             const struct iovec *src, int scnt, size_t soff, size_t bytes)
+{
+    int d = 0, s = 0;
+    size_t done = 0;
+
+    while (d < dcnt && doff >= dst[d].iov_len) {
+        doff -= dst[d++].iov_len;
+    }
+    while (s < scnt && soff >= src[s].iov_len) {
+        soff -= src[s++].iov_len;
+    }
+
+    while (done < bytes && d < dcnt && s < scnt) {
+        size_t len = MIN(dst[d].iov_len - doff, src[s].iov_len - soff);
+
+        len = MIN(len, bytes - done);
+        memcpy((uint8_t *)dst[d].iov_base + doff,
+               (uint8_t *)src[s].iov_base + soff, len);
+        done += len;
+        doff += len;
+        soff += len;
+        if (doff == dst[d].iov_len) {
+            d++;
+            doff = 0;
+        }
+        if (soff == src[s].iov_len) {
+            s++;
+            soff = 0;
+        }
+    }
+    return done;
+}
+
+static void
+vus_log_iov(VusPort *port, const struct iovec *iov, const uint64_t *gpa,
+            int cnt, size_t len)
+{
+    int i;
+
+    for (i = 0; i < cnt && len; i++) {
+        size_t l = MIN(len, iov[i].iov_len);
+
+        vus_log_write(port, gpa[i], l);
+        len -= l;
+    }
+}
+
+static size_t
+vus_hdr_len(VusPort *port)
+{
+    if (port->features & ((1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                          (1ULL << VIRTIO_F_VERSION_1))) {
+        return sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    }
+    return sizeof(struct virtio_net_hdr);
+}
+
+/* Switching */
+
+static VusMacEntry *
+vus_mac_lookup(VusSwitch *sw, const uint8_t *mac)
+{
+    unsigned hash = (mac[3] ^ mac[4] * 31 ^ mac[5] * 131) % VUS_MAC_TABLE_SIZE;
+
+    return &sw->mac_table[hash];
+}
+
+static void
+vus_mac_learn(VusSwitch *sw, const uint8_t *mac, int port)
+{
+    VusMacEntry *e;
+
+    if (mac[0] & 1) {
+        return;
+    }
+    e = vus_mac_lookup(sw, mac);
+    if (e->port != port || memcmp(e->mac, mac, 6)) {
+        DPRINT("Learned %02x:%02x:%02x:%02x:%02x:%02x on port %d\n",
+               mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], port);
+        memcpy(e->mac, mac, 6);
+        e->port = port;
+    }
+}
+
+static void
+vus_mac_forget_port(VusSwitch *sw, int port)
+{
+    int i;
+
+    for (i = 0; i < VUS_MAC_TABLE_SIZE; i++) {
+        if (sw->mac_table[i].port == port) {
+            sw->mac_table[i].port = -1;
+        }
+    }
+}
+
+/* Copy one frame (without its virtio-net header) into a receive buffer of
+ * DST, on queue pair QP if possible.  */
+static void
+vus_deliver(VusPort *dst, unsigned qp, const struct iovec *src_iov,
+            int src_cnt, size_t src_off, size_t len)
+{
+    VusSwitch *sw = dst->sw;
+    VusVirtq *vq = &dst->vq[2 * qp];
+    struct virtio_net_hdr_mrg_rxbuf hdr = { .num_buffers = 1 };
+    struct iovec hdr_iov = { .iov_base = &hdr, .iov_len = vus_hdr_len(dst) };
+    struct iovec iov[VUS_MAX_IOV];
+    uint64_t gpa[VUS_MAX_IOV];
+    uint16_t avail_index, head;
+    size_t total;
+    int cnt;
+
+    if (!vus_vq_ready(vq)) {
+        vq = &dst->vq[0];
+        if (!vus_vq_ready(vq)) {
+            dst->rx_dropped++;
+            return;
+        }
+    }
+
+    avail_index = atomic_mb_read(&vq->avail->idx);
+    if (vq->last_avail_index == avail_index) {
+        dst->rx_dropped++;
+        return;
+    }
+    smp_rmb();
+
+    head = vq->avail->ring[vq->last_avail_index % vq->size];
+    cnt = vus_map_chain(dst, vq, head, true, iov, gpa, &total);
+    if (cnt < 0 || total < hdr_iov.iov_len + len) {
+        /* Hand the buffer back empty rather than stalling the queue.  */
+        dst->rx_dropped++;
+        vus_vq_push(sw, vq, head, 0);
+        return;
+    }
+
+    vus_iov_copy(iov, cnt, 0, &hdr_iov, 1, 0, hdr_iov.iov_len);
+    vus_iov_copy(iov, cnt, hdr_iov.iov_len, src_iov, src_cnt, src_off, len);
+    vus_log_iov(dst, iov, gpa, cnt, hdr_iov.iov_len + len);
+
+    dst->rx_packets++;
+    vus_vq_push(sw, vq, head, hdr_iov.iov_len + len);
+}
+
+static void
+vus_forward(VusPort *src, unsigned qp, const struct iovec *iov, int cnt,
+            size_t total)
+{
+    VusSwitch *sw = src->sw;
+    size_t hdr_len = vus_hdr_len(src);
+    struct iovec eth_iov;
+    uint8_t eth[12];
+    VusMacEntry *e;
+    int i;
+
+    eth_iov.iov_base = eth;
+    eth_iov.iov_len = sizeof(eth);
+    if (total < hdr_len + 14 ||
+        vus_iov_copy(&eth_iov, 1, 0, iov, cnt, hdr_len, sizeof(eth)) !=
+        sizeof(eth)) {
+        return;
+    }
+
+    vus_mac_learn(sw, eth + 6, src->index);
+    src->tx_packets++;
+
+    if (!(eth[0] & 1)) {
+        e = vus_mac_lookup(sw, eth);
+        if (e->port >= 0 && !memcmp(e->mac, eth, 6)) {
+            if (e->port != src->index) {
+                vus_deliver(&sw->ports[e->port], qp, iov, cnt, hdr_len,
+                            total - hdr_len);
+            }
+            return;
+        }
+    }
+
+    /* Broadcast, multicast or unknown destination: flood.  */
+    for (i = 0; i < sw->nports; i++) {
+        if (i != src->index && sw->ports[i].conn_sock != -1) {
+            vus_deliver(&sw->ports[i], qp, iov, cnt, hdr_len, total - hdr_len);
+        }
+    }
+}
+
+/* Drain a transmit queue, one batch at a time.  */
+static void
+vus_process_tx(VusPort *port, VusVirtq *vq)
+{
+    VusSwitch *sw = port->sw;
+    unsigned qp = (vq - port->vq) / 2;
+    struct iovec iov[VUS_MAX_IOV];
+
+    if (!vus_vq_ready(vq)) {
+        return;
+    }
+
+    vus_vq_set_notify(vq, false);
+    for (;;) {
+        unsigned n = 0;
+
+        while (n < sw->batch &&
+               vq->last_avail_index != atomic_mb_read(&vq->avail->idx)) {
+            uint16_t head;
+            size_t total;
+            int cnt;
+
+            smp_rmb();
+            head = vq->avail->ring[vq->last_avail_index % vq->size];
+            cnt = vus_map_chain(port, vq, head, false, iov, NULL, &total);
+            if (cnt > 0) {
+                vus_forward(port, qp, iov, cnt, total);
+            }
+            vus_vq_push(sw, vq, head, 0);
+            n++;
+        }
+        vus_flush(sw);
+
+        if (n < sw->batch) {
+            /* Empty: re-enable kicks, then look once more for buffers
+             * that were added before the guest saw the flag.  */
+            vus_vq_set_notify(vq, true);
+            if (vq->last_avail_index == atomic_mb_read(&vq->avail->idx)) {
+                break;
+            }
+            vus_vq_set_notify(vq, false);
+        }
+    }
+}
+
+static void
+vus_kick_cb(int sock, void *ctx)
+{
+    VusVirtq *vq = ctx;
+    eventfd_t kick_data;
+
+    if (eventfd_read(sock, &kick_data) == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        vus_die("eventfd_read()");
+    }
+    vus_process_tx(vq->port, vq);
+}
+
+static void
+vus_vq_stop(VusPort *port, VusVirtq *vq)
+{
+    if (vq->kick_fd != -1) {
+        dispatcher_remove(&port->sw->dispatcher, vq->kick_fd);
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+    }
+}
+
+static void
+vus_vq_reset(VusPort *port, VusVirtq *vq)
+{
+    vus_vq_stop(port, vq);
+    if (vq->call_fd != -1) {
+        close(vq->call_fd);
+    }
+    *vq = (VusVirtq) {
+        .port = port,
+        .call_fd = -1,
+        .kick_fd = -1,
+    };
+}
+
+/* Forget everything about the guest, and wait for it to come back.  */
+static void
+vus_port_disconnect(VusPort *port)
+{
+    VusSwitch *sw = port->sw;
+    int i;
+
+    printf("port %d: disconnected (tx %" PRIu64 " rx %" PRIu64
+           " dropped %" PRIu64 ")\n", port->index, port->tx_packets,
+           port->rx_packets, port->rx_dropped);
+
+    for (i = 0; i < VUS_MAX_VQ; i++) {
+        vus_vq_reset(port, &port->vq[i]);
+    }
+    vus_unmap_regions(port);
+    vus_close_log(port);
+    vus_mac_forget_port(sw, port->index);
+
+    dispatcher_remove(&sw->dispatcher, port->conn_sock);
+    close(port->conn_sock);
+    port->conn_sock = -1;
+    port->features = 0;
+    port->protocol_features = 0;
+}
+
+/* Protocol */
+
+static bool
+vus_message_read(int conn_fd, VhostUserMsg *vmsg)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))] = { };
+    struct iovec iov = {
+        .iov_base = (char *)vmsg,
+        .iov_len = VHOST_USER_HDR_SIZE,
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    size_t fd_size;
+    ssize_t rc;
+
+    do {
+        rc = recvmsg(conn_fd, &msg, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc != VHOST_USER_HDR_SIZE) {
+        return false;
+    }
+
+    vmsg->fd_num = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_size = cmsg->cmsg_len - CMSG_LEN(0);
+            vmsg->fd_num = fd_size / sizeof(int);
+            memcpy(vmsg->fds, CMSG_DATA(cmsg), fd_size);
+            break;
+        }
+    }
+
+    if (vmsg->size > sizeof(vmsg->payload)) {
+        fprintf(stderr, "Error: too big message request: %d, size: %u\n",
+                vmsg->request, vmsg->size);
+        return false;
+    }
+
+    if (vmsg->size) {
+        size_t done = 0;
+
+        while (done < vmsg->size) {
+            rc = read(conn_fd, (uint8_t *)&vmsg->payload + done,
+                      vmsg->size - done);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc <= 0) {
+                return false;
+            }
+            done += rc;
+        }
+    }
+    return true;
+}
+
+static bool
+vus_message_write(int conn_fd, VhostUserMsg *vmsg)
+{
+    int rc;
+
+    do {
+        rc = write(conn_fd, vmsg, VHOST_USER_HDR_SIZE + vmsg->size);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc == VHOST_USER_HDR_SIZE + vmsg->size;
+}
+
+static void
+vus_close_msg_fds(VhostUserMsg *vmsg)
+{
+    int i;
+
+    for (i = 0; i < vmsg->fd_num; i++) {
+        close(vmsg->fds[i]);
+    }
+    vmsg->fd_num = 0;
+}
+
+/* Returns the vring index of a message, or -1 if it is out of range.  */
+static int
+vus_vring_index(unsigned index)
+{
+    if (index >= VUS_MAX_VQ) {
+        fprintf(stderr, "Error: vring index %u out of range\n", index);
+        return -1;
+    }
+    return index;
+}
+
+static int
+vus_set_mem_table(VusPort *port, VhostUserMsg *vmsg)
+{
+    VhostUserMemory *memory = &vmsg->payload.memory;
+    int i;
+
+    if (memory->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+        memory->nregions != vmsg->fd_num) {
+        return -1;
+    }
+
+    vus_unmap_regions(port);
+    for (i = 0; i < memory->nregions; i++) {
+        VhostUserMemoryRegion *msg_region = &memory->regions[i];
+        VusRegion *r = &port->regions[i];
+        void *mmap_addr;
+
+        r->gpa = msg_region->guest_phys_addr;
+        r->size = msg_region->memory_size;
+        r->qva = msg_region->userspace_addr;
+        r->mmap_offset = msg_region->mmap_offset;
+
+        /* We don't use offset argument of mmap() since the
+         * mapped address has to be page aligned, and we use huge
+         * pages.  */
+        mmap_addr = mmap(0, r->size + r->mmap_offset,
+                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                         vmsg->fds[i], 0);
+        if (mmap_addr == MAP_FAILED) {
+            perror("mmap");
+            port->nregions = i;
+            return -1;
+        }
+        r->mmap_addr = (uint64_t)(uintptr_t)mmap_addr;
+        port->nregions = i + 1;
+    }
+    vus_close_msg_fds(vmsg);
+    return 0;
+}
+
+static int
+vus_set_log_base(VusPort *port, VhostUserMsg *vmsg)
+{
+    void *rc;
+
+    if (vmsg->fd_num != 1 || vmsg->size != sizeof(vmsg->payload.log)) {
+        return -1;
+    }
+
+    if (port->log_table) {
+        munmap(port->log_table, port->log_size);
+        port->log_table = NULL;
+    }
+    rc = mmap(0, vmsg->payload.log.mmap_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED, vmsg->fds[0], vmsg->payload.log.mmap_offset);
+    vus_close_msg_fds(vmsg);
+    if (rc == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    port->log_table = rc;
+    port->log_size = vmsg->payload.log.mmap_size;
+
+    vmsg->size = sizeof(vmsg->payload.u64);
+    /* Reply */
+    return 1;
+}
+
+static int
+vus_set_vring_addr(VusPort *port, VhostUserMsg *vmsg)
+{
+    struct vhost_vring_addr *vra = &vmsg->payload.addr;
+    int index = vus_vring_index(vra->index);
+    VusVirtq *vq;
+
+    if (index < 0) {
+        return -1;
+    }
+    vq = &port->vq[index];
+    vq->desc = qva_to_va(port, vra->desc_user_addr);
+    vq->used = qva_to_va(port, vra->used_user_addr);
+    vq->avail = qva_to_va(port, vra->avail_user_addr);
+    vq->log_guest_addr = vra->log_guest_addr;
+    if (!vq->desc || !vq->used || !vq->avail) {
+        vq->desc = NULL;
+        return -1;
+    }
+
+    vq->last_used_index = vq->used->idx;
+    return 0;
+}
+
+static int
+vus_set_vring_kick(VusPort *port, VhostUserMsg *vmsg)
+{
+    uint64_t u64_arg = vmsg->payload.u64;
+    int index = vus_vring_index(u64_arg & VHOST_USER_VRING_IDX_MASK);
+    VusVirtq *vq;
+
+    if (index < 0 || (u64_arg & VHOST_USER_VRING_NOFD_MASK) ||
+        vmsg->fd_num != 1) {
+        /* Polling mode is not supported.  */
+        return -1;
+    }
+    vq = &port->vq[index];
+
+    vus_vq_stop(port, vq);
+    vq->kick_fd = vmsg->fds[0];
+    vmsg->fd_num = 0;
+
+    /* Without protocol features, rings are enabled as soon as they are
+     * started.  */
+    if (!(port->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        vq->enabled = true;
+    }
+
+    if (index % 2 == 1) {
+        /* TX queue. */
+        if (dispatcher_add(&port->sw->dispatcher, vq->kick_fd, vq,
+                           vus_kick_cb) < 0) {
+            return -1;
+        }
+        /* Buffers may have been queued while nobody was listening.  */
+        vus_process_tx(port, vq);
+    }
+    return 0;
+}
+
+static int
+vus_execute_request(VusPort *port, VhostUserMsg *vmsg)
+{
+    VusSwitch *sw = port->sw;
+    int index;
+
+    DPRINT("port %d: request %d size %u fds %d\n", port->index,
+           vmsg->request, vmsg->size, vmsg->fd_num);
+
+    switch (vmsg->request) {
+    case VHOST_USER_GET_FEATURES:
+        vmsg->payload.u64 =
+            (1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+            (1ULL << VIRTIO_F_ANY_LAYOUT) |
+            (1ULL << VHOST_F_LOG_ALL) |
+            (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        if (sw->queue_pairs > 1) {
+            vmsg->payload.u64 |= 1ULL << VIRTIO_NET_F_MQ;
+        }
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return 1;
+
+    case VHOST_USER_SET_FEATURES:
+        port->features = vmsg->payload.u64;
+        return 0;
+
+    case VHOST_USER_SET_OWNER:
+        return 0;
+
+    case VHOST_USER_RESET_OWNER:
+        for (index = 0; index < VUS_MAX_VQ; index++) {
+            vus_vq_reset(port, &port->vq[index]);
+        }
+        vus_close_log(port);
+        port->features = 0;
+        return 0;
+
+    case VHOST_USER_SET_MEM_TABLE:
+        return vus_set_mem_table(port, vmsg);
+
+    case VHOST_USER_SET_LOG_BASE:
+        return vus_set_log_base(port, vmsg);
+
+    case VHOST_USER_SET_LOG_FD:
+        if (vmsg->fd_num != 1) {
+            return -1;
+        }
+        if (port->log_call_fd != -1) {
+            close(port->log_call_fd);
+        }
+        port->log_call_fd = vmsg->fds[0];
+        vmsg->fd_num = 0;
+        return 0;
+
+    case VHOST_USER_SET_VRING_NUM:
+        index = vus_vring_index(vmsg->payload.state.index);
+        if (index < 0 || !vmsg->payload.state.num ||
+            vmsg->payload.state.num > 32768) {
+            return -1;
+        }
+        port->vq[index].size = vmsg->payload.state.num;
+        return 0;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        return vus_set_vring_addr(port, vmsg);
+
+    case VHOST_USER_SET_VRING_BASE:
+        index = vus_vring_index(vmsg->payload.state.index);
+        if (index < 0) {
+            return -1;
+        }
+        port->vq[index].last_avail_index = vmsg->payload.state.num;
+        return 0;
+
+    case VHOST_USER_GET_VRING_BASE:
+        index = vus_vring_index(vmsg->payload.state.index);
+        if (index < 0) {
+            return -1;
+        }
+        /* This stops the ring.  */
+        vus_vq_stop(port, &port->vq[index]);
+        port->vq[index].enabled = false;
+        vmsg->payload.state.num = port->vq[index].last_avail_index;
+        vmsg->size = sizeof(vmsg->payload.state);
+        return 1;
+
+    case VHOST_USER_SET_VRING_KICK:
+        return vus_set_vring_kick(port, vmsg);
+
+    case VHOST_USER_SET_VRING_CALL:
+        index = vus_vring_index(vmsg->payload.u64 &
+                                VHOST_USER_VRING_IDX_MASK);
+        if (index < 0) {
+            return -1;
+        }
+        if (port->vq[index].call_fd != -1) {
+            close(port->vq[index].call_fd);
+            port->vq[index].call_fd = -1;
+        }
+        if (!(vmsg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+            if (vmsg->fd_num != 1) {
+                return -1;
+            }
+            port->vq[index].call_fd = vmsg->fds[0];
+            vmsg->fd_num = 0;
+        }
+        return 0;
+
+    case VHOST_USER_SET_VRING_ERR:
+        vus_close_msg_fds(vmsg);
+        return 0;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        vmsg->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) |
+                            (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD);
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return 1;
+
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+        port->protocol_features = vmsg->payload.u64;
+        return 0;
+
+    case VHOST_USER_GET_QUEUE_NUM:
+        vmsg->payload.u64 = sw->queue_pairs;
+        vmsg->size = sizeof(vmsg->payload.u64);
+        return 1;
+
+    case VHOST_USER_SET_VRING_ENABLE:
+        index = vus_vring_index(vmsg->payload.state.index);
+        if (index < 0) {
+            return -1;
+        }
+        port->vq[index].enabled = vmsg->payload.state.num;
+        if (index % 2 == 1 && port->vq[index].enabled) {
+            vus_process_tx(port, &port->vq[index]);
+        }
+        return 0;
+
+    case VHOST_USER_SEND_RARP:
+        /* Guests announce themselves after migration; nothing to do.  */
+        return 0;
+
+    default:
+        fprintf(stderr, "port %d: unknown request %d\n", port->index,
+                vmsg->request);
+        return -1;
+    }
+}
+
+static void
+vus_receive_cb(int sock, void *ctx)
+{
+    VusPort *port = ctx;
+    VhostUserMsg vmsg;
+    int ret;
+
+    if (!vus_message_read(sock, &vmsg)) {
+        vus_port_disconnect(port);
+        return;
+    }
+
+    ret = vus_execute_request(port, &vmsg);
+    vus_close_msg_fds(&vmsg);
+    if (ret < 0) {
+        fprintf(stderr, "port %d: bad request %d, disconnecting\n",
+                port->index, vmsg.request);
+        vus_port_disconnect(port);
+        return;
+    }
+    if (ret > 0) {
+        /* Set the version in the flags when sending the reply */
+        vmsg.flags &= ~VHOST_USER_VERSION_MASK;
+        vmsg.flags |= VHOST_USER_VERSION;
+        vmsg.flags |= VHOST_USER_REPLY_MASK;
+        if (!vus_message_write(sock, &vmsg)) {
+            vus_port_disconnect(port);
+        }
+    }
+}
+
+static void
+vus_accept_cb(int sock, void *ctx)
+{
+    VusPort *port = ctx;
+    int conn_fd;
+
+    conn_fd = accept(sock, NULL, NULL);
+    if (conn_fd == -1) {
+        perror("accept");
+        return;
+    }
+    if (port->conn_sock != -1) {
+        fprintf(stderr, "port %d: already connected, refusing\n",
+                port->index);
+        close(conn_fd);
+        return;
+    }
+    if (dispatcher_add(&port->sw->dispatcher, conn_fd, port,
+                       vus_receive_cb) < 0) {
+        close(conn_fd);
+        return;
+    }
+
+    printf("port %d: connected\n", port->index);
+    port->conn_sock = conn_fd;
+    port->tx_packets = port->rx_packets = port->rx_dropped = 0;
+}
+
+static void
+vus_port_init(VusSwitch *sw, int index, const char *path)
+{
+    VusPort *port = &sw->ports[index];
+    struct sockaddr_un un;
+    int i;
+
+    port->sw = sw;
+    port->index = index;
+    port->path = path;
+    port->conn_sock = -1;
+    port->log_call_fd = -1;
+    for (i = 0; i < VUS_MAX_VQ; i++) {
+        port->vq[i] = (VusVirtq) {
+            .port = port,
+            .call_fd = -1,
+            .kick_fd = -1,
+        };
+    }
+
+    if (strlen(path) >= sizeof(un.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(1);
+    }
+
+    port->listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (port->listen_sock == -1) {
+        vus_die("socket");
+    }
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, path);
+    unlink(path);
+
+    if (bind(port->listen_sock, (struct sockaddr *) &un, sizeof(un)) == -1) {
+        vus_die("bind");
+    }
+    if (listen(port->listen_sock, 1) == -1) {
+        vus_die("listen");
+    }
+    if (dispatcher_add(&sw->dispatcher, port->listen_sock, port,
+                       vus_accept_cb) < 0) {
+        exit(1);
+    }
+
+    printf("port %d: waiting for connections on %s\n", index, path);
+}
+
+static void
+vus_usage(const char *name, int code)
+{
+    fprintf(stderr, "%s [opts] SOCKET...\n", name);
+    fprintf(stderr, "  -h: show this help\n");
+    fprintf(stderr, "  -v: verbose mode\n");
+    fprintf(stderr, "  -q <n>: queue pairs per port (default 1, max %d)\n",
+            VUS_MAX_QUEUE_PAIRS);
+    fprintf(stderr, "  -b <n>: packets per batch (default %d, max %d)\n",
+            VUS_DEFAULT_BATCH, VUS_MAX_BATCH);
+    exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static VusSwitch sw;
+    int c, i;
+
+    sw.queue_pairs = 1;
+    sw.batch = VUS_DEFAULT_BATCH;
+
+    while ((c = getopt(argc, argv, "hvq:b:")) != -1) {
+        switch (c) {
+        case 'h':
+            vus_usage(argv[0], 0);
+            break;
+        case 'v':
+            vus_verbose = true;
+            break;
+        case 'q':
+            sw.queue_pairs = atoi(optarg);
+            if (sw.queue_pairs < 1 || sw.queue_pairs > VUS_MAX_QUEUE_PAIRS) {
+                vus_usage(argv[0], 1);
+            }
+            break;
+        case 'b':
+            sw.batch = atoi(optarg);
+            if (sw.batch < 1 || sw.batch > VUS_MAX_BATCH) {
+                vus_usage(argv[0], 1);
+            }
+            break;
+        default:
+            vus_usage(argv[0], 1);
+        }
+    }
+
+    sw.nports = argc - optind;
+    if (sw.nports < 1 || sw.nports > VUS_MAX_PORTS) {
+        vus_usage(argv[0], 1);
+    }
+
+    for (i = 0; i < VUS_MAC_TABLE_SIZE; i++) {
+        sw.mac_table[i].port = -1;
+    }
+
+    /* A guest going away must not take the switch with it.  */
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    dispatcher_init(&sw.dispatcher);
+    for (i = 0; i < sw.nports; i++) {
+        vus_port_init(&sw, i, argv[optind + i]);
+    }
+
+    while (1) {
+        /* timeout 200ms */
+        dispatcher_wait(&sw.dispatcher, 200000);
+    }
+    return 0;
+}
@@ -25,6 +25,13 @@
 bool exit_request;
 CPUState *tcg_current_cpu;
 
+/* -accel tcg,thread=multi: one host thread per vCPU */
+bool mttcg_enabled;
+/* set once more than one vCPU thread may run translated code */
+bool parallel_cpus;
+/* -accel tcg,trace-threshold=N */
+int tb_trace_threshold;
+
 /* exit the current TB from a signal handler. The host registers are
    restored in a state compatible with the CPU emulator
  */
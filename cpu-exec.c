@@ -26,6 +26,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
 #include "hw/i386/apic.h"
@@ -207,55 +208,114 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     tb_free(tb);
 }
 
-static TranslationBlock *tb_find_physical(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint64_t flags)
+/* Execute a single instruction with no other vCPU running, after the
+ * translator bailed out with EXCP_ATOMIC.  The one-shot TB is generated
+ * with parallel_cpus cleared, so that plain loads and stores can be used
+ * to emulate the atomic operation.
+ */
+void cpu_exec_step_atomic(CPUState *cpu)
 {
+    CPUClass *cc = CPU_GET_CLASS(cpu);
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb) {
-            return NULL;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    current_cpu = cpu;
+    rcu_read_lock();
+    cc->cpu_exec_enter(cpu);
+
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+
+        tb_lock();
+        parallel_cpus = false;
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 1 | CF_NOCACHE);
+        parallel_cpus = true;
+        tb->orig_tb = NULL;
+        tb_unlock();
+
+        /* execute the generated code */
+        trace_exec_tb_nocache(tb, tb->pc);
+        cpu->current_tb = tb;
+        cpu_tb_exec(cpu, tb->tc_ptr);
+        cpu->current_tb = NULL;
+
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* The instruction faulted or the translation had to be aborted.
+         * Any exception is delivered by the next cpu_exec().
+         */
+        parallel_cpus = true;
+        cpu->can_do_io = 1;
+        tb_lock_reset();
+        if (qemu_mutex_iothread_locked()) {
+            qemu_mutex_unlock_iothread();
         }
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    break;
-                }
-            } else {
-                break;
+    }
+
+    cc->cpu_exec_exit(cpu);
+    rcu_read_unlock();
+    current_cpu = NULL;
+}
+
+struct tb_desc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+};
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const struct tb_desc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        !atomic_read(&tb->invalid)) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
+    return false;
+}
 
-    /* Move the TB to the head of the list */
-    *ptb1 = tb->phys_hash_next;
-    tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    return tb;
+/* Lock-free; must be called within an RCU read-side critical section,
+   which cpu_exec() provides.  */
+static TranslationBlock *tb_find_physical(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
+{
+    tb_page_addr_t phys_pc;
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = (CPUArchState *)cpu->env_ptr;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.pc = pc;
+    phys_pc = get_page_addr_code(desc.env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
 static TranslationBlock *tb_find_slow(CPUState *cpu,
@@ -270,32 +330,29 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
         goto found;
     }
 
-#ifdef CONFIG_USER_ONLY
     /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
+     * taken outside tb_lock.  Since the lookup above took no lock,
+     * there's a chance that our desired tb has been translated in
+     * the meantime by another thread.
      */
-    tb_unlock();
+#ifdef CONFIG_USER_ONLY
     mmap_lock();
+#endif
     tb_lock();
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    if (!tb) {
+        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+        /* if no translated code available, then translate it now */
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
+    tb_unlock();
 #ifdef CONFIG_USER_ONLY
     mmap_unlock();
 #endif
 
 found:
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
@@ -310,7 +367,7 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
@@ -318,6 +375,39 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
     return tb;
 }
 
+/* Replace a hot TB with a trace that follows its direct jumps.  */
+static TranslationBlock *tb_gen_trace(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    TranslationBlock *trace = NULL;
+
+#ifdef CONFIG_USER_ONLY
+    mmap_lock();
+#endif
+    tb_lock();
+    if (!tb->invalid) {
+        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+        trace = tb_gen_code(cpu, pc, tb->cs_base, tb->flags,
+                            (tb->cflags & (CF_COUNT_MASK | CF_IGNORE_ICOUNT))
+                            | CF_TRACE);
+        if (!tcg_ctx.tb_ctx.tb_invalidated_flag) {
+            /* tb is still alive; the trace replaces it in the hash table */
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    tb_unlock();
+#ifdef CONFIG_USER_ONLY
+    mmap_unlock();
+#endif
+
+    if (!trace) {
+        /* someone else got there first */
+        trace = tb_find_slow(cpu, pc, tb->cs_base, tb->flags);
+    }
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], trace);
+    return trace;
+}
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -354,8 +444,14 @@ int cpu_exec(CPUState *cpu)
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
+            if (qemu_tcg_mttcg_enabled()) {
+                qemu_mutex_lock_iothread();
+            }
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            if (qemu_tcg_mttcg_enabled()) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -408,8 +504,14 @@ int cpu_exec(CPUState *cpu)
                     break;
 #else
                     if (replay_exception()) {
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_lock_iothread();
+                        }
                         cc->do_interrupt(cpu);
                         cpu->exception_index = -1;
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_unlock_iothread();
+                        }
                     } else if (!replay_has_interrupt()) {
                         /* give a chance to iothread in replay mode */
                         ret = EXCP_INTERRUPT;
@@ -429,6 +531,14 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* Interrupt delivery touches device state; with
+                     * multi-threaded TCG we run without the BQL, so
+                     * take it here.  The cpu_loop_exit paths below
+                     * release it after the longjmp.
+                     */
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_lock_iothread();
+                    }
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -481,6 +591,9 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_unlock_iothread();
+                    }
                 }
                 if (unlikely(cpu->exit_request
                              || replay_has_interrupt())) {
@@ -488,16 +601,11 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                tb_lock();
                 tb = tb_find_fast(cpu);
-                /* Note: we do it here to avoid a gcc bug on Mac OS X when
-                   doing it in tb_find_slow */
-                if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
-                    /* as some TB could have been invalidated because
-                       of memory exceptions while generating the code, we
-                       must recompute the hash index here */
+                if (unlikely((tb->cflags & CF_TRACE_JUMP)
+                             && atomic_read(&tb->hot_count) < 0)) {
+                    tb = tb_gen_trace(cpu, tb);
                     next_tb = 0;
-                    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
                 }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
@@ -508,10 +616,20 @@ int cpu_exec(CPUState *cpu)
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1
                     && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb =
+                        (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+
+                    tb_lock();
+                    /* Some TB could have been invalidated, or the buffer
+                       flushed, because of memory exceptions while
+                       generating the code; next_tb may then be stale.  */
+                    if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
+                        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+                    } else if (!last_tb->invalid && !tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                tb_unlock();
                 if (likely(!cpu->exit_request)) {
                     trace_exec_tb(tb, tb->pc);
                     tc_ptr = tb->tc_ptr;
@@ -590,6 +708,11 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            /* With multi-threaded TCG cpu_exec() runs without the BQL;
+               release it if we longjmp'ed out of a locked section.  */
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
         }
     } /* for(;;) */
 
@@ -43,6 +43,8 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "cpu.h"
+#include "tcg.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -880,18 +882,104 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Exclusive sections for multi-threaded TCG, protected by the BQL.
+ * pending_cpus counts the thread that requested the section plus the
+ * vCPUs it is still waiting for to leave cpu_exec().
+ */
+static QemuCond qemu_exclusive_cond;
+static QemuCond qemu_exclusive_resume;
+static int pending_cpus;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
+    qemu_cond_init(&qemu_exclusive_resume);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+/* Wait for pending exclusive operations to complete.  The BQL must be
+ * held.
+ */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
+    }
+}
+
+/* Start an exclusive operation: kick every vCPU that is inside cpu_exec()
+ * and wait until all of them have left it.  Must be called with the BQL
+ * held, from outside cpu_exec().
+ */
+static void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    exclusive_idle();
+
+    pending_cpus = 1;
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            qemu_cpu_kick(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&qemu_exclusive_resume);
+}
+
+/* Wait for exclusive operations to finish, and mark the vCPU as running
+ * translated code.
+ */
+static void tcg_cpu_exec_start(CPUState *cpu)
+{
+    exclusive_idle();
+    cpu->running = true;
+}
+
+/* Mark the vCPU as not running, and release pending exclusive ops.  */
+static void tcg_cpu_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&qemu_exclusive_cond);
+        }
+    }
+}
+
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+
+    qemu_cpu_kick(cpu);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -904,19 +992,9 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
+    wi.exclusive = false;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
-
-    qemu_cpu_kick(cpu);
+    queue_work_on_cpu(cpu, &wi);
     while (!atomic_mb_read(&wi.done)) {
         CPUState *self_cpu = current_cpu;
 
@@ -939,18 +1017,21 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->data = data;
     wi->free = true;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
-    }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+    queue_work_on_cpu(cpu, wi);
+}
 
-    qemu_cpu_kick(cpu);
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+
+    queue_work_on_cpu(cpu, wi);
 }
 
 static void flush_queued_work(CPUState *cpu)
@@ -969,7 +1050,13 @@ static void flush_queued_work(CPUState *cpu)
             cpu->queued_work_last = NULL;
         }
         qemu_mutex_unlock(&cpu->work_mutex);
-        wi->func(wi->data);
+        if (wi->exclusive) {
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
         qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
@@ -1103,9 +1190,23 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+static void qemu_tcg_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void tcg_exec_all(void);
 
-static void *qemu_tcg_cpu_thread_fn(void *arg)
+/* Single-threaded TCG
+ *
+ * In the single-threaded case each vCPU is simulated in turn.  The
+ * thread runs with the BQL held, except while waiting for work.
+ */
+static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
@@ -1150,6 +1251,64 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUState *cpu);
+
+/* Multi-threaded TCG
+ *
+ * In the multi-threaded case each vCPU has its own thread, and runs
+ * translated code without the BQL.  cpu_exec() takes the BQL itself
+ * around interrupt delivery and device accesses.
+ */
+static void *qemu_tcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            tcg_cpu_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu);
+            qemu_mutex_lock_iothread();
+            tcg_cpu_exec_end(cpu);
+
+            switch (r) {
+            case EXCP_DEBUG:
+                cpu_handle_guest_debug(cpu);
+                break;
+            case EXCP_ATOMIC:
+                /* Emulate the instruction with all other vCPUs stopped,
+                 * so that its loads and stores are atomic.
+                 */
+                start_exclusive();
+                qemu_mutex_unlock_iothread();
+                cpu_exec_step_atomic(cpu);
+                qemu_mutex_lock_iothread();
+                end_exclusive();
+                break;
+            default:
+                break;
+            }
+        }
+
+        qemu_tcg_mttcg_wait_io_event(cpu);
+        current_cpu = cpu;
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1185,7 +1344,9 @@ static void qemu_cpu_kick_no_halt(void)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (tcg_enabled()) {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        cpu_exit(cpu);
+    } else if (tcg_enabled()) {
         qemu_cpu_kick_no_halt();
     } else {
         qemu_cpu_kick_thread(cpu);
@@ -1219,9 +1380,10 @@ void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
-     * TCG code execution.
+     * TCG code execution.  Multi-threaded TCG vCPUs only hold the BQL
+     * for short periods, so they need no kick either.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
@@ -1267,7 +1429,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1301,6 +1463,53 @@ void resume_all_vcpus(void)
     }
 }
 
+/* Multi-threaded TCG needs the front-end to emulate guest atomics and
+ * barriers safely, the back-end to patch direct jumps atomically, and
+ * the host memory model to be at least as strong as the guest's.
+ */
+static bool check_tcg_mttcg_supported(void)
+{
+#if !defined(TARGET_SUPPORTS_MTTCG) || !defined(TCG_TARGET_SUPPORTS_MTTCG)
+    return false;
+#elif defined(TARGET_STRONG_MO) && !defined(TCG_TARGET_STRONG_MO)
+    return false;
+#else
+    return true;
+#endif
+}
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = opts ? qemu_opt_get(opts, "thread") : NULL;
+    uint64_t threshold;
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else if (strcmp(t, "multi") == 0) {
+        if (!check_tcg_mttcg_supported()) {
+            error_setg(errp, "multi-threaded TCG is not supported for this "
+                       "guest on this host");
+        } else if (use_icount) {
+            error_setg(errp, "multi-threaded TCG is incompatible with icount");
+        } else if (replay_mode != REPLAY_MODE_NONE) {
+            error_setg(errp, "multi-threaded TCG is incompatible with "
+                       "record/replay");
+        } else {
+            mttcg_enabled = true;
+        }
+    } else {
+        error_setg(errp, "invalid 'thread' setting %s", t);
+    }
+
+    threshold = opts ? qemu_opt_get_number(opts, "trace-threshold", 0) : 0;
+    if (threshold > INT32_MAX) {
+        error_setg(errp, "invalid 'trace-threshold' setting %" PRIu64,
+                   threshold);
+    } else {
+        tb_trace_threshold = threshold;
+    }
+}
+
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
@@ -1312,23 +1521,36 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    /* share a single thread for all cpus with TCG, unless multi-threaded
+       TCG gives each its own */
+    if (qemu_tcg_mttcg_enabled() || !tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
-        tcg_halt_cond = cpu->halt_cond;
         snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
                  cpu->cpu_index);
-        qemu_thread_create(cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
-                           cpu, QEMU_THREAD_JOINABLE);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* Hotplugged vCPUs may join later, so decide from max_cpus
+               before any code is translated.  */
+            parallel_cpus = max_cpus > 1;
+            qemu_thread_create(cpu->thread, thread_name,
+                               qemu_tcg_cpu_thread_fn,
+                               cpu, QEMU_THREAD_JOINABLE);
+        } else {
+            tcg_halt_cond = cpu->halt_cond;
+            qemu_thread_create(cpu->thread, thread_name,
+                               qemu_tcg_rr_cpu_thread_fn,
+                               cpu, QEMU_THREAD_JOINABLE);
+        }
 #ifdef _WIN32
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
             qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
         }
-        tcg_cpu_thread = cpu->thread;
+        if (!qemu_tcg_mttcg_enabled()) {
+            tcg_cpu_thread = cpu->thread;
+        }
     } else {
         cpu->thread = tcg_cpu_thread;
         cpu->halt_cond = tcg_halt_cond;
@@ -29,6 +29,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "tcg/tcg.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -36,6 +37,44 @@
 /* statistics */
 int tlb_flush_count;
 
+/* Resizes the victim TLB of mmu_idx, which has just been flushed, for the
+ * use it got since the previous flush.  It is doubled when it was refilled
+ * several times over and a good part of the evicted entries were hit
+ * again, and halved when it saw few refills, e.g. because of frequent
+ * flushes.  Entries above CPU_VTLB_ENTRIES() are never looked at, so the
+ * victim TLB must be empty here, and entries that are brought into use are
+ * invalidated first.
+ */
+static void tlb_resize_vtlb(CPUArchState *env, int mmu_idx)
+{
+    uint32_t hits = env->vtlb_window_hits[mmu_idx];
+    uint32_t fills = env->vtlb_window_fills[mmu_idx];
+    uint32_t size = CPU_VTLB_ENTRIES(env, mmu_idx);
+
+    if (fills >= 2 * size && hits >= fills / 8 &&
+        env->vtlb_order[mmu_idx] < CPU_VTLB_MAX_ORDER) {
+        env->vtlb_order[mmu_idx]++;
+        memset(&env->tlb_v_table[mmu_idx][size], -1,
+               size * sizeof(CPUTLBEntry));
+    } else if (fills < size / 2 && env->vtlb_order[mmu_idx] > 0) {
+        env->vtlb_order[mmu_idx]--;
+    }
+    env->vtlb_window_hits[mmu_idx] = 0;
+    env->vtlb_window_fills[mmu_idx] = 0;
+}
+
+static void tlb_flush_mmuidx_tables(CPUArchState *env, int mmu_idx)
+{
+    /* nothing to clear if no entry was filled since the last flush */
+    if (!(env->tlb_clean_mmuidx & (1 << mmu_idx))) {
+        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+        memset(env->tlb_v_table[mmu_idx], -1,
+               CPU_VTLB_ENTRIES(env, mmu_idx) * sizeof(CPUTLBEntry));
+        env->tlb_clean_mmuidx |= 1 << mmu_idx;
+    }
+    tlb_resize_vtlb(env, mmu_idx);
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -48,9 +87,10 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
@@ -59,8 +99,9 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_mmuidx_tables(env, mmu_idx);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
     env->vtlb_index = 0;
@@ -69,9 +110,60 @@ void tlb_flush(CPUState *cpu, int flush_global)
     tlb_flush_count++;
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+/* With multi-threaded TCG a vCPU's TLB may only be modified by its own
+ * thread.  Flushes requested by other threads are queued as work for
+ * the target vCPU, which runs them before it executes any more code.
+ */
+static inline bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+typedef struct TLBFlushWork {
+    CPUState *cpu;
+    target_ulong addr;
+    uint16_t idxmap;
+} TLBFlushWork;
+
+static void tlb_flush_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_nocheck(work->cpu);
+    g_free(work);
+}
+
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushWork *work = g_new0(TLBFlushWork, 1);
+
+        work->cpu = cpu;
+        async_run_on_cpu(cpu, tlb_flush_async_work, work);
+    } else {
+        tlb_flush_nocheck(cpu);
+    }
+}
+
+static uint16_t v_tlb_mmuidx_bitmap(va_list argp)
+{
+    uint16_t idxmap = 0;
+
+    for (;;) {
+        int mmu_idx = va_arg(argp, int);
+
+        if (mmu_idx < 0) {
+            break;
+        }
+        idxmap |= 1 << mmu_idx;
+    }
+    return idxmap;
+}
+
+static void tlb_flush_by_mmuidx_nocheck(CPUState *cpu, uint16_t idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_by_mmuidx:");
@@ -80,19 +172,16 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
         }
 
 #if defined(DEBUG_TLB)
         printf(" %d", mmu_idx);
 #endif
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_mmuidx_tables(env, mmu_idx);
     }
 
 #if defined(DEBUG_TLB)
@@ -102,12 +191,37 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 }
 
+static void tlb_flush_by_mmuidx_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_by_mmuidx_nocheck(work->cpu, work->idxmap);
+    g_free(work);
+}
+
+static void tlb_flush_by_mmuidx_bitmap(CPUState *cpu, uint16_t idxmap)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushWork *work = g_new0(TLBFlushWork, 1);
+
+        work->cpu = cpu;
+        work->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_by_mmuidx_async_work, work);
+    } else {
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+    }
+}
+
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    uint16_t idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = v_tlb_mmuidx_bitmap(argp);
     va_end(argp);
+
+    tlb_flush_by_mmuidx_bitmap(cpu, idxmap);
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -122,7 +236,7 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
     int i;
@@ -138,7 +252,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -154,7 +268,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < CPU_VTLB_ENTRIES(env, mmu_idx); k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
@@ -162,13 +276,32 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     tb_flush_jmp_cache(cpu, addr);
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+static void tlb_flush_page_async_work(void *data)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
+    TLBFlushWork *work = data;
 
-    va_start(argp, addr);
+    tlb_flush_page_nocheck(work->cpu, work->addr);
+    g_free(work);
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushWork *work = g_new0(TLBFlushWork, 1);
+
+        work->cpu = cpu;
+        work->addr = addr;
+        async_run_on_cpu(cpu, tlb_flush_page_async_work, work);
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
+
+static void tlb_flush_page_by_mmuidx_nocheck(CPUState *cpu, target_ulong addr,
+                                             uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i, k, mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page_by_mmu_idx: " TARGET_FMT_lx, addr);
@@ -180,8 +313,7 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -191,11 +323,9 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
         }
 
 #if defined(DEBUG_TLB)
@@ -205,11 +335,10 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
         /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < CPU_VTLB_ENTRIES(env, mmu_idx); k++) {
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
-    va_end(argp);
 
 #if defined(DEBUG_TLB)
     printf("\n");
@@ -218,6 +347,35 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     tb_flush_jmp_cache(cpu, addr);
 }
 
+static void tlb_flush_page_by_mmuidx_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_page_by_mmuidx_nocheck(work->cpu, work->addr, work->idxmap);
+    g_free(work);
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    va_list argp;
+    uint16_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = v_tlb_mmuidx_bitmap(argp);
+    va_end(argp);
+
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushWork *work = g_new0(TLBFlushWork, 1);
+
+        work->cpu = cpu;
+        work->addr = addr;
+        work->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_page_by_mmuidx_async_work, work);
+    } else {
+        tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+    }
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -246,7 +404,9 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* may be called from another thread under MTTCG */
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -277,7 +437,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
 
-        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        for (i = 0; i < CPU_VTLB_ENTRIES(env, mmu_idx); i++) {
             tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
                                   start1, length);
         }
@@ -307,7 +467,7 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        for (k = 0; k < CPU_VTLB_ENTRIES(env, mmu_idx); k++) {
             tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
         }
     }
@@ -355,7 +515,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     uintptr_t addend;
     CPUTLBEntry *te;
     hwaddr iotlb, xlat, sz;
-    unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+    unsigned vidx = env->vtlb_index++ & (CPU_VTLB_ENTRIES(env, mmu_idx) - 1);
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -390,6 +550,9 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     te = &env->tlb_table[mmu_idx][index];
 
+    env->tlb_clean_mmuidx &= ~(1 << mmu_idx);
+    env->vtlb_window_fills[mmu_idx]++;
+
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
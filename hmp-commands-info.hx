@@ -287,7 +287,7 @@ ETEXI
 STEXI
 @item info jit
 @findex jit
-Show dynamic compiler info.
+Show dynamic compiler info, including TLB and victim TLB statistics.
 ETEXI
 
     {
@@ -39,6 +39,110 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     return err;
 }
 
+/*
+ * Size of a directory entry in a Rreaddir reply: qid (13) + offset (8) +
+ * type (1) + name size (2) + name.  Entries of a 9P2000.u Rread reply on a
+ * directory are always larger.
+ */
+static int32_t v9fs_dirent_size(struct dirent *dent)
+{
+    return 24 + strlen(dent->d_name);
+}
+
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, off_t dir_pos,
+                           int32_t maxsize, bool dostat)
+{
+    V9fsDirEnt *e, **tail = entries;
+    struct dirent *dent, *result;
+    int32_t size = 0;
+    int err = 0;
+
+    dent = g_malloc(sizeof(struct dirent));
+    while (1) {
+        errno = 0;
+        err = s->ops->readdir_r(&s->ctx, &fidp->fs, dent, &result);
+        if (!result) {
+            err = errno ? -errno : 0;
+            break;
+        }
+        if (size + v9fs_dirent_size(dent) > maxsize) {
+            /* Leave the entry for the next request */
+            s->ops->seekdir(&s->ctx, &fidp->fs, dir_pos);
+            break;
+        }
+
+        e = g_new0(V9fsDirEnt, 1);
+        e->dent = g_memdup(dent, sizeof(struct dirent));
+        v9fs_path_init(&e->path);
+        *tail = e;
+        tail = &e->next;
+
+        if (dostat) {
+            err = v9fs_name_to_path(s, &fidp->path, dent->d_name, &e->path);
+            if (!err) {
+                err = s->ops->lstat(&s->ctx, &e->path, &e->st);
+                if (err < 0) {
+                    err = -errno;
+                }
+            }
+            if (err < 0) {
+                break;
+            }
+        }
+        size += v9fs_dirent_size(dent);
+        dir_pos = dent->d_off;
+    }
+    g_free(dent);
+    return err < 0 ? err : size;
+}
+
+/*
+ * Reads directory entries, starting at @dir_pos, until the end of the
+ * directory or until the entries would take more than @maxsize bytes in a
+ * Rreaddir reply.  If @dostat is true, the entries are also lstat()ed.
+ * All of this is done in a single trip to the worker threads.
+ *
+ * The entries are returned in @entries and must be freed with
+ * v9fs_free_dirents(), even on error.  Returns the size of the entries in
+ * a Rreaddir reply or a negative errno.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, off_t dir_pos,
+                         int32_t maxsize, bool dostat)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    if (dostat) {
+        v9fs_path_read_lock(s);
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(s, fidp, entries, dir_pos, maxsize, dostat);
+        });
+    if (dostat) {
+        v9fs_path_unlock(s);
+    }
+    return err;
+}
+
+void v9fs_free_dirents(V9fsDirEnt *e)
+{
+    V9fsDirEnt *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        g_free(e->dent);
+        v9fs_path_free(&e->path);
+        g_free(e);
+    }
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -197,6 +197,17 @@ struct V9fsFidState
     V9fsFidState *rclm_lst;
 };
 
+/*
+ * Directory entries read in a single batch by v9fs_co_readdir_many().
+ * @path and @st are only filled if the entries were stat()ed.
+ */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    V9fsPath path;
+    struct stat st;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 typedef struct V9fsState
 {
     VirtIODevice parent_obj;
@@ -26,6 +26,31 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* One per virtqueue.  Requests popped from a queue are completed on the
+ * same queue.
+ */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+
+    /* Requests are popped in this queue's IOThread but completed in the
+     * device's IOThread, so the vring state is protected by a lock.
+     */
+    QemuMutex vring_lock;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    QEMUBH *bh;                     /* bh for guest notification */
+
+    /* Note that these EventNotifiers are assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on them
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    IOThread *iothread;             /* services host_notifier */
+    AioContext *ctx;
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool started;
     bool starting;
@@ -35,19 +60,15 @@ struct VirtIOBlockDataPlane {
     VirtIOBlkConf *conf;
 
     VirtIODevice *vdev;
-    Vring vring;                    /* virtqueue vring */
-    EventNotifier *guest_notifier;  /* irq */
-    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned int num_queues;
+    VirtIOBlockDataPlaneQueue *queues;
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
+    /* The BlockBackend lives in this IOThread's AioContext; request
+     * completion and guest notification happen there for all queues.
      */
     IOThread *iothread;
     IOThread internal_iothread_obj;
     AioContext *ctx;
-    EventNotifier host_notifier;    /* doorbell */
 
     /* Operation blocker on BDS */
     Error *blocker;
@@ -56,28 +77,35 @@ struct VirtIOBlockDataPlane {
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockDataPlaneQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
-        return;
-    }
+    bool should_notify;
+
+    qemu_mutex_lock(&q->vring_lock);
+    should_notify = vring_should_notify(q->s->vdev, &q->vring);
+    qemu_mutex_unlock(&q->vring_lock);
 
-    event_notifier_set(s->guest_notifier);
+    if (should_notify) {
+        event_notifier_set(q->guest_notifier);
+    }
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneQueue *q = opaque;
 
-    notify_guest(s);
+    notify_guest(q);
 }
 
 static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlockDataPlane *s = req->dev->dataplane;
+    VirtIOBlockDataPlaneQueue *q = &s->queues[virtio_get_queue_index(req->vq)];
     stb_p(&req->in->status, status);
 
-    vring_push(s->vdev, &req->dev->dataplane->vring, &req->elem, req->in_len);
+    qemu_mutex_lock(&q->vring_lock);
+    vring_push(s->vdev, &q->vring, &req->elem, req->in_len);
+    qemu_mutex_unlock(&q->vring_lock);
 
     /* Suppress notification to guest by BH and its scheduled
      * flag because requests are completed as a batch after io
@@ -85,56 +113,149 @@ static void complete_request_vring(VirtIOBlockReq *req, unsigned char status)
      * executed in dataplane aio context even after it is
      * stopped, so needn't worry about notification loss with BH.
      */
-    qemu_bh_schedule(s->bh);
+    qemu_bh_schedule(q->bh);
 }
 
-static void handle_notify(EventNotifier *e)
+/* Pop all available requests from the vring.  Returns them as a list
+ * linked through req->next, and the error that ended the loop in @pret.
+ */
+static VirtIOBlockReq *pop_requests(VirtIOBlockDataPlaneQueue *q, int *pret)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    VirtIOBlockReq *head = NULL, **tail = &head;
+    int ret;
+
+    qemu_mutex_lock(&q->vring_lock);
+
+    /* Disable guest->host notifies to avoid unnecessary vmexits */
+    vring_disable_notification(s->vdev, &q->vring);
 
-    event_notifier_test_and_clear(&s->host_notifier);
-    blk_io_plug(s->conf->conf.blk);
     for (;;) {
-        MultiReqBuffer mrb = {};
-        int ret;
+        VirtIOBlockReq *req = virtio_blk_alloc_request(vblk, q->vq);
 
-        /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        ret = vring_pop(s->vdev, &q->vring, &req->elem);
+        if (ret < 0) {
+            virtio_blk_free_request(req);
+            break; /* no more requests */
+        }
 
-        for (;;) {
-            VirtIOBlockReq *req = virtio_blk_alloc_request(vblk);
+        trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
+                                                    req->elem.in_num,
+                                                    req->elem.index);
+        *tail = req;
+        tail = &req->next;
+    }
+    *tail = NULL;
 
-            ret = vring_pop(s->vdev, &s->vring, &req->elem);
-            if (ret < 0) {
-                virtio_blk_free_request(req);
-                break; /* no more requests */
-            }
+    qemu_mutex_unlock(&q->vring_lock);
 
-            trace_virtio_blk_data_plane_process_request(s, req->elem.out_num,
-                                                        req->elem.in_num,
-                                                        req->elem.index);
+    *pret = ret;
+    return head;
+}
 
-            virtio_blk_handle_request(req, &mrb);
-        }
+static void handle_notify(EventNotifier *e)
+{
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+    VirtIOBlockDataPlane *s = q->s;
+
+    event_notifier_test_and_clear(&q->host_notifier);
+
+    for (;;) {
+        MultiReqBuffer mrb = {};
+        VirtIOBlockReq *req, *next;
+        bool enabled;
+        int ret;
+
+        /* Walking the descriptors only needs this queue's vring, so queues
+         * in different IOThreads do it in parallel.
+         */
+        req = pop_requests(q, &ret);
 
-        if (mrb.num_reqs) {
-            virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
+        /* The BlockBackend lives in the device's AioContext.  Requests are
+         * parsed and submitted with it held, serialized with all other
+         * queues and with completions.
+         */
+        if (req) {
+            aio_context_acquire(s->ctx);
+            blk_io_plug(s->conf->conf.blk);
+            for (; req; req = next) {
+                next = req->next;
+                virtio_blk_handle_request(req, &mrb);
+            }
+            if (mrb.num_reqs) {
+                virtio_blk_submit_multireq(s->conf->conf.blk, &mrb);
+            }
+            blk_io_unplug(s->conf->conf.blk);
+            aio_context_release(s->ctx);
         }
 
         if (likely(ret == -EAGAIN)) { /* vring emptied */
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            qemu_mutex_lock(&q->vring_lock);
+            enabled = vring_enable_notification(s->vdev, &q->vring);
+            qemu_mutex_unlock(&q->vring_lock);
+            if (enabled) {
                 break;
             }
         } else { /* fatal error */
             break;
         }
     }
-    blk_io_unplug(s->conf->conf.blk);
+}
+
+/* Polling callback for the host notifier: process new requests if the
+ * guest has made any available.
+ */
+static bool handle_notify_poll(void *opaque)
+{
+    EventNotifier *e = opaque;
+    VirtIOBlockDataPlaneQueue *q = container_of(e, VirtIOBlockDataPlaneQueue,
+                                                host_notifier);
+
+    if (q->vring.broken || !vring_more_avail(q->s->vdev, &q->vring)) {
+        return false;
+    }
+
+    handle_notify(e);
+    return true;
+}
+
+/* Parse the colon-separated list of IOThread ids in @ids.  Returns the
+ * number of IOThreads, each with a reference taken, or -1 on error.
+ */
+static int parse_queue_iothreads(const char *ids, IOThread ***piothreads,
+                                 Error **errp)
+{
+    char **names = g_strsplit(ids, ":", 0);
+    IOThread **iothreads = g_new0(IOThread *, g_strv_length(names));
+    int i;
+
+    for (i = 0; names[i]; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    names[i]);
+        IOThread *iothread = (IOThread *)object_dynamic_cast(obj,
+                                                             TYPE_IOTHREAD);
+
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", names[i]);
+            while (i--) {
+                object_unref(OBJECT(iothreads[i]));
+            }
+            g_free(iothreads);
+            g_strfreev(names);
+            return -1;
+        }
+        object_ref(OBJECT(iothread));
+        iothreads[i] = iothread;
+    }
+
+    g_strfreev(names);
+    *piothreads = iothreads;
+    return i;
 }
 
 /* Context: QEMU global mutex held */
@@ -146,10 +267,13 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     Error *local_err = NULL;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **queue_iothreads = NULL;
+    int nb_queue_iothreads = 0;
+    unsigned int i;
 
     *dataplane = NULL;
 
-    if (!conf->data_plane && !conf->iothread) {
+    if (!conf->data_plane && !conf->iothread && !conf->queue_iothreads) {
         return;
     }
 
@@ -172,6 +296,14 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    if (conf->queue_iothreads) {
+        nb_queue_iothreads = parse_queue_iothreads(conf->queue_iothreads,
+                                                   &queue_iothreads, errp);
+        if (nb_queue_iothreads < 0) {
+            return;
+        }
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
@@ -179,6 +311,9 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
+    } else if (nb_queue_iothreads) {
+        s->iothread = queue_iothreads[0];
+        object_ref(OBJECT(s->iothread));
     } else {
         /* Create per-device IOThread if none specified.  This is for
          * x-data-plane option compatibility.  If x-data-plane is removed we
@@ -191,7 +326,29 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         s->iothread = &s->internal_iothread_obj;
     }
     s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    /* Queues are dealt out round-robin to the IOThreads in
+     * x-queue-iothreads, or all use the device's IOThread.
+     */
+    s->num_queues = conf->num_queues;
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->vq = virtio_get_queue(vdev, i);
+        qemu_mutex_init(&q->vring_lock);
+        q->bh = aio_bh_new(s->ctx, notify_guest_bh, q);
+        q->iothread = nb_queue_iothreads ?
+                      queue_iothreads[i % nb_queue_iothreads] : s->iothread;
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+    }
+
+    for (i = 0; i < nb_queue_iothreads; i++) {
+        object_unref(OBJECT(queue_iothreads[i]));
+    }
+    g_free(queue_iothreads);
 
     error_setg(&s->blocker, "block device is in use by data plane");
     blk_op_block_all(conf->conf.blk, s->blocker);
@@ -216,6 +373,8 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned int i;
+
     if (!s) {
         return;
     }
@@ -223,7 +382,12 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     virtio_blk_data_plane_stop(s);
     blk_op_unblock_all(s->conf->conf.blk, s->blocker);
     error_free(s->blocker);
-    qemu_bh_delete(s->bh);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_bh_delete(s->queues[i].bh);
+        qemu_mutex_destroy(&s->queues[i].vring_lock);
+        object_unref(OBJECT(s->queues[i].iothread));
+    }
+    g_free(s->queues);
     object_unref(OBJECT(s->iothread));
     g_free(s);
 }
@@ -234,7 +398,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
-    VirtQueue *vq;
+    unsigned int i, n;
     int r;
 
     if (s->started || s->disabled) {
@@ -247,27 +411,38 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     s->starting = true;
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        goto fail_vring;
+    for (n = 0; n < s->num_queues; n++) {
+        if (!vring_setup(&s->queues[n].vring, s->vdev, n)) {
+            goto fail_vring;
+        }
     }
 
-    /* Set up guest notifier (irq) */
-    r = k->set_guest_notifiers(qbus->parent, 1, true);
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, s->num_queues, true);
     if (r != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier (%d), "
                 "ensure -enable-kvm is set\n", r);
         goto fail_guest_notifiers;
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].guest_notifier =
+            virtio_queue_get_guest_notifier(s->queues[i].vq);
+    }
 
     /* Set up virtqueue notify */
-    r = k->set_host_notifier(qbus->parent, 0, true);
-    if (r != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n", r);
-        goto fail_host_notifier;
+    for (i = 0; i < s->num_queues; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier (%d)\n",
+                    r);
+            while (i--) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            goto fail_host_notifier;
+        }
+        s->queues[i].host_notifier =
+            *virtio_queue_get_host_notifier(s->queues[i].vq);
     }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
 
     s->saved_complete_request = vblk->complete_request;
     vblk->complete_request = complete_request_vring;
@@ -278,22 +453,36 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
 
-    /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, true,
-                           handle_notify);
-    aio_context_release(s->ctx);
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(virtio_queue_get_host_notifier(q->vq));
+
+        /* Get this show started by hooking up our callbacks */
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, true,
+                               handle_notify);
+        aio_set_event_notifier_poll(q->ctx, &q->host_notifier,
+                                    handle_notify_poll);
+        aio_context_release(q->ctx);
+    }
     return;
 
   fail_host_notifier:
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
   fail_guest_notifiers:
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->disabled = true;
+    s->starting = false;
+    return;
+
   fail_vring:
+    while (n--) {
+        vring_teardown(&s->queues[n].vring, s->vdev, n);
+    }
     s->starting = false;
 }
 
@@ -303,6 +492,7 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtIOBlock *vblk = VIRTIO_BLK(s->vdev);
+    unsigned int i;
 
 
     /* Better luck next time. */
@@ -317,25 +507,36 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     vblk->complete_request = s->saved_complete_request;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
+    /* Stop notifications for new requests from guest.  Each queue's
+     * AioContext is taken on its own, never together with s->ctx: a
+     * handle_notify() running in that context may be waiting for s->ctx.
+     */
+    for (i = 0; i < s->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-    /* Stop notifications for new requests from guest */
-    aio_set_event_notifier(s->ctx, &s->host_notifier, true, NULL);
+        aio_context_acquire(q->ctx);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, true, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    aio_context_acquire(s->ctx);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
 
-    /* Sync vring state back to virtqueue so that non-dataplane request
-     * processing can continue when we disable the host notifier below.
-     */
-    vring_teardown(&s->vring, s->vdev, 0);
+    for (i = 0; i < s->num_queues; i++) {
+        /* Sync vring state back to virtqueue so that non-dataplane request
+         * processing can continue when we disable the host notifier below.
+         */
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
 
-    k->set_host_notifier(qbus->parent, 0, false);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
     s->started = false;
     s->stopping = false;
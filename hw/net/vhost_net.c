@@ -118,6 +118,11 @@ void vhost_net_ack_features(struct vhost_net *net, uint64_t features)
     vhost_ack_features(&net->dev, vhost_net_get_feature_bits(net), features);
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return net->dev.acked_features;
+}
+
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
     return net->dev.max_queues;
@@ -139,6 +144,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
     int r;
     bool backend_kernel = options->backend_type == VHOST_BACKEND_TYPE_KERNEL;
     struct vhost_net *net = g_malloc(sizeof *net);
+    uint64_t features = 0;
 
     if (!options->net_backend) {
         fprintf(stderr, "vhost-net requires net backend to be setup\n");
@@ -185,9 +191,21 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
             vhost_dev_cleanup(&net->dev);
             goto fail;
         }
+    } else {
+        /* A reconnecting vhost-user backend must accept what the guest
+         * already negotiated with the previous one.
+         */
+        features = vhost_user_get_acked_features(net->nc);
+        if (~net->dev.features & features) {
+            error_report("vhost-user backend lacks feature mask 0x%" PRIx64
+                         " acked by the guest",
+                         (uint64_t)(~net->dev.features & features));
+            vhost_dev_cleanup(&net->dev);
+            goto fail;
+        }
     }
     /* Set sane init value. Override when guest acks. */
-    vhost_net_ack_features(net, 0);
+    vhost_net_ack_features(net, features);
     return net;
 fail:
     g_free(net);
@@ -329,6 +347,15 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         if (r < 0) {
             goto err_start;
         }
+
+        if (ncs[i].peer->vring_enable) {
+            /* restore vring enable state, e.g. after a backend reconnect */
+            r = vhost_set_vring_enable(ncs[i].peer, ncs[i].peer->vring_enable);
+            if (r < 0) {
+                vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
+                goto err_start;
+            }
+        }
     }
 
     return 0;
@@ -424,8 +451,16 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 int vhost_set_vring_enable(NetClientState *nc, int enable)
 {
     VHostNetState *net = get_vhost_net(nc);
-    const VhostOps *vhost_ops = net->dev.vhost_ops;
+    const VhostOps *vhost_ops;
+
+    nc->vring_enable = enable;
+
+    /* The backend may be disconnected; the state is applied on restart. */
+    if (!net) {
+        return 0;
+    }
 
+    vhost_ops = net->dev.vhost_ops;
     if (vhost_ops->vhost_set_vring_enable) {
         return vhost_ops->vhost_set_vring_enable(&net->dev, enable);
     }
@@ -434,6 +469,11 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
 }
 
 #else
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return 0;
+}
+
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
     return 1;
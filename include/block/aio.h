@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -129,6 +130,20 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Adaptive polling, see aio_context_set_poll_params().  poll_ns is the
+     * current polling window, which moves between 0 and poll_max_ns.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Number of blocking aio_poll() calls that were satisfied by polling,
+     * and that had to sleep.
+     */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
 };
 
 /**
@@ -328,6 +343,38 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Set a polling callback on the handler for @fd.  Before aio_poll() blocks,
+ * it may call @io_poll repeatedly instead, for up to the current polling
+ * window.  @io_poll must check for new work without blocking, process it,
+ * and return true if it made progress.
+ *
+ * Polling is only used while every handler that aio_poll() would wait for
+ * has a polling callback.  The callback is removed together with the handler.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Set a polling callback on the handler for @notifier.  Behaves like
+ * aio_set_fd_poll; @io_poll is called with @notifier as its argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling window multiplier when polling would have helped, or 0
+ *        for the default
+ * @shrink: polling window divisor when polling took too long, or 0 to
+ *          stop polling altogether
+ *
+ * Configure adaptive busy polling in aio_poll().  The polling window starts
+ * at 0 and adapts to how long aio_poll() actually had to wait for events.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -36,14 +36,34 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+
+    /* Only for structured reply chunks, whose payload follows the header */
+    bool structured;
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+/* One extent of a block status reply, in host byte order */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;                 /* NBD_STATE_* */
+} NBDExtent;
+
+/* Protocol extensions that a client asks for during negotiation */
+typedef struct NBDExtensions {
+    bool structured_reply;          /* NBD_OPT_STRUCTURED_REPLY */
+    bool base_allocation;           /* "base:allocation" meta context */
+    uint32_t meta_context_id;       /* id of "base:allocation" */
+} NBDExtensions;
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections are safe */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -54,18 +74,42 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Selected meta context. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
+#define NBD_REP_ERR_UNKNOWN     ((UINT32_C(1) << 31) | 6) /* Unknown export. */
+
+#define NBD_REP_IS_ERR(type)    ((type) & (UINT32_C(1) << 31))
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)       /* One block status extent */
+
+/* Structured reply flags and chunk types. */
+#define NBD_REPLY_FLAG_DONE     (1 << 0)        /* Last chunk of the reply */
+
+#define NBD_REPLY_TYPE_NONE             0
+#define NBD_REPLY_TYPE_OFFSET_DATA      1
+#define NBD_REPLY_TYPE_OFFSET_HOLE      2
+#define NBD_REPLY_TYPE_BLOCK_STATUS     5
+#define NBD_REPLY_TYPE_ERROR            ((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET     ((1 << 15) | 2)
+
+#define NBD_REPLY_TYPE_IS_ERR(type)     ((type) & (1 << 15))
+
+/* Block status flags of the "base:allocation" meta context. */
+#define NBD_STATE_HOLE          (1 << 0)        /* Unallocated */
+#define NBD_STATE_ZERO          (1 << 1)        /* Reads as zeroes */
+
+#define NBD_META_CONTEXT_BASE_ALLOCATION "base:allocation"
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
 #define NBD_DEFAULT_PORT	10809
@@ -75,10 +119,11 @@ enum {
 
 ssize_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp);
+                          off_t *size, NBDExtensions *ext, Error **errp);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -57,8 +57,17 @@ typedef uint64_t target_ulong;
 #endif
 
 #if !defined(CONFIG_USER_ONLY)
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/* use a fully associative victim tlb.  Its size for each MMU mode is
+ * adjusted whenever that mode is flushed, between CPU_VTLB_MIN_SIZE and
+ * CPU_VTLB_SIZE entries, depending on how it was used since the last flush.
+ */
+#define CPU_VTLB_MIN_SIZE 8
+#define CPU_VTLB_MAX_ORDER 3
+#define CPU_VTLB_SIZE (CPU_VTLB_MIN_SIZE << CPU_VTLB_MAX_ORDER)
+
+/* number of entries in use in the victim tlb of mmu_idx */
+#define CPU_VTLB_ENTRIES(env, mmu_idx) \
+    (CPU_VTLB_MIN_SIZE << (env)->vtlb_order[mmu_idx])
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -140,6 +149,15 @@ typedef struct CPUIOTLBEntry {
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
     target_ulong vtlb_index;                                            \
+    /* MMU modes without valid entries since their last flush */        \
+    uint16_t tlb_clean_mmuidx;                                          \
+    uint8_t vtlb_order[NB_MMU_MODES];                                   \
+    /* victim tlb use since the last flush, to size it */               \
+    uint32_t vtlb_window_hits[NB_MMU_MODES];                            \
+    uint32_t vtlb_window_fills[NB_MMU_MODES];                           \
+    /* statistics */                                                    \
+    uint64_t vtlb_hit_count;                                            \
+    uint64_t vtlb_miss_count;                                           \
 
 #else
 
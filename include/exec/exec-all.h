@@ -156,8 +156,10 @@ static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* Initial number of TBs the physical hash table is sized for; it grows
+   on demand.  */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -185,16 +187,25 @@ struct TranslationBlock {
                            size <= TARGET_PAGE_SIZE) */
     uint16_t icount;
     uint32_t cflags;    /* compile flags */
+    bool invalid;       /* set once the TB has been invalidated */
+    /* with CF_COUNT_HOT, decremented by the generated code on every
+       execution; the TB is retranslated as a trace once it goes negative,
+       and the generated code stops counting.  Starts out negative if a
+       trace would not follow any jump (no CF_TRACE_JUMP).  */
+    int32_t hot_count;
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_PARALLEL    0x80000 /* Generate code for a parallel context */
+#define CF_COUNT_HOT   0x100000 /* Count executions, see hot_count */
+#define CF_TRACE       0x200000 /* Hot trace spanning several blocks */
+#define CF_TRACE_JUMP  0x400000 /* A trace would follow a jump, set by
+                                   the translator with CF_COUNT_HOT */
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -219,13 +230,17 @@ struct TranslationBlock {
 };
 
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs indexed by tb_hash_func(); lookups are lock-free under RCU,
+       updates are done with tb_lock held.  */
+    struct qht htable;
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
@@ -256,8 +271,9 @@ void ppc_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    stl_le_p((void*)jmp_addr, addr - (jmp_addr + 4));
+    /* patch the branch destination; the displacement is 4-byte aligned
+       by tcg_out_op so that other vCPU threads never see a torn jump */
+    atomic_set((int32_t *)jmp_addr, addr - (jmp_addr + 4));
     /* no need to flush icache explicitly */
 }
 #elif defined(__s390x__)
@@ -405,4 +421,17 @@ extern int singlestep;
 extern CPUState *tcg_current_cpu;
 extern bool exit_request;
 
+/* cpu-exec-common.c: true when TBs may be executed by several vCPU
+ * threads at once, so that translators must emit truly atomic code
+ * (or exit to cpu_exec_step_atomic) for guest atomic operations.
+ */
+extern bool parallel_cpus;
+
+/* cpu-exec-common.c: number of executions after which a TB is
+ * retranslated as a trace (CF_TRACE), or 0 if traces are disabled.
+ */
+extern int tb_trace_threshold;
+
+void cpu_exec_step_atomic(CPUState *cpu);
+
 #endif
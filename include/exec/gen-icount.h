@@ -21,6 +21,29 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_COUNT_HOT) {
+        /* Leave through exitreq_label once the TB gets hot; cpu_exec
+           then retranslates it as a trace.  Once the counter is negative
+           it is left alone.  It is not updated atomically, it only needs
+           to be approximate.  */
+        TCGLabel *hot_label = gen_new_label();
+        TCGv_i32 hot = tcg_temp_local_new_i32();
+        TCGv_ptr ptr;
+
+        ptr = tcg_const_ptr(&tb->hot_count);
+        tcg_gen_ld_i32(hot, ptr, 0);
+        tcg_temp_free_ptr(ptr);
+        tcg_gen_brcondi_i32(TCG_COND_LT, hot, 0, hot_label);
+
+        ptr = tcg_const_ptr(&tb->hot_count);
+        tcg_gen_subi_i32(hot, hot, 1);
+        tcg_gen_st_i32(hot, ptr, 0);
+        tcg_temp_free_ptr(ptr);
+        tcg_gen_brcondi_i32(TCG_COND_LT, hot, 0, exitreq_label);
+        gen_set_label(hot_label);
+        tcg_temp_free_i32(hot);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
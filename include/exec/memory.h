@@ -239,6 +239,8 @@ struct AddressSpace {
 
     /* Accessed via RCU.  */
     struct FlatView *current_map;
+    /* The region current_map was rendered from */
+    MemoryRegion *flat_root;
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
@@ -20,6 +20,8 @@
 #ifndef EXEC_TB_HASH
 #define EXEC_TB_HASH
 
+#include "qemu/bitops.h"
+
 /* Only the bottom TB_JMP_PAGE_BITS of the jump cache hash bits vary for
    addresses on the same page.  The top bits are the same.  This allows
    TLB invalidation to quickly clear a subset of the hash table.  */
@@ -43,9 +45,53 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
            | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* xxHash32 (http://cyan4973.github.io/xxHash/) unrolled for the fixed
+   32-byte key of a TB, which is cheap to compute and spreads the
+   physical hash table well even when many TBs share a page.  */
+#define TB_HASH_PRIME32_1 2654435761U
+#define TB_HASH_PRIME32_2 2246822519U
+#define TB_HASH_PRIME32_3 3266489917U
+#define TB_HASH_SEED               1
+
+static inline uint32_t tb_hash_round(uint32_t v, uint32_t input)
+{
+    v += input * TB_HASH_PRIME32_2;
+    v = rol32(v, 13);
+    return v * TB_HASH_PRIME32_1;
+}
+
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t a = phys_pc;
+    uint64_t b = pc;
+    uint64_t c = cs_base;
+    uint32_t v1 = TB_HASH_SEED + TB_HASH_PRIME32_1 + TB_HASH_PRIME32_2;
+    uint32_t v2 = TB_HASH_SEED + TB_HASH_PRIME32_2;
+    uint32_t v3 = TB_HASH_SEED + 0;
+    uint32_t v4 = TB_HASH_SEED - TB_HASH_PRIME32_1;
+    uint32_t h32;
+
+    v1 = tb_hash_round(v1, a);
+    v2 = tb_hash_round(v2, a >> 32);
+    v3 = tb_hash_round(v3, b);
+    v4 = tb_hash_round(v4, b >> 32);
+
+    v1 = tb_hash_round(v1, flags);
+    v2 = tb_hash_round(v2, flags >> 32);
+    v3 = tb_hash_round(v3, c);
+    v4 = tb_hash_round(v4, c >> 32);
+
+    h32 = rol32(v1, 1) + rol32(v2, 7) + rol32(v3, 12) + rol32(v4, 18);
+    h32 += 32;
+
+    h32 ^= h32 >> 15;
+    h32 *= TB_HASH_PRIME32_2;
+    h32 ^= h32 >> 13;
+    h32 *= TB_HASH_PRIME32_3;
+    h32 ^= h32 >> 16;
+
+    return h32;
 }
 
 #endif
@@ -60,7 +60,9 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet, it replaces the page of its set that
+ * was used the least in the last bitmap generations.
  *
  * Returns -1 when the page isn't inserted into cache
  *
@@ -347,6 +347,7 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool exclusive;
 };
 
 
@@ -492,6 +493,11 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
             && ((uintptr_t) buf) % sizeof(VECTYPE) == 0);
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+bool test_buffer_find_nonzero_offset_next_accel(void);
+const char *buffer_find_nonzero_offset_accel(void);
+#ifdef CONFIG_AVX2_OPT
+bool host_cpu_has_avx2(void);
+#endif
 
 /*
  * helper to parse debug environment variables
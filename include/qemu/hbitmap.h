@@ -87,6 +87,36 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size);
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b);
 
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the number of bytes hbitmap_serialize() produces for @hb.  The
+ * serialized form is the bottom level of the bitmap, one bit per group
+ * of 2^granularity elements, in little-endian 64-bit words.  It does not
+ * depend on the host, so it can be stored or migrated.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb);
+
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size(@hb) bytes.
+ *
+ * Store the contents of @hb into @buf.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer of hbitmap_serialization_size(@hb) bytes.
+ *
+ * Replace the contents of @hb with the bitmap serialized in @buf, which
+ * must come from a bitmap with the same size and granularity.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf);
+
 /**
  * hbitmap_empty:
  * @hb: HBitmap to operate on.
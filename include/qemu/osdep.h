@@ -293,7 +293,28 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz);
+#define MEM_PREALLOC_MAX_THREADS 16
+
+/**
+ * MemPreallocParams:
+ * @threads: number of threads touching the memory, 0 to use one per
+ * host CPU, up to MEM_PREALLOC_MAX_THREADS
+ * @thread_init: if not NULL, called by each thread with its index before
+ * it touches any memory, e.g. to set its CPU affinity
+ * @progress: if not NULL, called by the caller's thread about once a
+ * second with the number of bytes preallocated so far, and once more when
+ * preallocation is done
+ * @opaque: passed to @thread_init and @progress
+ */
+typedef struct MemPreallocParams {
+    int threads;
+    void (*thread_init)(int index, void *opaque);
+    void (*progress)(uint64_t done, uint64_t total, void *opaque);
+    void *opaque;
+} MemPreallocParams;
+
+void os_mem_prealloc(int fd, char *area, size_t sz,
+                     const MemPreallocParams *params);
 
 int qemu_read_password(char *buf, int buf_size);
 
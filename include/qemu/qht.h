@@ -0,0 +1,159 @@
+/*
+ * QHT: a resizable, RCU-protected hash table with lock-free lookups
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "qemu/thread.h"
+
+struct qht {
+    struct qht_map *map;
+    QemuMutex lock; /* serializes resizes and slow-path insertions */
+    unsigned int mode;
+};
+
+/**
+ * struct qht_stats - statistics of a QHT
+ * @head_buckets: number of head buckets
+ * @used_head_buckets: number of non-empty head buckets
+ * @entries: total number of entries
+ * @max_chain: length (in buckets) of the longest bucket chain
+ * @chain_buckets: number of buckets in non-empty chains, used together
+ *                 with @used_head_buckets to get the average chain length
+ */
+struct qht_stats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    size_t max_chain;
+    size_t chain_buckets;
+};
+
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t h,
+                                void *up);
+
+#define QHT_MODE_AUTO_RESIZE 0x1 /* grow the table when chains get long */
+
+/**
+ * qht_init:
+ * @ht: the hash table to be initialized
+ * @n_elems: number of entries the table is expected to hold
+ * @mode: bitmask of QHT_MODE_* flags
+ *
+ * The table is sized for @n_elems entries; with QHT_MODE_AUTO_RESIZE it
+ * doubles in size whenever too many overflow buckets are in use.
+ */
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: the hash table to be destroyed
+ *
+ * The entries themselves are not freed.  The caller must make sure no
+ * other thread is accessing @ht.
+ */
+void qht_destroy(struct qht *ht);
+
+/**
+ * qht_insert:
+ * @ht: the hash table
+ * @p: pointer to be inserted, must not be NULL
+ * @hash: hash of @p
+ *
+ * Attempting to insert a NULL pointer is a bug.  Inserting the same
+ * pointer twice with the same @hash is not allowed.
+ *
+ * Returns true on success, false if @p was already in @ht.
+ */
+bool qht_insert(struct qht *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: the hash table
+ * @func: comparison function, called on every entry whose hash is @hash
+ * @userp: pointer passed to @func
+ * @hash: hash of the entry being looked up
+ *
+ * Lookups take no locks; they must be called from within an RCU read-side
+ * critical section.  The returned entry may be concurrently removed by
+ * another thread, but it stays valid until the end of the critical section.
+ *
+ * Returns the first entry for which @func returns true, or NULL.
+ */
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: the hash table
+ * @p: pointer to be removed
+ * @hash: hash of @p
+ *
+ * The caller is responsible for freeing @p only after an RCU grace
+ * period, since concurrent lookups may still be looking at it.
+ *
+ * Returns true if @p was found and removed, false otherwise.
+ */
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: the hash table
+ *
+ * Remove all entries from @ht without changing its size.  As with
+ * qht_remove, the entries must not be freed before a grace period.
+ */
+void qht_reset(struct qht *ht);
+
+/**
+ * qht_reset_size:
+ * @ht: the hash table
+ * @n_elems: number of entries the table is expected to hold
+ *
+ * Like qht_reset, but also resize the table for @n_elems entries.
+ *
+ * Returns true if the table was resized.
+ */
+bool qht_reset_size(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_resize:
+ * @ht: the hash table
+ * @n_elems: number of entries the table is expected to hold
+ *
+ * Returns true if the table was resized.
+ */
+bool qht_resize(struct qht *ht, size_t n_elems);
+
+/**
+ * qht_iter:
+ * @ht: the hash table
+ * @func: function called for every entry
+ * @userp: pointer passed to @func
+ *
+ * Inserts and removals are blocked while @func runs, so @func must not
+ * modify @ht itself.
+ */
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
+
+/**
+ * qht_statistics:
+ * @ht: the hash table
+ * @stats: filled with a snapshot of the statistics of @ht
+ *
+ * This takes no locks; the result is approximate when @ht is being
+ * modified concurrently.
+ */
+void qht_statistics(struct qht *ht, struct qht_stats *stats);
+
+#endif /* QEMU_QHT_H */
@@ -58,6 +58,42 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+typedef struct QemuSpin {
+    int value;
+} QemuSpin;
+
+/* Test-and-test-and-set spinlock, for very short critical sections
+ * where sleeping on a mutex would cost more than the wait itself.
+ */
+static inline void qemu_spin_init(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
+static inline void qemu_spin_lock(QemuSpin *spin)
+{
+    while (__builtin_expect(__sync_lock_test_and_set(&spin->value, 1), 0)) {
+        while (*(volatile int *)&spin->value) {
+            /* spin */
+        }
+    }
+}
+
+static inline int qemu_spin_trylock(QemuSpin *spin)
+{
+    return __sync_lock_test_and_set(&spin->value, 1);
+}
+
+static inline bool qemu_spin_locked(QemuSpin *spin)
+{
+    return *(volatile int *)&spin->value;
+}
+
+static inline void qemu_spin_unlock(QemuSpin *spin)
+{
+    __sync_lock_release(&spin->value);
+}
+
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
 void qemu_thread_atexit_remove(struct Notifier *notifier);
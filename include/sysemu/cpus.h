@@ -14,6 +14,8 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
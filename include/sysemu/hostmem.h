@@ -47,6 +47,8 @@ struct HostMemoryBackendClass {
  * @size: amount of memory backend provides
  * @id: unique identification string in memdev namespace
  * @mr: MemoryRegion representing host memory belonging to backend
+ * @prealloc_threads: number of threads preallocating memory, 0 for one
+ * per host CPU
  */
 struct HostMemoryBackend {
     /* private */
@@ -56,6 +58,7 @@ struct HostMemoryBackend {
     uint64_t size;
     bool merge, dump;
     bool prealloc, force_prealloc;
+    uint32_t prealloc_threads;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
@@ -33,6 +33,11 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
+/* Regions changed in the current transaction, unless all FlatViews have
+ * to be rendered again.
+ */
+static GHashTable *memory_region_changes;
+static bool memory_region_update_all;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -525,6 +530,22 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+/* Returns the index of the first range in @view that ends after @addr. */
+static unsigned flatview_lower_bound(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (int128_ge(addr, addrrange_end(view->ranges[mid].addr))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -583,7 +604,8 @@ static void render_memory_region(FlatView *view,
     fr.readonly = readonly;
 
     /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    for (i = flatview_lower_bound(view, base);
+         i < view->nr && int128_nz(remain); ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -612,6 +634,87 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Find the region that a FlatView for @mr has to be rendered from.  Aliases
+ * that cover their target entirely, and containers whose only enabled
+ * subregion covers them, render the same as that region.  Looking through
+ * them lets address spaces such as the bus master address spaces of PCI
+ * devices share a single FlatView.
+ *
+ * Returns NULL if the FlatView is empty.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    MemoryRegion *subregion, *next;
+    unsigned found;
+
+    while (mr && mr->enabled) {
+        if (mr->addr || mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            if (mr->alias_offset || mr->alias->addr ||
+                int128_lt(mr->size, mr->alias->size)) {
+                return mr;
+            }
+            mr = mr->alias;
+            continue;
+        }
+        if (mr->terminates) {
+            return mr;
+        }
+
+        found = 0;
+        next = NULL;
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (subregion->enabled) {
+                next = subregion;
+                found++;
+            }
+        }
+        if (!found) {
+            return NULL;
+        }
+        if (found > 1 || next->addr || int128_lt(mr->size, next->size)) {
+            return mr;
+        }
+        mr = next;
+    }
+    return NULL;
+}
+
+/* Returns true if @mr or a region below it changed in the current
+ * transaction.  @visited caches the result for regions that were already
+ * looked at.
+ */
+static bool memory_region_changed(MemoryRegion *mr, GHashTable *visited)
+{
+    MemoryRegion *subregion;
+    gpointer result;
+    bool changed = false;
+
+    if (g_hash_table_lookup_extended(visited, mr, NULL, &result)) {
+        return GPOINTER_TO_INT(result);
+    }
+
+    if (g_hash_table_lookup(memory_region_changes, mr)) {
+        changed = true;
+    } else if (!mr->enabled) {
+        changed = false;
+    } else if (mr->alias) {
+        changed = memory_region_changed(mr->alias, visited);
+    } else {
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (memory_region_changed(subregion, visited)) {
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    g_hash_table_insert(visited, mr, GINT_TO_POINTER(changed));
+    return changed;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -791,14 +894,40 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* @views maps the flat roots rendered in this transaction to their FlatView,
+ * so that address spaces with the same flat root share it.  A FlatView is
+ * only rendered again if something below its root changed.
+ */
+static void address_space_update_topology(AddressSpace *as,
+                                          GHashTable *views,
+                                          GHashTable *visited)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
+    FlatView *new_view;
+
+    new_view = g_hash_table_lookup(views, root);
+    if (!new_view) {
+        if (root == as->flat_root && !memory_region_update_all
+            && (!root || !memory_region_changed(root, visited))) {
+            new_view = old_view;
+            flatview_ref(new_view);
+        } else {
+            new_view = generate_memory_topology(root);
+        }
+        g_hash_table_insert(views, root, new_view);
+    }
+    flatview_ref(new_view);
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
+    if (new_view != old_view) {
+        address_space_update_topology_pass(as, old_view, new_view, false);
+    }
     address_space_update_topology_pass(as, old_view, new_view, true);
 
+    memory_region_ref(root);
+    memory_region_unref(as->flat_root);
+    as->flat_root = root;
+
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
     call_rcu(old_view, flatview_unref, rcu);
@@ -820,27 +949,52 @@ void memory_region_transaction_begin(void)
     ++memory_region_transaction_depth;
 }
 
+/* Record that @mr changed in a way that affects the FlatViews it is in. */
+static void memory_region_mark_changed(MemoryRegion *mr)
+{
+    if (!memory_region_changes) {
+        memory_region_changes = g_hash_table_new(NULL, NULL);
+    }
+    g_hash_table_insert(memory_region_changes, mr, mr);
+    memory_region_update_pending = true;
+}
+
 static void memory_region_clear_pending(void)
 {
     memory_region_update_pending = false;
     ioeventfd_update_pending = false;
+    memory_region_update_all = false;
+    if (memory_region_changes) {
+        g_hash_table_remove_all(memory_region_changes);
+    }
 }
 
 void memory_region_transaction_commit(void)
 {
     AddressSpace *as;
+    GHashTable *views, *visited;
 
     assert(memory_region_transaction_depth);
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            if (!memory_region_changes) {
+                memory_region_changes = g_hash_table_new(NULL, NULL);
+            }
+            views = g_hash_table_new_full(NULL, NULL, NULL,
+                                          (GDestroyNotify)flatview_unref);
+            visited = g_hash_table_new(NULL, NULL);
+
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views, visited);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+
+            g_hash_table_destroy(views);
+            g_hash_table_destroy(visited);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1464,7 +1618,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1513,7 +1669,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1523,7 +1681,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_changed(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1780,7 +1940,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1821,7 +1983,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1832,7 +1996,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_mark_changed(mr);
     memory_region_transaction_commit();
 }
 
@@ -1848,7 +2012,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_mark_changed(mr);
     memory_region_transaction_commit();
 }
 
@@ -1885,7 +2049,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_changed(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2014,6 +2180,7 @@ void memory_global_dirty_log_start(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all = true;
     memory_region_transaction_commit();
 }
 
@@ -2024,6 +2191,7 @@ void memory_global_dirty_log_stop(void)
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
+    memory_region_update_all = true;
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2106,6 +2274,7 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     memory_region_ref(root);
     memory_region_transaction_begin();
     as->root = root;
+    as->flat_root = NULL;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
@@ -2130,6 +2299,7 @@ static void do_address_space_destroy(AddressSpace *as)
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
+    memory_region_unref(as->flat_root);
     memory_region_unref(as->root);
 }
 
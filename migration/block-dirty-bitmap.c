@@ -0,0 +1,330 @@
+/*
+ * Migration of named dirty bitmaps
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * With the dirty-bitmaps capability, every named dirty bitmap is sent to
+ * the destination, where it is created (or overwritten, if it exists) on
+ * the node with the same device or node name.  Bitmaps are small compared
+ * to RAM, so they are only sent once the source is stopped.
+ *
+ * Stream format, after a one-byte flags field:
+ *
+ *   DIRTY_BITMAP_MIG_FLAG_BITMAP:
+ *     be16 + node name, be16 + bitmap name,
+ *     be32 granularity, u8 bitmap flags, be64 data size, data
+ *
+ *   DIRTY_BITMAP_MIG_FLAG_EOS: end of section
+ *
+ * Persistent bitmaps are written to the image on the source at the end,
+ * and handed over to the destination when migration succeeds, so that only
+ * one side writes them back to a shared image.
+ */
+
+#include "qemu-common.h"
+#include "block/block.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "hw/hw.h"
+#include "migration/block.h"
+#include "migration/migration.h"
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS           0x01
+#define DIRTY_BITMAP_MIG_FLAG_BITMAP        0x02
+
+#define DIRTY_BITMAP_MIG_ENABLED            0x01
+#define DIRTY_BITMAP_MIG_PERSISTENT         0x02
+
+typedef struct DirtyBitmapMigState {
+    bool bitmaps_sent;
+    Notifier migration_state;
+} DirtyBitmapMigState;
+
+static DirtyBitmapMigState dirty_bitmap_mig_state;
+
+static void put_string(QEMUFile *f, const char *str)
+{
+    size_t len = strlen(str);
+
+    assert(len <= UINT16_MAX);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, (const uint8_t *)str, len);
+}
+
+static char *get_string(QEMUFile *f)
+{
+    int len = qemu_get_be16(f);
+    char *str = g_malloc(len + 1);
+
+    qemu_get_buffer(f, (uint8_t *)str, len);
+    str[len] = '\0';
+    return str;
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    BlockDriverState *bs = NULL;
+    BdrvDirtyBitmap *bitmap;
+
+    while ((bs = bdrv_next(bs))) {
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+            if (!name) {
+                continue;
+            }
+            if (bdrv_dirty_bitmap_frozen(bitmap)) {
+                error_report("Dirty bitmap '%s' on '%s' is in use by a block "
+                             "job and cannot be migrated", name,
+                             bdrv_get_device_or_node_name(bs));
+                return -EBUSY;
+            }
+            if (strlen(name) > UINT16_MAX) {
+                error_report("Dirty bitmap name '%s' is too long", name);
+                return -EINVAL;
+            }
+        }
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return 0;
+}
+
+static void send_bitmap(QEMUFile *f, BlockDriverState *bs,
+                        BdrvDirtyBitmap *bitmap)
+{
+    uint64_t size = bdrv_dirty_bitmap_serialization_size(bitmap);
+    uint8_t flags = 0;
+    uint8_t *buf;
+
+    if (bdrv_dirty_bitmap_status(bitmap) != DIRTY_BITMAP_STATUS_DISABLED) {
+        flags |= DIRTY_BITMAP_MIG_ENABLED;
+    }
+    if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+        flags |= DIRTY_BITMAP_MIG_PERSISTENT;
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_BITMAP);
+    put_string(f, bdrv_get_device_or_node_name(bs));
+    put_string(f, bdrv_dirty_bitmap_name(bitmap));
+    qemu_put_be32(f, bdrv_dirty_bitmap_granularity(bitmap));
+    qemu_put_byte(f, flags);
+    qemu_put_be64(f, size);
+
+    buf = g_malloc(size);
+    bdrv_dirty_bitmap_serialize(bitmap, buf);
+    qemu_put_buffer(f, buf, size);
+    g_free(buf);
+}
+
+/* Called with iothread lock taken.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    DirtyBitmapMigState *s = opaque;
+    BlockDriverState *bs = NULL;
+    BdrvDirtyBitmap *bitmap;
+    int ret;
+
+    while ((bs = bdrv_next(bs))) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (bdrv_dirty_bitmap_name(bitmap)) {
+                send_bitmap(f, bs, bitmap);
+            }
+        }
+
+        if (bdrv_has_persistent_dirty_bitmaps(bs)) {
+            ret = bdrv_store_persistent_dirty_bitmaps(bs);
+            if (ret < 0) {
+                error_report("Could not store dirty bitmaps of '%s': %s",
+                             bdrv_get_device_or_node_name(bs),
+                             strerror(-ret));
+                aio_context_release(aio_context);
+                return ret;
+            }
+        }
+        aio_context_release(aio_context);
+    }
+
+    qemu_put_byte(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    s->bitmaps_sent = true;
+    return 0;
+}
+
+static int load_bitmap(QEMUFile *f)
+{
+    char *node_name = get_string(f);
+    char *name = get_string(f);
+    uint32_t granularity = qemu_get_be32(f);
+    uint8_t flags = qemu_get_byte(f);
+    uint64_t size = qemu_get_be64(f);
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    AioContext *aio_context = NULL;
+    Error *local_err = NULL;
+    uint8_t *buf;
+    int ret = -EINVAL;
+
+    bs = bdrv_lookup_bs(node_name, node_name, &local_err);
+    if (!bs) {
+        error_report_err(local_err);
+        goto out;
+    }
+
+    if (granularity < BDRV_SECTOR_SIZE || !is_power_of_2(granularity)) {
+        error_report("Invalid granularity %" PRIu32 " for dirty bitmap '%s'",
+                     granularity, name);
+        goto out;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (bitmap && (bdrv_dirty_bitmap_frozen(bitmap) ||
+                   bdrv_dirty_bitmap_granularity(bitmap) != granularity)) {
+        error_report("Dirty bitmap '%s' on '%s' already exists and cannot be "
+                     "overwritten", name, node_name);
+        goto out_release;
+    }
+    if (!bitmap) {
+        bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, &local_err);
+        if (!bitmap) {
+            error_report_err(local_err);
+            goto out_release;
+        }
+    }
+
+    if (size != bdrv_dirty_bitmap_serialization_size(bitmap) ||
+        size > INT_MAX) {
+        error_report("Dirty bitmap '%s' does not match the size of '%s'",
+                     name, node_name);
+        goto out_release;
+    }
+
+    buf = g_malloc(size);
+    qemu_get_buffer(f, buf, size);
+    bdrv_dirty_bitmap_deserialize(bitmap, buf);
+    g_free(buf);
+
+    if (flags & DIRTY_BITMAP_MIG_ENABLED) {
+        bdrv_enable_dirty_bitmap(bitmap);
+    } else {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+
+    if (flags & DIRTY_BITMAP_MIG_PERSISTENT) {
+        if (bdrv_can_store_persistent_dirty_bitmaps(bs)) {
+            bdrv_dirty_bitmap_set_persistance(bitmap, true);
+        } else {
+            error_report("Warning: '%s' cannot store dirty bitmaps, bitmap "
+                         "'%s' will not be persistent", node_name, name);
+        }
+    }
+    ret = 0;
+
+out_release:
+    aio_context_release(aio_context);
+out:
+    g_free(node_name);
+    g_free(name);
+    return ret;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int flags, ret;
+
+    do {
+        flags = qemu_get_byte(f);
+
+        if (flags & DIRTY_BITMAP_MIG_FLAG_BITMAP) {
+            ret = load_bitmap(f);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS)) {
+            error_report("Unknown dirty bitmap migration flags: %#x", flags);
+            return -EINVAL;
+        }
+
+        ret = qemu_file_get_error(f);
+        if (ret != 0) {
+            return ret;
+        }
+    } while (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS));
+
+    return 0;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+/*
+ * Once the destination has taken over, the source must not write the
+ * persistent bitmaps back to the image anymore.
+ */
+static void dirty_bitmap_migration_state_changed(Notifier *notifier,
+                                                 void *data)
+{
+    DirtyBitmapMigState *s = container_of(notifier, DirtyBitmapMigState,
+                                          migration_state);
+    MigrationState *ms = data;
+    BlockDriverState *bs = NULL;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!s->bitmaps_sent) {
+        return;
+    }
+    if (migration_has_failed(ms)) {
+        s->bitmaps_sent = false;
+        return;
+    }
+    if (!migration_has_finished(ms)) {
+        return;
+    }
+
+    s->bitmaps_sent = false;
+    while ((bs = bdrv_next(bs))) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        aio_context_acquire(aio_context);
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (bdrv_dirty_bitmap_name(bitmap)) {
+                bdrv_dirty_bitmap_set_persistance(bitmap, false);
+            }
+        }
+        aio_context_release(aio_context);
+    }
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_complete_precopy = dirty_bitmap_save_complete,
+    .load_state = dirty_bitmap_load,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    dirty_bitmap_mig_state.migration_state.notify =
+        dirty_bitmap_migration_state_changed;
+    add_migration_state_change_notifier(&dirty_bitmap_mig_state.migration_state);
+
+    register_savevm_live(NULL, "dirty-bitmap", 0, 1,
+                         &savevm_dirty_bitmap_handlers,
+                         &dirty_bitmap_mig_state);
+}
@@ -51,6 +51,10 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of extra RAM connections for x-multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default maximum number of pages sent ahead of a postcopy fault */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 64
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -90,6 +94,10 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES] =
+                DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES,
     };
 
     if (!once) {
@@ -357,6 +365,7 @@ static void process_incoming_migration_co(void *opaque)
     }
 
     qemu_fclose(f);
+    migrate_multifd_recv_join();
     free_xbzrle_decoded_buf();
     migration_incoming_state_destroy();
 
@@ -511,6 +520,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->x_postcopy_prefetch_pages =
+            s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES];
 
     return params;
 }
@@ -541,6 +554,7 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
@@ -695,6 +709,22 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Batches of pages go to whichever channel is idle, and the
+         * channels are only ordered against each other by the sync after
+         * each bitmap sync.  Xbzrle, compressed and postcopy pages travel
+         * on the main stream instead, which is not ordered against the
+         * channels at all in between, so an older copy of a page could
+         * land after a newer one.
+         */
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_postcopy_ram()) {
+            error_report("Multifd is not currently compatible with xbzrle, "
+                         "compression or postcopy");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -706,7 +736,12 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_postcopy_prefetch_pages,
+                                int64_t x_postcopy_prefetch_pages,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -741,6 +776,21 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_postcopy_prefetch_pages &&
+            (x_postcopy_prefetch_pages < 0 ||
+             x_postcopy_prefetch_pages > 65536)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 65536");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -761,6 +811,14 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_x_postcopy_prefetch_pages) {
+        s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES] =
+                                                    x_postcopy_prefetch_pages;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -1001,6 +1059,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "Multifd migration requires a tcp: URI");
+        return;
+    }
+
     /* We are starting a new migration, so we want to start in a clean
        state.  This change is only needed if previous migration
        failed/was cancelled.  We don't use migrate_set_state() because
@@ -1164,6 +1227,42 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_POSTCOPY_PREFETCH_PAGES];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
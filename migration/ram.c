@@ -64,6 +64,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD          0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -147,6 +148,7 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
@@ -199,6 +201,11 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
@@ -497,6 +504,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -599,6 +607,8 @@ static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
+/* Pages dirtied since they were sent are about to go out again, see multifd */
+static bool multifd_sync_needed;
 
 static void migration_bitmap_sync_init(void)
 {
@@ -619,6 +629,7 @@ static void migration_bitmap_sync(void)
     int64_t bytes_xfer_now;
 
     bitmap_sync_count++;
+    multifd_sync_needed = true;
 
     if (!bytes_xfer_prev) {
         bytes_xfer_prev = ram_bytes_transferred();
@@ -968,6 +979,409 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/* Multifd: RAM pages sent over several extra connections.  The migration
+ * thread collects pages into packets and hands each packet to whichever
+ * channel is idle, round-robin.  It only blocks when every channel is busy.
+ *
+ * A page is sent at most once between two syncs of the dirty bitmap.  After
+ * each sync, and before any page is sent again, every channel sends a sync
+ * packet and the main stream carries MULTIFD_CMD_SYNC.  The destination
+ * holds each channel at its sync packet until all of them got there, so a
+ * newer copy of a page can never be overwritten by an older one that took
+ * another channel.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+#define MULTIFD_PAGES_PER_PACKET 64
+
+/* Packet types on a channel */
+#define MULTIFD_FLAG_PAGES 0x1
+#define MULTIFD_FLAG_SYNC  0x2
+
+/* Set in the offset of a page that is not followed by its data */
+#define MULTIFD_PAGE_ZERO  0x1
+
+/* Commands following RAM_SAVE_FLAG_MULTIFD on the main stream */
+#define MULTIFD_CMD_SETUP  1 /* be32: number of channels */
+#define MULTIFD_CMD_SYNC   2 /* wait for a sync packet on every channel */
+
+struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+};
+typedef struct MultiFDPages MultiFDPages;
+
+struct MultiFDSendChannel {
+    QemuThread thread;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* everything below is protected by mutex */
+    MultiFDPages pages;
+    bool busy;          /* pages (and sync) handed over, not sent yet */
+    bool started;       /* the thread holds the RCU read lock for pages */
+    bool sync;          /* send a sync packet after pages */
+    bool quit;
+    bool error;
+    /* sent, but not yet accounted for in the main stream */
+    uint64_t bytes;
+    uint64_t norm_pages;
+    uint64_t zero_pages;
+};
+typedef struct MultiFDSendChannel MultiFDSendChannel;
+
+static MultiFDSendChannel *multifd_send;
+static int multifd_send_count;
+static int multifd_send_next;           /* where the idle search starts */
+static QemuSemaphore multifd_send_idle; /* counts idle channels */
+static MultiFDPages multifd_send_pages; /* packet being filled */
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *ch = opaque;
+    QEMUFile *f = ch->file;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&ch->mutex);
+    while (true) {
+        uint64_t bytes = 0, norm_pages = 0, zero_pages = 0;
+        int i;
+
+        while (!ch->busy && !ch->quit) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+        }
+        if (!ch->busy) {
+            break;
+        }
+
+        /* The migration thread waits for this before it leaves the RCU
+         * critical section in which it queued the pages.
+         */
+        rcu_read_lock();
+        ch->started = true;
+        qemu_cond_broadcast(&ch->cond);
+        qemu_mutex_unlock(&ch->mutex);
+
+        /* ch->pages and ch->sync are ours until busy is cleared */
+        if (ch->pages.num) {
+            RAMBlock *block = ch->pages.block;
+            size_t len = strlen(block->idstr);
+
+            qemu_put_be32(f, MULTIFD_FLAG_PAGES);
+            qemu_put_be32(f, ch->pages.num);
+            qemu_put_byte(f, len);
+            qemu_put_buffer(f, (uint8_t *)block->idstr, len);
+            bytes += 9 + len;
+
+            for (i = 0; i < ch->pages.num; i++) {
+                ram_addr_t offset = ch->pages.offset[i];
+                uint8_t *p = block->host + offset;
+
+                if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+                    qemu_put_be64(f, offset | MULTIFD_PAGE_ZERO);
+                    bytes += 8;
+                    zero_pages++;
+                } else {
+                    qemu_put_be64(f, offset);
+                    qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+                    bytes += 8 + TARGET_PAGE_SIZE;
+                    norm_pages++;
+                }
+            }
+        }
+        if (ch->sync) {
+            qemu_put_be32(f, MULTIFD_FLAG_SYNC);
+            bytes += 4;
+        }
+        qemu_fflush(f);
+        rcu_read_unlock();
+
+        qemu_mutex_lock(&ch->mutex);
+        ch->bytes += bytes;
+        ch->norm_pages += norm_pages;
+        ch->zero_pages += zero_pages;
+        ch->error = qemu_file_get_error(f) != 0;
+        ch->pages.num = 0;
+        ch->sync = false;
+        ch->started = false;
+        ch->busy = false;
+        qemu_cond_broadcast(&ch->cond);
+        qemu_sem_post(&multifd_send_idle);
+    }
+    qemu_mutex_unlock(&ch->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Account what @ch sent since the last call.  Called with ch->mutex held. */
+static int multifd_send_account(QEMUFile *f, MultiFDSendChannel *ch)
+{
+    acct_info.norm_pages += ch->norm_pages;
+    acct_info.dup_pages += ch->zero_pages;
+    bytes_transferred += ch->bytes;
+    qemu_update_position(f, ch->bytes);
+    qemu_file_update_transfer(f, ch->bytes);
+    ch->norm_pages = ch->zero_pages = ch->bytes = 0;
+
+    return ch->error ? -EIO : 0;
+}
+
+/* Wait until @ch is idle and account what it sent.  Called with
+ * ch->mutex held.
+ */
+static int multifd_send_wait(QEMUFile *f, MultiFDSendChannel *ch)
+{
+    while (ch->busy) {
+        qemu_cond_wait(&ch->cond, &ch->mutex);
+    }
+    return multifd_send_account(f, ch);
+}
+
+/* Make idle channel @ch send @pages, and a sync packet if @sync is true.
+ * The caller has taken a token from multifd_send_idle.  Called with
+ * ch->mutex held.
+ */
+static int multifd_send_start(QEMUFile *f, MultiFDSendChannel *ch,
+                              MultiFDPages *pages, bool sync)
+{
+    int ret;
+
+    assert(!ch->busy);
+    ret = multifd_send_account(f, ch);
+    if (ret < 0) {
+        qemu_sem_post(&multifd_send_idle);
+        return ret;
+    }
+
+    if (pages) {
+        ch->pages = *pages;
+    }
+    ch->sync = sync;
+    ch->busy = true;
+    qemu_cond_broadcast(&ch->cond);
+    return 0;
+}
+
+/* Hand the packet being filled to the next idle channel.  Blocks only
+ * while every channel is busy.
+ */
+static int multifd_send_queued(QEMUFile *f)
+{
+    MultiFDSendChannel *ch = NULL;
+    int i, ret;
+
+    if (!multifd_send_pages.num) {
+        return 0;
+    }
+
+    qemu_sem_wait(&multifd_send_idle);
+    for (i = 0; i < multifd_send_count; i++) {
+        ch = &multifd_send[(multifd_send_next + i) % multifd_send_count];
+        qemu_mutex_lock(&ch->mutex);
+        if (!ch->busy) {
+            break;
+        }
+        qemu_mutex_unlock(&ch->mutex);
+    }
+    /* Every busy channel has yet to post its token */
+    assert(i < multifd_send_count);
+    multifd_send_next = (multifd_send_next + i + 1) % multifd_send_count;
+
+    ret = multifd_send_start(f, ch, &multifd_send_pages, false);
+    qemu_mutex_unlock(&ch->mutex);
+    multifd_send_pages.num = 0;
+
+    return ret;
+}
+
+/**
+ * multifd_send_sync: send a sync packet on every channel
+ *
+ * Waits until every channel has sent everything it was handed, and puts
+ * the matching MULTIFD_CMD_SYNC on @f.
+ *
+ * @f: main migration stream
+ */
+static int multifd_send_sync(QEMUFile *f)
+{
+    int i, ret;
+
+    ret = multifd_send_queued(f);
+    for (i = 0; i < multifd_send_count && !ret; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+
+        qemu_mutex_lock(&ch->mutex);
+        ret = multifd_send_wait(f, ch);
+        if (!ret) {
+            /* Idle, so a token is available for this channel */
+            qemu_sem_wait(&multifd_send_idle);
+            ret = multifd_send_start(f, ch, NULL, true);
+        }
+        qemu_mutex_unlock(&ch->mutex);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+        int err;
+
+        qemu_mutex_lock(&ch->mutex);
+        err = multifd_send_wait(f, ch);
+        qemu_mutex_unlock(&ch->mutex);
+        ret = ret ? ret : err;
+    }
+    if (!ret) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+        qemu_put_be32(f, MULTIFD_CMD_SYNC);
+        bytes_transferred += 12;
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+
+    return ret;
+}
+
+/**
+ * multifd_send_page: queue a page for the next idle channel
+ *
+ * Returns: Number of pages queued, or a negative errno
+ *
+ * @f: main migration stream, where the transfer is accounted
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int multifd_send_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    int ret;
+
+    /* The page may have been sent before the last bitmap sync */
+    if (multifd_sync_needed) {
+        multifd_sync_needed = false;
+        ret = multifd_send_sync(f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (multifd_send_pages.num &&
+        (multifd_send_pages.block != block ||
+         multifd_send_pages.num == MULTIFD_PAGES_PER_PACKET)) {
+        ret = multifd_send_queued(f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    multifd_send_pages.block = block;
+    multifd_send_pages.offset[multifd_send_pages.num++] = offset;
+
+    return 1;
+}
+
+/**
+ * multifd_send_flush: hand over all queued pages without waiting for them
+ *
+ * The channel threads take the RCU read lock for the RAMBlock of each
+ * packet themselves.  This waits until every busy channel has done so, so
+ * it must be called before the migration thread leaves the critical
+ * section in which it queued the pages.  It also accounts what the
+ * channels have sent so far.
+ *
+ * @f: main migration stream
+ */
+static int multifd_send_flush(QEMUFile *f)
+{
+    int i, ret;
+
+    ret = multifd_send_queued(f);
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+        int err;
+
+        qemu_mutex_lock(&ch->mutex);
+        while (ch->busy && !ch->started) {
+            qemu_cond_wait(&ch->cond, &ch->mutex);
+        }
+        err = multifd_send_account(f, ch);
+        qemu_mutex_unlock(&ch->mutex);
+        ret = ret ? ret : err;
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+
+    return ret;
+}
+
+static void multifd_send_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+
+        qemu_mutex_lock(&ch->mutex);
+        ch->quit = true;
+        qemu_cond_broadcast(&ch->cond);
+        qemu_mutex_unlock(&ch->mutex);
+        /* in case the thread is stuck writing to a dead connection */
+        qemu_file_shutdown(ch->file);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+
+        qemu_thread_join(&ch->thread);
+        qemu_fclose(ch->file);
+        qemu_mutex_destroy(&ch->mutex);
+        qemu_cond_destroy(&ch->cond);
+    }
+    if (multifd_send) {
+        qemu_sem_destroy(&multifd_send_idle);
+    }
+    g_free(multifd_send);
+    multifd_send = NULL;
+    multifd_send_count = 0;
+}
+
+static int multifd_send_setup(QEMUFile *f)
+{
+    int i, n = migrate_multifd_channels();
+    Error *local_err = NULL;
+
+    multifd_send = g_new0(MultiFDSendChannel, n);
+    multifd_send_next = 0;
+    multifd_send_pages.num = 0;
+    multifd_sync_needed = false;
+    qemu_sem_init(&multifd_send_idle, n);
+    for (i = 0; i < n; i++) {
+        MultiFDSendChannel *ch = &multifd_send[i];
+        int fd;
+
+        fd = tcp_connect_migration_channel(&local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+        ch->file = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(ch->file, MULTIFD_MAGIC);
+        qemu_put_be32(ch->file, MULTIFD_VERSION);
+        qemu_put_be32(ch->file, i);
+        qemu_mutex_init(&ch->mutex);
+        qemu_cond_init(&ch->cond);
+        qemu_thread_create(&ch->thread, "multifd_send",
+                           multifd_send_thread, ch, QEMU_THREAD_JOINABLE);
+        multifd_send_count++;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+    qemu_put_be32(f, MULTIFD_CMD_SETUP);
+    qemu_put_be32(f, n);
+
+    return 0;
+}
+
 /*
  * Find the next dirty page and update any state associated with
  * the search process.
@@ -1024,7 +1438,167 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
 }
 
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Postcopy prefetching
+ *
+ * After a page fault, the pages following the faulting one are sent before
+ * the background scan resumes.  The size of that window adapts to the fault
+ * pattern, much like file readahead: it doubles (up to
+ * x-postcopy-prefetch-pages) while faults keep landing in or right after
+ * the previous window, and drops back to the minimum on a random fault.
+ *
+ * On top of that, the faults are counted per 2MB region.  Regions that keep
+ * faulting are considered hot and are streamed as a whole, since a guest
+ * that touches them repeatedly will most likely touch the rest of them too.
+ * The counters decay so that the set of hot regions follows the guest.
+ *
+ * The state is protected by ms->src_page_req_mutex, faults are recorded by
+ * the return path thread while the migration thread consumes the window.
+ */
+#define POSTCOPY_PREFETCH_MIN_PAGES 4
+#define POSTCOPY_HOT_REGION_BITS    21
+#define POSTCOPY_HOT_REGIONS        16
+#define POSTCOPY_HOT_REGION_FAULTS  4
+#define POSTCOPY_HOT_DECAY_FAULTS   64
+
+typedef struct PostcopyHotRegion {
+    RAMBlock   *rb;         /* only compared, never dereferenced */
+    ram_addr_t  start;
+    unsigned    faults;
+} PostcopyHotRegion;
+
+static struct {
+    RAMBlock   *rb;         /* Block of the current window, or NULL */
+    ram_addr_t  offset;     /* Next page of the window to send */
+    ram_addr_t  end;        /* End of the window */
+    ram_addr_t  last_fault; /* End of the last fault in rb */
+    ram_addr_t  window;     /* Current window size in bytes */
+    unsigned    nb_faults;
+    PostcopyHotRegion hot[POSTCOPY_HOT_REGIONS];
+} postcopy_prefetch;
+
+static void postcopy_prefetch_set_block(RAMBlock *rb)
+{
+    if (postcopy_prefetch.rb == rb) {
+        return;
+    }
+    if (postcopy_prefetch.rb) {
+        memory_region_unref(postcopy_prefetch.rb->mr);
+    }
+    if (rb) {
+        memory_region_ref(rb->mr);
+    }
+    postcopy_prefetch.rb = rb;
+}
+
+/* Count a fault in its region, returns true if the region is hot */
+static bool postcopy_prefetch_hot_region(RAMBlock *rb, ram_addr_t start)
+{
+    PostcopyHotRegion *coldest = &postcopy_prefetch.hot[0];
+    PostcopyHotRegion *r;
+    int i;
+
+    start &= ~((ram_addr_t)(1 << POSTCOPY_HOT_REGION_BITS) - 1);
+
+    if (++postcopy_prefetch.nb_faults % POSTCOPY_HOT_DECAY_FAULTS == 0) {
+        for (i = 0; i < POSTCOPY_HOT_REGIONS; i++) {
+            postcopy_prefetch.hot[i].faults /= 2;
+        }
+    }
+
+    for (i = 0; i < POSTCOPY_HOT_REGIONS; i++) {
+        r = &postcopy_prefetch.hot[i];
+        if (r->rb == rb && r->start == start) {
+            return ++r->faults >= POSTCOPY_HOT_REGION_FAULTS;
+        }
+        if (r->faults < coldest->faults) {
+            coldest = r;
+        }
+    }
+
+    coldest->rb = rb;
+    coldest->start = start;
+    coldest->faults = 1;
+    return false;
+}
+
+/* Called with src_page_req_mutex held, after queueing a fault */
+static void postcopy_prefetch_fault(RAMBlock *rb, ram_addr_t start,
+                                    ram_addr_t len)
+{
+    ram_addr_t max = (ram_addr_t)migrate_postcopy_prefetch_pages()
+                     * TARGET_PAGE_SIZE;
+    ram_addr_t min = MIN(max, POSTCOPY_PREFETCH_MIN_PAGES * TARGET_PAGE_SIZE);
+    ram_addr_t end = start + len;
+    ram_addr_t region_size = (ram_addr_t)1 << POSTCOPY_HOT_REGION_BITS;
+    bool sequential;
+
+    if (!max) {
+        return;
+    }
+
+    sequential = postcopy_prefetch.rb == rb &&
+                 start >= postcopy_prefetch.last_fault &&
+                 start <= MAX(postcopy_prefetch.end,
+                              postcopy_prefetch.last_fault) + len;
+    if (sequential) {
+        postcopy_prefetch.window = MIN(MAX(postcopy_prefetch.window * 2, min),
+                                       max);
+    } else {
+        postcopy_prefetch.window = min;
+    }
+
+    postcopy_prefetch_set_block(rb);
+    postcopy_prefetch.last_fault = end;
+
+    if (postcopy_prefetch_hot_region(rb, start)) {
+        /* Stream the whole region, including what precedes the fault */
+        postcopy_prefetch.offset = start & ~(region_size - 1);
+        postcopy_prefetch.end = MAX(postcopy_prefetch.offset + region_size,
+                                    end + postcopy_prefetch.window);
+    } else {
+        postcopy_prefetch.offset = end;
+        postcopy_prefetch.end = end + postcopy_prefetch.window;
+    }
+
+    postcopy_prefetch.offset &= ~((ram_addr_t)qemu_host_page_size - 1);
+    postcopy_prefetch.end = MIN(ROUND_UP(postcopy_prefetch.end,
+                                         qemu_host_page_size),
+                                rb->used_length);
+
+    trace_postcopy_prefetch_fault(rb->idstr, start, postcopy_prefetch.offset,
+                                  postcopy_prefetch.end, sequential);
+}
+
+/*
+ * Helper for 'get_queued_page' - gets the next page of the prefetch window,
+ * called with src_page_req_mutex held.  Pages are returned a host page at
+ * a time, ram_save_host_page() sends the whole host page.
+ */
+static RAMBlock *postcopy_prefetch_page(ram_addr_t *offset,
+                                        ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block = postcopy_prefetch.rb;
+
+    if (!block || postcopy_prefetch.offset >= postcopy_prefetch.end) {
+        return NULL;
+    }
+
+    *offset = postcopy_prefetch.offset;
+    *ram_addr_abs = (*offset + block->offset) & TARGET_PAGE_MASK;
+    postcopy_prefetch.offset += qemu_host_page_size;
+
+    return block;
+}
+
+static void postcopy_prefetch_reset(void)
+{
+    postcopy_prefetch_set_block(NULL);
+    memset(&postcopy_prefetch, 0, sizeof(postcopy_prefetch));
+}
+
+/*
+ * Helper for 'get_queued_page' - gets a page off the queue, or from the
+ * postcopy prefetch window once the queue is empty
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
  * ram_addr_abs: global offset in the dirty/sent bitmaps
@@ -1053,6 +1627,8 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
             QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
             g_free(entry);
         }
+    } else {
+        block = postcopy_prefetch_page(offset, ram_addr_abs);
     }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
 
@@ -1143,6 +1719,7 @@ void flush_page_queue(MigrationState *ms)
         QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
         g_free(mspr);
     }
+    postcopy_prefetch_reset();
     rcu_read_unlock();
 }
 
@@ -1199,6 +1776,7 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    postcopy_prefetch_fault(ramblock, start, len);
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1233,7 +1811,9 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     /* Check the pages is dirty and if it is send it */
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
-        if (compression_switch && migrate_use_compression()) {
+        if (multifd_send_count) {
+            res = multifd_send_page(f, block, offset);
+        } else if (compression_switch && migrate_use_compression()) {
             res = ram_save_compressed_page(f, block, offset,
                                            last_stage,
                                            bytes_transferred);
@@ -1425,6 +2005,8 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    multifd_send_cleanup();
 }
 
 static void reset_ram_globals(void)
@@ -1942,6 +2524,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     rcu_read_unlock();
 
+    if (migrate_use_multifd() && multifd_send_setup(f) < 0) {
+        return -1;
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1996,6 +2582,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (multifd_send_count) {
+        multifd_send_flush(f);
+    }
     rcu_read_unlock();
 
     /*
@@ -2040,6 +2629,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (multifd_send_count) {
+        multifd_send_sync(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2251,6 +2843,231 @@ static void decompress_data_with_multi_threads(uint8_t *compbuf,
     }
 }
 
+struct MultiFDRecvChannel {
+    QemuThread thread;
+    QemuMutex mutex;    /* protects file against multifd_recv_join */
+    QEMUFile *file;
+    QemuSemaphore sem_sync; /* posted when a sync packet arrives */
+    QemuSemaphore sem_go;   /* posted when every channel has synced */
+    bool error;
+};
+typedef struct MultiFDRecvChannel MultiFDRecvChannel;
+
+static MultiFDRecvChannel *multifd_recv;
+static int multifd_recv_count;
+static bool multifd_recv_quit;
+
+static int multifd_recv_pages(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    int num, len, i, ret = 0;
+
+    num = qemu_get_be32(f);
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    if (num < 0 || num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("Invalid multifd packet with %d pages", num);
+        return -EINVAL;
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("Unknown ramblock \"%s\" in multifd packet", id);
+        ret = -EINVAL;
+    }
+    for (i = 0; i < num && !ret; i++) {
+        ram_addr_t offset = qemu_get_be64(f);
+        bool zero = offset & MULTIFD_PAGE_ZERO;
+        void *host;
+
+        offset &= TARGET_PAGE_MASK;
+        if (offset >= block->used_length) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT " in multifd "
+                         "packet", offset);
+            ret = -EINVAL;
+            break;
+        }
+        host = block->host + offset;
+        if (zero) {
+            ram_handle_compressed(host, 0, TARGET_PAGE_SIZE);
+        } else {
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        }
+    }
+    rcu_read_unlock();
+
+    return ret ? ret : qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *ch = opaque;
+    Error *local_err = NULL;
+    QEMUFile *f;
+    int fd, ret = 0;
+    bool quit;
+
+    rcu_register_thread();
+
+    fd = tcp_accept_migration_channel(&local_err);
+    if (fd < 0) {
+        if (!atomic_read(&multifd_recv_quit)) {
+            error_report_err(local_err);
+        } else {
+            error_free(local_err);
+        }
+        goto out;
+    }
+
+    f = qemu_fopen_socket(fd, "rb");
+    qemu_mutex_lock(&ch->mutex);
+    ch->file = f;
+    quit = multifd_recv_quit;
+    qemu_mutex_unlock(&ch->mutex);
+    if (quit) {
+        goto out;
+    }
+
+    if (qemu_get_be32(f) != MULTIFD_MAGIC ||
+        qemu_get_be32(f) != MULTIFD_VERSION) {
+        error_report("Invalid multifd channel header");
+        goto out;
+    }
+    qemu_get_be32(f); /* channel number on the source, unused */
+
+    while (!ret) {
+        uint32_t flags = qemu_get_be32(f);
+
+        if (qemu_file_get_error(f)) {
+            /* the source closes the channels once it is done */
+            break;
+        }
+        switch (flags) {
+        case MULTIFD_FLAG_PAGES:
+            ret = multifd_recv_pages(f);
+            break;
+        case MULTIFD_FLAG_SYNC:
+            /* Pages after the sync may be newer copies of pages that are
+             * still on their way over another channel; hold them back.
+             */
+            qemu_sem_post(&ch->sem_sync);
+            qemu_sem_wait(&ch->sem_go);
+            if (atomic_read(&multifd_recv_quit)) {
+                ret = -EINTR;
+            }
+            break;
+        default:
+            error_report("Unknown multifd packet type %#x", flags);
+            ret = -EINVAL;
+        }
+    }
+
+out:
+    /* No more sync packets can arrive; don't leave the loader waiting */
+    atomic_set(&ch->error, true);
+    qemu_sem_post(&ch->sem_sync);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static int multifd_recv_setup(int n)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        error_report("Multifd migration stream, but x-multifd is not "
+                     "enabled on the destination");
+        return -EINVAL;
+    }
+    if (multifd_recv || n < 1 || n > 255) {
+        error_report("Invalid multifd setup for %d channels", n);
+        return -EINVAL;
+    }
+
+    multifd_recv_quit = false;
+    multifd_recv = g_new0(MultiFDRecvChannel, n);
+    multifd_recv_count = n;
+    for (i = 0; i < n; i++) {
+        MultiFDRecvChannel *ch = &multifd_recv[i];
+
+        qemu_mutex_init(&ch->mutex);
+        qemu_sem_init(&ch->sem_sync, 0);
+        qemu_sem_init(&ch->sem_go, 0);
+        qemu_thread_create(&ch->thread, "multifd_recv",
+                           multifd_recv_thread, ch, QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+/* Wait until every page sent before MULTIFD_CMD_SYNC has been received,
+ * then let the channels go on with the pages sent after it.  This blocks
+ * the main loop, like the load of the main stream itself.
+ */
+static int multifd_recv_sync(void)
+{
+    int i, ret = 0;
+
+    if (!multifd_recv) {
+        error_report("Multifd sync without multifd setup");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvChannel *ch = &multifd_recv[i];
+
+        qemu_sem_wait(&ch->sem_sync);
+        if (atomic_read(&ch->error)) {
+            ret = -EIO;
+        }
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv[i].sem_go);
+    }
+
+    return ret;
+}
+
+void migrate_multifd_recv_join(void)
+{
+    int i;
+
+    if (!multifd_recv) {
+        return;
+    }
+
+    atomic_set(&multifd_recv_quit, true);
+    tcp_shutdown_migration_listener();
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvChannel *ch = &multifd_recv[i];
+
+        qemu_mutex_lock(&ch->mutex);
+        if (ch->file) {
+            qemu_file_shutdown(ch->file);
+        }
+        qemu_mutex_unlock(&ch->mutex);
+        /* in case the thread waits for the other channels to sync */
+        qemu_sem_post(&ch->sem_go);
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        MultiFDRecvChannel *ch = &multifd_recv[i];
+
+        qemu_thread_join(&ch->thread);
+        if (ch->file) {
+            qemu_fclose(ch->file);
+        }
+        qemu_mutex_destroy(&ch->mutex);
+        qemu_sem_destroy(&ch->sem_sync);
+        qemu_sem_destroy(&ch->sem_go);
+    }
+    tcp_close_migration_listener();
+    g_free(multifd_recv);
+    multifd_recv = NULL;
+    multifd_recv_count = 0;
+}
+
 /*
  * Allocate data structures etc needed by incoming migration with postcopy-ram
  * postcopy-ram's similarly names postcopy_ram_incoming_init does the work
@@ -2495,6 +3312,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD:
+            switch (qemu_get_be32(f)) {
+            case MULTIFD_CMD_SETUP:
+                ret = multifd_recv_setup(qemu_get_be32(f));
+                break;
+            case MULTIFD_CMD_SYNC:
+                ret = multifd_recv_sync();
+                break;
+            default:
+                error_report("Unknown multifd command");
+                ret = -EINVAL;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -33,6 +33,10 @@
     do { } while (0)
 #endif
 
+/* Where multifd channels connect to, and where they are accepted from */
+static char *outgoing_host_port;
+static int incoming_listen_fd = -1;
+
 static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 {
     MigrationState *s = opaque;
@@ -50,9 +54,65 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(outgoing_host_port);
+    outgoing_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Open one more blocking connection to the migration destination */
+int tcp_connect_migration_channel(Error **errp)
+{
+    if (!outgoing_host_port) {
+        error_setg(errp, "No outgoing tcp migration");
+        return -1;
+    }
+    return inet_connect(outgoing_host_port, errp);
+}
+
+/* Wait for one more connection on the incoming migration socket.
+ * This blocks, so it must be called outside the main loop.
+ */
+int tcp_accept_migration_channel(Error **errp)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int c, err;
+
+    if (incoming_listen_fd < 0) {
+        error_setg(errp, "No incoming tcp migration socket");
+        return -1;
+    }
+
+    do {
+        c = qemu_accept(incoming_listen_fd, (struct sockaddr *)&addr,
+                        &addrlen);
+        err = socket_error();
+    } while (c < 0 && err == EINTR);
+
+    if (c < 0) {
+        error_setg_errno(errp, err, "could not accept migration channel");
+        return -1;
+    }
+    qemu_set_block(c);
+    return c;
+}
+
+/* Wake up anybody blocked in tcp_accept_migration_channel() */
+void tcp_shutdown_migration_listener(void)
+{
+    if (incoming_listen_fd >= 0) {
+        shutdown(incoming_listen_fd, SHUT_RDWR);
+    }
+}
+
+void tcp_close_migration_listener(void)
+{
+    if (incoming_listen_fd >= 0) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -66,7 +126,13 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
+    if (c >= 0 && migrate_use_multifd()) {
+        /* keep listening: the RAM channels connect to the same port */
+        qemu_set_block(s);
+        incoming_listen_fd = s;
+    } else {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
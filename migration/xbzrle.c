@@ -11,6 +11,7 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -23,17 +24,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf,
+                                        int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -125,6 +123,239 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders compare a whole vector of old and new bytes at a
+ * time; the movemask of the comparison gives the position where a run
+ * ends.  The runs are maximal like in the generic encoder, so that the
+ * output is the same byte for byte.
+ *
+ * A scan function returns the index of the first byte at or after i
+ * that ends the current run, or slen.
+ */
+typedef int XbzrleScanFn(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     XbzrleScanFn *zrun_end,
+                                     XbzrleScanFn *nzrun_end)
+{
+    int d = 0, i = 0, next, len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        next = zrun_end(old_buf, new_buf, i, slen);
+
+        /* buffer unchanged */
+        if (next - i == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (next == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, next - i);
+        i = next;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        next = nzrun_end(old_buf, new_buf, i, slen);
+        len = next - i;
+        d += uleb128_encode_small(dst + d, len);
+
+        /* overflow */
+        if (d + len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, len);
+        d += len;
+        i = next;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline uint32_t xbzrle_cmpeq_sse2(const uint8_t *old_buf,
+                                         const uint8_t *new_buf, int i)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+}
+
+static int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + (int)sizeof(__m128i) <= slen; i += sizeof(__m128i)) {
+        mask = xbzrle_cmpeq_sse2(old_buf, new_buf, i);
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + (int)sizeof(__m128i) <= slen; i += sizeof(__m128i)) {
+        mask = xbzrle_cmpeq_sse2(old_buf, new_buf, i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_sse2, xbzrle_nzrun_end_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint32_t xbzrle_cmpeq_avx2(const uint8_t *old_buf,
+                                         const uint8_t *new_buf, int i)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + (int)sizeof(__m256i) <= slen; i += sizeof(__m256i)) {
+        mask = xbzrle_cmpeq_avx2(old_buf, new_buf, i);
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + (int)sizeof(__m256i) <= slen; i += sizeof(__m256i)) {
+        mask = xbzrle_cmpeq_avx2(old_buf, new_buf, i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+
+#pragma GCC pop_options
+#endif
+
+static const struct {
+    const char *name;
+    int (*encode)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen);
+    bool (*usable)(void);
+} xbzrle_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", xbzrle_encode_buffer_avx2, host_cpu_has_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", xbzrle_encode_buffer_sse2, NULL },
+#endif
+    { "generic", xbzrle_encode_buffer_generic, NULL },
+};
+
+static unsigned xbzrle_accel;
+
+static void xbzrle_select_accel(unsigned i)
+{
+    while (xbzrle_accels[i].usable && !xbzrle_accels[i].usable()) {
+        i++;
+    }
+    xbzrle_accel = i;
+}
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    xbzrle_select_accel(0);
+}
+
+/*
+ * Switches the encoder to the next slower implementation, for tests and
+ * benchmarks.  Returns false, after going back to the best implementation,
+ * when there is none left.
+ */
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (xbzrle_accel + 1 == ARRAY_SIZE(xbzrle_accels)) {
+        xbzrle_select_accel(0);
+        return false;
+    }
+    xbzrle_select_accel(xbzrle_accel + 1);
+    return true;
+}
+
+const char *xbzrle_encode_accel(void)
+{
+    return xbzrle_accels[xbzrle_accel].name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_accels[xbzrle_accel].encode(old_buf, new_buf, slen,
+                                              dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
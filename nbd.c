@@ -64,8 +64,10 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_STRUCTURED_REPLY_SIZE (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
 #define NBD_CLIENT_MAGIC        0x0000420281861253LL
 #define NBD_REP_MAGIC           0x3e889045565a9LL
@@ -85,6 +87,14 @@
 #define NBD_OPT_EXPORT_NAME     (1)
 #define NBD_OPT_ABORT           (2)
 #define NBD_OPT_LIST            (3)
+#define NBD_OPT_STRUCTURED_REPLY (8)
+#define NBD_OPT_SET_META_CONTEXT (10)
+
+/* Upper bound for the data of options that the server reads in one piece */
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* Upper bound for the extents in one block status reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 256
 
 /* NBD errors are based on errno numbers, so there is a 1:1 mapping,
  * but only a limited set of errno values is specified in the protocol.
@@ -120,7 +130,7 @@ static int system_errno_to_nbd_errno(int err)
     }
 }
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -180,6 +190,9 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;      /* reads are answered in chunks */
+    bool base_allocation;       /* block status queries are allowed */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -303,10 +316,10 @@ static ssize_t write_sync(int fd, void *buffer, size_t size)
 
 */
 
-static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+static int nbd_send_rep_len(int csock, uint32_t type, uint32_t opt,
+                            uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -323,7 +336,7 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -331,6 +344,11 @@ static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_send_rep(int csock, uint32_t type, uint32_t opt)
+{
+    return nbd_send_rep_len(csock, type, opt, 0);
+}
+
 static int nbd_send_rep_list(int csock, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -424,6 +442,128 @@ fail:
     return rc;
 }
 
+static int nbd_handle_structured_reply(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+
+    if (length) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_handle_set_meta_context(NBDClient *client, uint32_t length)
+{
+    int csock = client->sock;
+    const char *context = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t len, nb_queries, id;
+    uint8_t *buf, *p, *end;
+    char *name;
+    int rc;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           for each query, its length (4 bytes) and the query
+
+       Only "base:allocation" is known; it needs structured replies.
+     */
+    if (!client->structured_reply || length > NBD_MAX_OPTION_SIZE) {
+        if (drop_sync(csock, length) != length) {
+            return -EIO;
+        }
+        return nbd_send_rep(csock, NBD_REP_ERR_INVALID,
+                            NBD_OPT_SET_META_CONTEXT);
+    }
+
+    buf = g_malloc(length);
+    if (read_sync(csock, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+    end = buf + length;
+
+    if (end - p < 4) {
+        goto invalid;
+    }
+    len = be32_to_cpup((uint32_t *)p);
+    p += 4;
+    if (len > end - p) {
+        goto invalid;
+    }
+    name = g_strndup((char *)p, len);
+    p += len;
+    if (!nbd_export_find(name)) {
+        g_free(name);
+        rc = nbd_send_rep(csock, NBD_REP_ERR_UNKNOWN,
+                          NBD_OPT_SET_META_CONTEXT);
+        goto out;
+    }
+    g_free(name);
+
+    if (end - p < 4) {
+        goto invalid;
+    }
+    nb_queries = be32_to_cpup((uint32_t *)p);
+    p += 4;
+
+    /* Each request replaces the contexts selected by earlier ones */
+    client->base_allocation = false;
+    while (nb_queries--) {
+        if (end - p < 4) {
+            goto invalid;
+        }
+        len = be32_to_cpup((uint32_t *)p);
+        p += 4;
+        if (len > end - p) {
+            goto invalid;
+        }
+        if (len == strlen(context) && !memcmp(p, context, len)) {
+            client->base_allocation = true;
+        }
+        p += len;
+    }
+    if (p != end) {
+        goto invalid;
+    }
+
+    if (client->base_allocation) {
+        /* The context gets id 0, followed by its name */
+        rc = nbd_send_rep_len(csock, NBD_REP_META_CONTEXT,
+                              NBD_OPT_SET_META_CONTEXT,
+                              sizeof(id) + strlen(context));
+        if (rc < 0) {
+            goto out;
+        }
+        id = cpu_to_be32(0);
+        if (write_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            write_sync(csock, (char *)context, strlen(context)) !=
+            strlen(context)) {
+            LOG("write failed (meta context)");
+            rc = -EINVAL;
+            goto out;
+        }
+    }
+    rc = nbd_send_rep(csock, NBD_REP_ACK, NBD_OPT_SET_META_CONTEXT);
+    goto out;
+
+invalid:
+    client->base_allocation = false;
+    rc = nbd_send_rep(csock, NBD_REP_ERR_INVALID, NBD_OPT_SET_META_CONTEXT);
+out:
+    g_free(buf);
+    return rc;
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
@@ -495,11 +635,37 @@ static int nbd_receive_options(NBDClient *client)
         case NBD_OPT_EXPORT_NAME:
             return nbd_handle_export_name(client, length);
 
+        case NBD_OPT_STRUCTURED_REPLY:
+            ret = nbd_handle_structured_reply(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
+        case NBD_OPT_SET_META_CONTEXT:
+            ret = nbd_handle_set_meta_context(client, length);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+
         default:
             tmp = be32_to_cpu(tmp);
             LOG("Unsupported option 0x%x", tmp);
-            nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
-            return -EINVAL;
+            if (!(flags & NBD_FLAG_C_FIXED_NEWSTYLE)) {
+                nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+                return -EINVAL;
+            }
+
+            /* Fixed newstyle clients may go on with other options */
+            if (drop_sync(csock, length) != length) {
+                return -EIO;
+            }
+            ret = nbd_send_rep(client->sock, NBD_REP_ERR_UNSUP, tmp);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
         }
     }
 }
@@ -509,8 +675,11 @@ static int nbd_send_negotiate(NBDClient *client)
     int csock = client->sock;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush on any
+     * connection covers writes completed on the others.  */
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -579,17 +748,195 @@ fail:
     return rc;
 }
 
+static int nbd_send_option(int csock, uint32_t opt, uint32_t len,
+                           const void *data, Error **errp)
+{
+    uint64_t magic;
+
+    /* Client sends:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   NBD option
+        [12 ..  15]   Data length
+        ...           Data
+     */
+    magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -EINVAL;
+    }
+    opt = cpu_to_be32(opt);
+    if (write_sync(csock, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -EINVAL;
+    }
+    len = cpu_to_be32(len);
+    if (write_sync(csock, &len, sizeof(len)) != sizeof(len)) {
+        error_setg(errp, "Failed to send option length");
+        return -EINVAL;
+    }
+    len = be32_to_cpu(len);
+    if (len && write_sync(csock, (void *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_rep(int csock, uint32_t opt, uint32_t *type,
+                           uint32_t *len, Error **errp)
+{
+    uint64_t magic;
+    uint32_t rep_opt;
+
+    /* Server sends:
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   NBD option
+        [12 ..  15]   Reply type
+        [16 ..  19]   Data length
+     */
+    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic) ||
+        read_sync(csock, &rep_opt, sizeof(rep_opt)) != sizeof(rep_opt) ||
+        read_sync(csock, type, sizeof(*type)) != sizeof(*type) ||
+        read_sync(csock, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Bad option reply magic received");
+        return -EINVAL;
+    }
+    if (be32_to_cpu(rep_opt) != opt) {
+        error_setg(errp, "Option reply for unexpected option 0x%x",
+                   be32_to_cpu(rep_opt));
+        return -EINVAL;
+    }
+    *type = be32_to_cpu(*type);
+    *len = be32_to_cpu(*len);
+    return 0;
+}
+
+/* Ask a fixed newstyle server for structured replies and, if it agrees,
+ * for the "base:allocation" metadata context of export @name.  Servers
+ * that do not know an option turn it down, so only transport errors are
+ * fatal here.  Older servers, QEMU's among them, hang up right after
+ * that though; see nbd_receive_negotiate().
+ */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext, Error **errp)
+{
+    const char *context = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t type, len, id;
+    uint8_t *buf, *p;
+    char ctx[64];
+    int rc;
+
+    rc = nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, 0, NULL, errp);
+    if (rc < 0) {
+        return rc;
+    }
+    rc = nbd_receive_rep(csock, NBD_OPT_STRUCTURED_REPLY, &type, &len, errp);
+    if (rc < 0) {
+        return rc;
+    }
+    if (type == NBD_REP_ACK && len == 0) {
+        ext->structured_reply = true;
+    } else if (!NBD_REP_IS_ERR(type)) {
+        error_setg(errp, "Unexpected reply 0x%x to structured reply option",
+                   type);
+        return -EINVAL;
+    }
+    if (len && drop_sync(csock, len) != len) {
+        error_setg(errp, "Failed to read option reply");
+        return -EINVAL;
+    }
+    if (!ext->structured_reply) {
+        return 0;
+    }
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries (1)
+        [+4 .. +7]    query length
+        ...           query
+     */
+    len = 4 + strlen(name) + 4 + 4 + strlen(context);
+    buf = p = g_malloc(len);
+    cpu_to_be32w((uint32_t *)p, strlen(name));
+    p += 4;
+    memcpy(p, name, strlen(name));
+    p += strlen(name);
+    cpu_to_be32w((uint32_t *)p, 1);
+    p += 4;
+    cpu_to_be32w((uint32_t *)p, strlen(context));
+    p += 4;
+    memcpy(p, context, strlen(context));
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, len, buf, errp);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    while (1) {
+        rc = nbd_receive_rep(csock, NBD_OPT_SET_META_CONTEXT, &type, &len,
+                             errp);
+        if (rc < 0) {
+            return rc;
+        }
+        if (type == NBD_REP_ACK && len == 0) {
+            return 0;
+        }
+        if (NBD_REP_IS_ERR(type)) {
+            ext->base_allocation = false;
+            if (len && drop_sync(csock, len) != len) {
+                error_setg(errp, "Failed to read option reply");
+                return -EINVAL;
+            }
+            return 0;
+        }
+        if (type != NBD_REP_META_CONTEXT || len < sizeof(id) ||
+            len - sizeof(id) >= sizeof(ctx)) {
+            error_setg(errp, "Unexpected reply 0x%x to meta context option",
+                       type);
+            return -EINVAL;
+        }
+
+        len -= sizeof(id);
+        if (read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, ctx, len) != len) {
+            error_setg(errp, "Failed to read meta context reply");
+            return -EINVAL;
+        }
+        ctx[len] = '\0';
+        if (strcmp(ctx, context) == 0) {
+            ext->base_allocation = true;
+            ext->meta_context_id = be32_to_cpu(id);
+        }
+    }
+}
+
+/* Negotiate export @name, or the old style handshake if @name is NULL.
+ * With @ext, ask for the protocol extensions in NBDExtensions.
+ *
+ * Returns -ECONNRESET if the handshake failed after the server turned
+ * down the extensions, as servers that hang up on unknown options do.
+ * The caller should connect again and negotiate without @ext.
+ */
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
     uint16_t tmp;
+    bool refused = false;
     int rc;
 
     TRACE("Receiving negotiation.");
 
     rc = -EINVAL;
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
 
     if (read_sync(csock, buf, 8) != 8) {
         error_setg(errp, "Failed to read data");
@@ -625,7 +972,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t clientflags = 0;
         uint32_t opt;
         uint32_t namesize;
 
@@ -643,12 +990,20 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            error_setg(errp, "Failed to read reserved field");
+        if (be16_to_cpu(tmp) & NBD_FLAG_FIXED_NEWSTYLE) {
+            clientflags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &clientflags, sizeof(clientflags)) !=
+            sizeof(clientflags)) {
+            error_setg(errp, "Failed to send client flags");
             goto fail;
         }
+        if (ext && clientflags) {
+            if (nbd_negotiate_extensions(csock, name, ext, errp) < 0) {
+                goto fail;
+            }
+            refused = !ext->structured_reply;
+        }
         /* write the export name */
         magic = cpu_to_be64(magic);
         if (write_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -710,6 +1065,9 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     rc = 0;
 
 fail:
+    if (rc < 0 && refused) {
+        rc = -ECONNRESET;
+    }
     return rc;
 }
 
@@ -899,13 +1257,48 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
         return -EINVAL;
     }
 
+    magic = be32_to_cpup((uint32_t*)buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        uint32_t length;
+
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags   (NBD_REPLY_FLAG_*)
+           [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+           [ 8 .. 15]    handle
+           [16 .. 19]    payload length
+         */
+        reply->structured = true;
+        reply->flags  = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type   = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
+        reply->error  = 0;
+
+        /* The rest of the header is already on its way */
+        do {
+            ret = read_sync(csock, &length, sizeof(length));
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(length)) {
+            LOG("read failed");
+            return ret < 0 ? ret : -EINVAL;
+        }
+        reply->length = be32_to_cpu(length);
+
+        TRACE("Got structured reply: "
+              "{ flags = 0x%x, type = %d, handle = %" PRIu64 ", length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
-
-    magic = be32_to_cpup((uint32_t*)buf);
+    reply->structured = false;
+    reply->flags  = 0;
+    reply->type   = 0;
+    reply->length = 0;
     reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
@@ -1209,6 +1602,239 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+/* Send one structured reply chunk: the chunk header, @hdr_len bytes of
+ * type-specific payload header and @data_len bytes of data.
+ */
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 void *hdr, size_t hdr_len,
+                                 void *data, size_t data_len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    ssize_t rc = 0;
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_*)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    payload length
+     */
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), hdr_len + data_len);
+
+    TRACE("Sending chunk { flags = 0x%x, type = %d, length = %zu }",
+          flags, type, hdr_len + data_len);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    socket_set_cork(csock, 1);
+    if (qemu_co_send(csock, buf, sizeof(buf)) != sizeof(buf) ||
+        (hdr_len && qemu_co_send(csock, hdr, hdr_len) != hdr_len) ||
+        (data_len && qemu_co_send(csock, data, data_len) != data_len)) {
+        LOG("writing to socket failed");
+        rc = -EIO;
+    }
+    socket_set_cork(csock, 0);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_structured_error(NBDRequest *req, uint64_t handle,
+                                            int error)
+{
+    uint8_t buf[6];
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length (0)
+     */
+    cpu_to_be32w((uint32_t*)buf, system_errno_to_nbd_errno(error));
+    cpu_to_be16w((uint16_t*)(buf + 4), 0);
+
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, buf, sizeof(buf), NULL, 0);
+}
+
+/* Return how many sectors from @sector_num on read as zeroes (*zero set)
+ * or as data (*zero clear), merging consecutive block status ranges.
+ * Ranges whose status cannot be determined are treated as data.
+ */
+static int nbd_get_zero_run(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors, bool *zero)
+{
+    int total = 0;
+
+    while (total < nb_sectors) {
+        int64_t ret;
+        bool is_zero;
+        int n;
+
+        ret = bdrv_get_block_status_above(bs, NULL, sector_num + total,
+                                          nb_sectors - total, &n);
+        if (ret < 0 || n <= 0) {
+            if (total == 0) {
+                *zero = false;
+                return nb_sectors;
+            }
+            break;
+        }
+
+        is_zero = !!(ret & BDRV_BLOCK_ZERO);
+        if (total == 0) {
+            *zero = is_zero;
+        } else if (is_zero != *zero) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/* Reply to a READ with structured replies: zeroed ranges are sent as holes
+ * without touching the data, the rest as data chunks.  Returns a negative
+ * value only if the connection must be dropped.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req, uint64_t handle,
+                                       uint64_t from, uint32_t len)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint32_t offset = 0;
+    ssize_t rc;
+
+    if (len == 0) {
+        return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+    }
+
+    while (offset < len) {
+        int64_t sector_num = (from + offset + exp->dev_offset)
+                             / BDRV_SECTOR_SIZE;
+        int nb_sectors = (len - offset) / BDRV_SECTOR_SIZE;
+        uint16_t flags;
+        uint8_t buf[12];
+        uint32_t size;
+        bool zero;
+        int n, ret;
+
+        n = nbd_get_zero_run(bs, sector_num, nb_sectors, &zero);
+        size = n * BDRV_SECTOR_SIZE;
+        flags = offset + size == len ? NBD_REPLY_FLAG_DONE : 0;
+        cpu_to_be64w((uint64_t*)buf, from + offset);
+
+        if (zero) {
+            /* Hole chunk payload
+               [ 0 ..  7]    offset
+               [ 8 .. 11]    hole size
+             */
+            cpu_to_be32w((uint32_t*)(buf + 8), size);
+            rc = nbd_co_send_chunk(req, handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_HOLE,
+                                   buf, 12, NULL, 0);
+        } else {
+            ret = blk_read(exp->blk, sector_num, req->data + offset, n);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(req, handle, -ret);
+            }
+
+            /* Data chunk payload
+               [ 0 ..  7]    offset
+               ...           data
+             */
+            rc = nbd_co_send_chunk(req, handle, flags,
+                                   NBD_REPLY_TYPE_OFFSET_DATA,
+                                   buf, 8, req->data + offset, size);
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        offset += size;
+    }
+
+    TRACE("Read %u byte(s)", len);
+    return 0;
+}
+
+/* Reply to a BLOCK_STATUS request for "base:allocation", describing at
+ * most one extent if @one is set.  Returns a negative value only if the
+ * connection must be dropped.
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req, uint64_t handle,
+                                        uint64_t from, uint32_t len, bool one)
+{
+    NBDExport *exp = req->client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    int max_extents = one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    NBDExtent *extents;
+    int nb_extents = 0;
+    uint32_t offset = 0;
+    uint32_t context_id;
+    ssize_t rc;
+    int i;
+
+    extents = g_new(NBDExtent, max_extents);
+    while (offset < len) {
+        int64_t ret;
+        uint32_t flags;
+        int n;
+
+        ret = bdrv_get_block_status_above(bs, NULL,
+                                          (from + offset + exp->dev_offset)
+                                          / BDRV_SECTOR_SIZE,
+                                          (len - offset) / BDRV_SECTOR_SIZE,
+                                          &n);
+        if (ret < 0) {
+            LOG("block status failed");
+            g_free(extents);
+            return nbd_co_send_structured_error(req, handle, -ret);
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (nb_extents && extents[nb_extents - 1].flags == flags) {
+            extents[nb_extents - 1].length += n * BDRV_SECTOR_SIZE;
+        } else if (nb_extents < max_extents) {
+            extents[nb_extents].length = n * BDRV_SECTOR_SIZE;
+            extents[nb_extents].flags = flags;
+            nb_extents++;
+        } else {
+            break;
+        }
+        offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    /* Block status chunk payload
+       [ 0 ..  3]    metadata context id
+       ...           for each extent, its length (4 bytes) and flags (4 bytes)
+     */
+    for (i = 0; i < nb_extents; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+    context_id = cpu_to_be32(0);
+    rc = nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                           NBD_REPLY_TYPE_BLOCK_STATUS,
+                           &context_id, sizeof(context_id),
+                           extents, nb_extents * sizeof(NBDExtent));
+    g_free(extents);
+    return rc;
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1227,7 +1853,11 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_MAX_BUFFER_SIZE) {
+    command = request->type & NBD_CMD_MASK_COMMAND;
+
+    /* Block status queries carry no data, so they may cover more */
+    if (command != NBD_CMD_BLOCK_STATUS &&
+        request->len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_MAX_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1243,7 +1873,6 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
 
     TRACE("Decoding type");
 
-    command = request->type & NBD_CMD_MASK_COMMAND;
     if (command == NBD_CMD_READ || command == NBD_CMD_WRITE) {
         req->data = blk_blockalign(client->exp->blk, request->len);
     }
@@ -1291,12 +1920,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
     if (command != NBD_CMD_DISC && (request.from + request.len) > exp->size) {
             LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
@@ -1327,6 +1956,18 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            /* Holes are found in units of sectors */
+            if ((request.from | request.len) % BDRV_SECTOR_SIZE) {
+                goto invalid_request;
+            }
+            if (nbd_co_send_sparse_read(req, request.handle, request.from,
+                                        request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = blk_read(exp->blk,
                        (request.from + exp->dev_offset) / BDRV_SECTOR_SIZE,
                        req->data, request.len / BDRV_SECTOR_SIZE);
@@ -1402,12 +2043,36 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+
+        if (!client->base_allocation) {
+            LOG("block status without a selected metadata context");
+            goto invalid_request;
+        }
+        if (request.len == 0 ||
+            (request.from | request.len) % BDRV_SECTOR_SIZE) {
+            goto invalid_request;
+        }
+        if (nbd_co_send_block_status(req, request.handle, request.from,
+                                     request.len,
+                                     request.type & NBD_CMD_FLAG_REQ_ONE) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
         reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(req, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
@@ -21,6 +21,7 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    uint64_t acked_features;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -36,6 +37,13 @@ VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+uint64_t vhost_user_get_acked_features(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->acked_features;
+}
+
 static int vhost_user_running(VhostUserState *s)
 {
     return (s->vhost_net) ? 1 : 0;
@@ -55,6 +63,11 @@ static void vhost_user_stop(int queues, NetClientState *ncs[])
         }
 
         if (s->vhost_net) {
+            /* keep what the guest negotiated for the next backend */
+            uint64_t features = vhost_net_get_acked_features(s->vhost_net);
+            if (features) {
+                s->acked_features = features;
+            }
             vhost_net_cleanup(s->vhost_net);
             s->vhost_net = NULL;
         }
@@ -106,12 +119,13 @@ err:
 static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
     /* In case of RARP (message size is 60) notify backup to send a fake RARP.
        This fake RARP will be sent by backend only for guest
        without GUEST_ANNOUNCE capability.
      */
-    if (size == 60) {
-        VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    if (size == 60 && s->vhost_net) {
         int r;
         static int display_rarp_failure = 1;
         char mac_addr[6];
@@ -188,7 +202,11 @@ static void net_vhost_user_event(void *opaque, int event)
         qmp_set_link(name, true, &err);
         break;
     case CHR_EVENT_CLOSED:
-        qmp_set_link(name, true, &err);
+        /* Taking the link down makes virtio-net stop vhost and save the
+         * ring state, so that every queue resumes where it was once the
+         * backend comes back (e.g. through the chardev's reconnect option).
+         */
+        qmp_set_link(name, false, &err);
         vhost_user_stop(queues, ncs);
         break;
     }
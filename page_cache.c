@@ -35,11 +35,19 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Pages are mapped to a set of PAGE_CACHE_WAYS entries, and can be stored in
+ * any entry of the set.  This way, a few hot pages whose addresses map to the
+ * same set do not keep evicting each other.
+ */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
@@ -47,6 +55,8 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -77,8 +87,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u pages\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -92,6 +105,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -114,31 +128,82 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first entry of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/*
+ * The hit count of a page is halved for every bitmap generation in which it
+ * was not used, so that pages that were hot long ago can still be evicted.
+ */
+static uint32_t cache_item_score(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age - it->it_age;
 
-    return &cache->page_cache[pos];
+    return idle >= 32 ? 0 : it->it_hits >> idle;
+}
+
+/*
+ * Chooses the entry of the set where a new page is stored: a free one if
+ * there is one, otherwise the page that is the least used recently.  Pages
+ * that are younger than CACHED_PAGE_LIFETIME are not replaced.
+ *
+ * Returns NULL if every page of the set is fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    uint32_t score, victim_score = 0;
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        score = cache_item_score(it, current_age);
+        if (!victim || score < victim_score ||
+            (score == victim_score && it->it_age < victim->it_age)) {
+            victim = it;
+            victim_score = score;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -148,9 +213,12 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
+    if (it) {
+        /* update the it_age and hit count when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < UINT32_MAX) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
@@ -164,12 +232,15 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            /* all the pages in the set are fresh, don't replace them */
+            return -1;
+        }
+        it->it_hits = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -192,8 +263,9 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *new_it, *set;
 
     g_assert(cache);
 
@@ -216,27 +288,40 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+        if (old_it->it_addr == -1) {
+            continue;
+        }
+
+        /* use a free entry, or replace the LRU page if it is older */
+        set = cache_get_set(new_cache, old_it->it_addr);
+        new_it = &set[0];
+        for (j = 0; j < new_cache->num_ways; j++) {
+            if (!set[j].it_data) {
+                new_it = &set[j];
+                break;
+            }
+            if (set[j].it_age < new_it->it_age) {
+                new_it = &set[j];
+            }
+        }
+
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            /* keep the MRU page */
+            g_free(old_it->it_data);
+        } else {
+            if (!new_it->it_data) {
+                new_cache->num_items++;
             }
+            g_free(new_it->it_data);
+            *new_it = *old_it;
         }
     }
 
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
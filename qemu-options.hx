@@ -86,6 +86,34 @@ ETEXI
 HXCOMM Deprecated by -machine
 DEF("M", HAS_ARG, QEMU_OPTION_M, "", QEMU_ARCH_ALL)
 
+DEF("accel", HAS_ARG, QEMU_OPTION_accel,
+    "-accel [accel=]accelerator[,thread=single|multi][,trace-threshold=n]\n"
+    "                select accelerator (kvm, xen or tcg)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                trace-threshold=n (retranslate TBs run n times as traces)\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -accel @var{name}[,prop=@var{value}[,...]]
+@findex -accel
+This is used to enable an accelerator. Depending on the target architecture,
+kvm, xen, or tcg can be available. By default, tcg is used.
+@table @option
+@item thread=single|multi
+Controls the number of TCG threads. With @code{thread=multi} each vCPU runs
+on its own host thread, taking advantage of additional host cores. This is
+only available when both the guest and the host architectures support it,
+and is incompatible with @option{-icount} and record/replay. The default is
+@code{single}, where all vCPUs share one thread.
+@item trace-threshold=@var{n}
+Once a translated block has run @var{n} times, retranslate it as a trace
+that continues through forward direct jumps on the same page, and loops
+without leaving the trace when a jump goes back to its start, so that the
+code generator can optimize across the original block boundaries. Blocks
+that such a trace would not extend are left alone. Only some targets build
+traces. The default is 0, which disables traces.
+@end table
+ETEXI
+
 DEF("cpu", HAS_ARG, QEMU_OPTION_cpu,
     "-cpu cpu        select CPU ('-cpu help' for list)\n", QEMU_ARCH_ALL)
 STEXI
@@ -464,7 +492,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -507,7 +535,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO, io_uring does not require cache.direct=on.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -1999,6 +2027,10 @@ end of the socket. On non-MSIX guests, the feature can be forced with
 @var{vhostforce}. Use 'queues=@var{n}' to specify the number of queues to
 be created for multiqueue vhost-user.
 
+If the chardev is created with the @option{reconnect} option, the link goes
+down while the backend is away; the negotiated features and the state of each
+queue are handed to the backend again when it reconnects.
+
 Example:
 @example
 qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,share=on \
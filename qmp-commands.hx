@@ -1375,7 +1375,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1392,6 +1392,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file, so that it survives
+                shutdown of QEMU (json-bool, optional, default false)
 
 Example:
 
@@ -2818,6 +2820,12 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling window multiplier, 0 for the default (json-int)
+- "poll-shrink": polling window divisor, 0 to reset (json-int)
+- "poll-ns": current polling window in ns (json-int)
+- "poll-hits": number of waits that polling satisfied (json-int)
+- "poll-misses": number of waits that had to sleep (json-int)
 
 Example:
 
@@ -2826,11 +2834,23 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":8000,
+            "poll-hits":1027,
+            "poll-misses":85
          }
       ]
    }
@@ -3463,6 +3483,7 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size in bytes
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of XBZRLE page cache hits
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
          - "overflow": number of times XBZRLE overflows.  This means
@@ -3572,6 +3593,7 @@ Examples:
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
+            "cache-hit":8320,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
             "overflow":34434
@@ -3598,6 +3620,8 @@ Enable/Disable migration capabilities
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
 - "events": generate events for each migration state change
+- "x-multifd": send RAM over several connections
+- "dirty-bitmaps": migrate named dirty bitmaps
 
 Arguments:
 
@@ -3650,6 +3674,10 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "x-multifd-channels": set the number of RAM connections for multifd
+                        migration (json-int)
+- "x-postcopy-prefetch-pages": set the maximum number of pages sent ahead of
+                               a postcopy page fault (json-int)
 
 Arguments:
 
@@ -3663,7 +3691,8 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-multifd-channels:i?,x-postcopy-prefetch-pages:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3676,6 +3705,9 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "x-multifd-channels" : number of multifd RAM connections (json-int)
+         - "x-postcopy-prefetch-pages" : maximum number of pages sent ahead
+                                         of a postcopy fault (json-int)
 
 Arguments:
 
@@ -3686,7 +3718,9 @@ Example:
       "return": {
          "decompress-threads", 2,
          "compress-threads", 8,
-         "compress-level", 1
+         "compress-level", 1,
+         "x-multifd-channels", 2,
+         "x-postcopy-prefetch-pages", 64
       }
    }
 
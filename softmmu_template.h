@@ -125,7 +125,7 @@
     int vidx;                                                                 \
     CPUIOTLBEntry tmpiotlb;                                                   \
     CPUTLBEntry tmptlb;                                                       \
-    for (vidx = CPU_VTLB_SIZE-1; vidx >= 0; --vidx) {                         \
+    for (vidx = CPU_VTLB_ENTRIES(env, mmu_idx) - 1; vidx >= 0; --vidx) {      \
         if (env->tlb_v_table[mmu_idx][vidx].ty == (addr & TARGET_PAGE_MASK)) {\
             /* found entry in victim tlb, swap tlb and iotlb */               \
             tmptlb = env->tlb_table[mmu_idx][index];                          \
@@ -137,6 +137,12 @@
             break;                                                            \
         }                                                                     \
     }                                                                         \
+    if (vidx >= 0) {                                                          \
+        env->vtlb_hit_count++;                                                \
+        env->vtlb_window_hits[mmu_idx]++;                                     \
+    } else {                                                                  \
+        env->vtlb_miss_count++;                                               \
+    }                                                                         \
     /* return true when there is a vtlb hit, i.e. vidx >=0 */                 \
     vidx >= 0;                                                                \
 })
@@ -159,8 +165,16 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     }
 
     cpu->mem_io_vaddr = addr;
-    memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
-                                iotlbentry->attrs);
+
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
+                                    iotlbentry->attrs);
+        qemu_mutex_unlock_iothread();
+    } else {
+        memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
+                                    iotlbentry->attrs);
+    }
     return val;
 }
 #endif
@@ -366,8 +380,16 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
-    memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
-                                 iotlbentry->attrs);
+
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
+                                     iotlbentry->attrs);
+        qemu_mutex_unlock_iothread();
+    } else {
+        memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
+                                     iotlbentry->attrs);
+    }
 }
 
 void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
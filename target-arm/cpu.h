@@ -97,6 +97,9 @@ struct arm_boot_info;
 #define NB_MMU_MODES 7
 #define TARGET_INSN_START_EXTRA_WORDS 1
 
+/* Exclusive stores and barriers are safe with multi-threaded TCG.  */
+#define TARGET_SUPPORTS_MTTCG
+
 /* We currently assume float and double are IEEE single and double
    precision respectively.
    Doing runtime conversions is tricky because VFP registers may contain
@@ -1241,7 +1241,12 @@ static void handle_sync(DisasContext *s, uint32_t insn,
         return;
     case 4: /* DSB */
     case 5: /* DMB */
-        /* We don't emulate caches so barriers are no-ops */
+        /* We don't emulate caches so barriers only need to order
+         * accesses against other vCPUs running in parallel.
+         */
+        if (s->tb->cflags & CF_PARALLEL) {
+            gen_helper_memory_barrier();
+        }
         return;
     case 6: /* ISB */
         /* We need to break the TB after this insn to execute
@@ -1753,11 +1758,23 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
      * }
      * env->exclusive_addr = -1;
      */
-    TCGLabel *fail_label = gen_new_label();
-    TCGLabel *done_label = gen_new_label();
-    TCGv_i64 addr = tcg_temp_local_new_i64();
+    TCGLabel *fail_label;
+    TCGLabel *done_label;
+    TCGv_i64 addr;
     TCGv_i64 tmp;
 
+    if (s->tb->cflags & CF_PARALLEL) {
+        /* The check-and-store below is only atomic with the other
+         * vCPUs stopped.
+         */
+        gen_exception_internal_insn(s, 4, EXCP_ATOMIC);
+        return;
+    }
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    addr = tcg_temp_local_new_i64();
+
     /* Copy input into a local temp so it is not trashed when the
      * basic block ends at the branch insn.
      */
@@ -1842,9 +1859,12 @@ static void disas_ldst_excl(DisasContext *s, uint32_t insn)
     }
     tcg_addr = read_cpu_reg_sp(s, rn, 1);
 
-    /* Note that since TCG is single threaded load-acquire/store-release
-     * semantics require no extra if (is_lasr) { ... } handling.
+    /* Load-acquire/store-release semantics only need extra barriers
+     * when other vCPUs run in parallel.
      */
+    if (is_lasr && is_store && (s->tb->cflags & CF_PARALLEL)) {
+        gen_helper_memory_barrier();
+    }
 
     if (is_excl) {
         if (!is_store) {
@@ -1861,6 +1881,10 @@ static void disas_ldst_excl(DisasContext *s, uint32_t insn)
             do_gpr_ld(s, tcg_rt, tcg_addr, size, false, false);
         }
     }
+
+    if (is_lasr && !is_store && (s->tb->cflags & CF_PARALLEL)) {
+        gen_helper_memory_barrier();
+    }
 }
 
 /*
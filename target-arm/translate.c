@@ -5205,6 +5205,46 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        /* Plain element-wise add/sub and most logic ops go through the
+         * generic vector expansion, which uses host SIMD where it can.
+         */
+        switch (op) {
+        case NEON_3R_VADD_VSUB:
+            if (u) {
+                tcg_gen_gvec_sub(cpu_env, size, vfp_reg_offset(1, rd),
+                                 vfp_reg_offset(1, rn),
+                                 vfp_reg_offset(1, rm), q ? 16 : 8);
+            } else {
+                tcg_gen_gvec_add(cpu_env, size, vfp_reg_offset(1, rd),
+                                 vfp_reg_offset(1, rn),
+                                 vfp_reg_offset(1, rm), q ? 16 : 8);
+            }
+            return 0;
+        case NEON_3R_LOGIC:
+            switch ((u << 2) | size) {
+            case 0: /* VAND */
+                tcg_gen_gvec_and(cpu_env, vfp_reg_offset(1, rd),
+                                 vfp_reg_offset(1, rn),
+                                 vfp_reg_offset(1, rm), q ? 16 : 8);
+                return 0;
+            case 1: /* VBIC */
+                tcg_gen_gvec_andc(cpu_env, vfp_reg_offset(1, rd),
+                                  vfp_reg_offset(1, rn),
+                                  vfp_reg_offset(1, rm), q ? 16 : 8);
+                return 0;
+            case 2: /* VORR */
+                tcg_gen_gvec_or(cpu_env, vfp_reg_offset(1, rd),
+                                vfp_reg_offset(1, rn),
+                                vfp_reg_offset(1, rm), q ? 16 : 8);
+                return 0;
+            case 4: /* VEOR */
+                tcg_gen_gvec_xor(cpu_env, vfp_reg_offset(1, rd),
+                                 vfp_reg_offset(1, rn),
+                                 vfp_reg_offset(1, rm), q ? 16 : 8);
+                return 0;
+            }
+            break;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7485,6 +7525,14 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGLabel *done_label;
     TCGLabel *fail_label;
 
+    if (s->tb->cflags & CF_PARALLEL) {
+        /* The check-and-store below is only atomic with the other
+         * vCPUs stopped.
+         */
+        gen_exception_internal_insn(s, 4, EXCP_ATOMIC);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -7722,7 +7770,12 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
             case 4: /* dsb */
             case 5: /* dmb */
                 ARCH(7);
-                /* We don't emulate caches so these are a no-op.  */
+                /* We don't emulate caches so these only need to order
+                 * memory accesses against other vCPUs running in parallel.
+                 */
+                if (s->tb->cflags & CF_PARALLEL) {
+                    gen_helper_memory_barrier();
+                }
                 return;
             case 6: /* isb */
                 /* We need to break the TB after this insn to execute
@@ -8452,22 +8505,26 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
                         /* SWP instruction */
                         rm = (insn) & 0xf;
 
-                        /* ??? This is not really atomic.  However we know
-                           we never have multiple CPUs running in parallel,
-                           so it is good enough.  */
-                        addr = load_reg(s, rn);
-                        tmp = load_reg(s, rm);
-                        tmp2 = tcg_temp_new_i32();
-                        if (insn & (1 << 22)) {
-                            gen_aa32_ld8u(tmp2, addr, get_mem_index(s));
-                            gen_aa32_st8(tmp, addr, get_mem_index(s));
+                        /* ??? This is not really atomic.  It is good
+                           enough as long as no other CPU runs in
+                           parallel; otherwise stop the world first.  */
+                        if (s->tb->cflags & CF_PARALLEL) {
+                            gen_exception_internal_insn(s, 4, EXCP_ATOMIC);
                         } else {
-                            gen_aa32_ld32u(tmp2, addr, get_mem_index(s));
-                            gen_aa32_st32(tmp, addr, get_mem_index(s));
+                            addr = load_reg(s, rn);
+                            tmp = load_reg(s, rm);
+                            tmp2 = tcg_temp_new_i32();
+                            if (insn & (1 << 22)) {
+                                gen_aa32_ld8u(tmp2, addr, get_mem_index(s));
+                                gen_aa32_st8(tmp, addr, get_mem_index(s));
+                            } else {
+                                gen_aa32_ld32u(tmp2, addr, get_mem_index(s));
+                                gen_aa32_st32(tmp, addr, get_mem_index(s));
+                            }
+                            tcg_temp_free_i32(tmp);
+                            tcg_temp_free_i32(addr);
+                            store_reg(s, rd, tmp2);
                         }
-                        tcg_temp_free_i32(tmp);
-                        tcg_temp_free_i32(addr);
-                        store_reg(s, rd, tmp2);
                     }
                 }
             } else {
@@ -10037,7 +10094,12 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                             break;
                         case 4: /* dsb */
                         case 5: /* dmb */
-                            /* These execute as NOPs.  */
+                            /* These execute as NOPs, except for ordering
+                             * against other vCPUs running in parallel.
+                             */
+                            if (s->tb->cflags & CF_PARALLEL) {
+                                gen_helper_memory_barrier();
+                            }
                             break;
                         case 6: /* isb */
                             /* We need to break the TB after this insn
@@ -802,6 +802,14 @@ typedef struct {
 #define NB_MMU_MODES 3
 #define TARGET_INSN_START_EXTRA_WORDS 1
 
+/* Locked instructions are safe with multi-threaded TCG, but the guest
+   relies on TSO ordering of plain loads and stores.  */
+#define TARGET_SUPPORTS_MTTCG
+#define TARGET_STRONG_MO
+
+/* The translator follows direct jumps when building CF_TRACE blocks */
+#define TARGET_SUPPORTS_TB_TRACE
+
 #define NB_OPMASK_REGS 8
 
 typedef enum TPRAccess {
@@ -54,6 +54,15 @@ void helper_lock_init(void)
 }
 #endif
 
+/* Stop the world and re-execute the current instruction on its own */
+void helper_exit_atomic(CPUX86State *env)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+
+    cs->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit(cs);
+}
+
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
@@ -116,6 +116,7 @@ typedef struct DisasContext {
     int mem_index; /* select memory access functions */
     uint64_t flags; /* all execution flags */
     struct TranslationBlock *tb;
+    TCGLabel *trace_head; /* start of a CF_TRACE block, see gen_trace_loop */
     int popl_esp_hack; /* for correct popl with esp base handling */
     int rip_offset; /* only used in x86_64, but left for simplicity */
     int cpuid_features;
@@ -2226,6 +2227,56 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
+/* How a trace (CF_TRACE) continues at a direct jump to @eip.  Forward
+   targets on the TB's first page are translated inline (if @can_inline),
+   so that [tb->pc, tb->pc + tb->size) still covers all the code.  Jumps
+   back to the start of the TB close a loop inside the trace.
+
+   While the TB is only counted (CF_COUNT_HOT), this records whether a
+   trace would follow the jump, so that cpu_exec does not retranslate TBs
+   for nothing.  */
+enum {
+    TRACE_END,
+    TRACE_INLINE,
+    TRACE_LOOP,
+};
+
+static int trace_jump_kind(DisasContext *s, target_ulong eip, bool can_inline)
+{
+    target_ulong pc = eip + s->cs_base;
+    TranslationBlock *tb = s->tb;
+    int kind = TRACE_END;
+
+    if (!s->jmp_opt || !(tb->cflags & (CF_TRACE | CF_COUNT_HOT))) {
+        return TRACE_END;
+    }
+    if (pc == tb->pc) {
+        kind = TRACE_LOOP;
+    } else if (can_inline && pc > s->pc &&
+               (pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK)) {
+        kind = TRACE_INLINE;
+    }
+    if (!(tb->cflags & CF_TRACE)) {
+        if (kind != TRACE_END) {
+            tb->cflags |= CF_TRACE_JUMP;
+        }
+        return TRACE_END;
+    }
+    return kind;
+}
+
+/* Jump back to the start of the trace.  The exit request check at the
+   start of the TB also runs on every iteration.  */
+static void gen_trace_loop(DisasContext *s, target_ulong eip)
+{
+    gen_update_cc_op(s);
+    set_cc_op(s, CC_OP_DYNAMIC);
+    /* in case the TB is left at the top of the loop */
+    gen_jmp_im(eip);
+    tcg_gen_br(s->trace_head);
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
 static inline void gen_jcc(DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
@@ -2238,7 +2289,11 @@ static inline void gen_jcc(DisasContext *s, int b,
         gen_goto_tb(s, 0, next_eip);
 
         gen_set_label(l1);
-        gen_goto_tb(s, 1, val);
+        if (trace_jump_kind(s, val, false) == TRACE_LOOP) {
+            gen_trace_loop(s, val);
+        } else {
+            gen_goto_tb(s, 1, val);
+        }
         s->is_jmp = DISAS_TB_JUMP;
     } else {
         l1 = gen_new_label();
@@ -2525,6 +2580,16 @@ static void gen_exception(DisasContext *s, int trapno, target_ulong cur_eip)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* Locked accesses cannot be emulated while other vCPUs run in parallel;
+   leave the TB and execute the instruction again with the world stopped. */
+static void gen_exit_atomic(DisasContext *s, target_ulong cur_eip)
+{
+    gen_update_cc_op(s);
+    gen_jmp_im(cur_eip);
+    gen_helper_exit_atomic(cpu_env);
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
 /* an interrupt is different from an exception because of the
    privilege checks */
 static void gen_interrupt(DisasContext *s, int intno,
@@ -2586,6 +2651,23 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* Direct unconditional jump, which a trace may follow (see
+   trace_jump_kind).  */
+static void gen_jmp_direct(DisasContext *s, target_ulong eip)
+{
+    switch (trace_jump_kind(s, eip, true)) {
+    case TRACE_INLINE:
+        s->pc = eip + s->cs_base;
+        break;
+    case TRACE_LOOP:
+        gen_trace_loop(s, eip);
+        break;
+    default:
+        gen_jmp(s, eip);
+        break;
+    }
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
@@ -4345,6 +4427,33 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             }
         }
         switch(b) {
+        case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        case 0xd4: /* paddq */
+            tcg_gen_gvec_add(cpu_env, b == 0xd4 ? MO_64 : b - 0xfc,
+                             op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
+        case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+            tcg_gen_gvec_sub(cpu_env, b - 0xf8,
+                             op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
+        case 0xdb: /* pand */
+            tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
+        case 0xdf: /* pandn */
+            tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset,
+                              is_xmm ? 16 : 8);
+            break;
+        case 0xeb: /* por */
+            tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset,
+                            is_xmm ? 16 : 8);
+            break;
+        case 0xef: /* pxor */
+            tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8);
+            break;
         case 0x0f: /* 3DNow! data insns */
             if (!(s->cpuid_ext2_features & CPUID_EXT2_3DNOW))
                 goto illegal_op;
@@ -4566,8 +4675,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
+    if (prefixes & PREFIX_LOCK) {
+        if (s->tb->cflags & CF_PARALLEL) {
+            gen_exit_atomic(s, pc_start - s->cs_base);
+            return s->pc;
+        }
         gen_helper_lock();
+    }
 
     /* now check op code */
  reswitch:
@@ -5549,6 +5663,10 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_mov_reg_v(ot, rm, cpu_T[0]);
             gen_op_mov_reg_v(ot, reg, cpu_T[1]);
         } else {
+            if (s->tb->cflags & CF_PARALLEL) {
+                gen_exit_atomic(s, pc_start - s->cs_base);
+                break;
+            }
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T[0], reg);
             /* for xchg, lock is implicit */
@@ -6433,7 +6551,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             tcg_gen_movi_tl(cpu_T[0], next_eip);
             gen_push_v(s, cpu_T[0]);
-            gen_jmp(s, tval);
+            gen_jmp_direct(s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6462,7 +6580,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else if (!CODE64(s)) {
             tval &= 0xffffffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6484,7 +6602,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_direct(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -7731,6 +7849,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 /* mfence */
                 if ((modrm & 0xc7) != 0xc0 || !(s->cpuid_features & CPUID_SSE2))
                     goto illegal_op;
+                if (s->tb->cflags & CF_PARALLEL) {
+                    gen_helper_memory_barrier();
+                }
             }
             break;
         case 7: /* sfence / clflush / clflushopt / pcommit */
@@ -7977,6 +8098,11 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
         max_insns = TCG_MAX_INSNS;
     }
 
+    if (tb->cflags & CF_TRACE) {
+        /* before the exit request check, so that loops check it too */
+        dc->trace_head = gen_new_label();
+        gen_set_label(dc->trace_head);
+    }
     gen_tb_start(tb);
     for(;;) {
         tcg_gen_insn_start(pc_ptr, dc->cc_op);
@@ -281,6 +281,10 @@ typedef enum {
     I3312_LDRSHX    = 0x38000000 | LDST_LD_S_X << 22 | MO_16 << 30,
     I3312_LDRSWX    = 0x38000000 | LDST_LD_S_X << 22 | MO_32 << 30,
 
+    /* The 128-bit SIMD&FP forms, which tcg_out_ldst_q handles.  */
+    I3312_STRQ      = 0x3c000000 | 2 << 22,
+    I3312_LDRQ      = 0x3c000000 | 3 << 22,
+
     I3312_TO_I3310  = 0x00200800,
     I3312_TO_I3313  = 0x01000000,
 
@@ -360,6 +364,14 @@ typedef enum {
     I3510_EOR       = 0x4a000000,
     I3510_EON       = 0x4a200000,
     I3510_ANDS      = 0x6a000000,
+
+    /* AdvSIMD three same instructions.  */
+    I3616_ADD       = 0x0e208400,
+    I3616_SUB       = 0x2e208400,
+    I3616_AND       = 0x0e201c00,
+    I3616_BIC       = 0x0e601c00,
+    I3616_ORR       = 0x0ea01c00,
+    I3616_EOR       = 0x2e201c00,
 } AArch64Insn;
 
 static inline uint32_t tcg_in32(TCGContext *s)
@@ -518,6 +530,12 @@ static void tcg_out_insn_3313(TCGContext *s, AArch64Insn insn,
     tcg_out32(s, insn | I3312_TO_I3313 | scaled_uimm << 10 | rn << 5 | rd);
 }
 
+static void tcg_out_insn_3616(TCGContext *s, AArch64Insn insn, bool q,
+                              unsigned size, int rd, int rn, int rm)
+{
+    tcg_out32(s, insn | q << 30 | size << 22 | rm << 16 | rn << 5 | rd);
+}
+
 /* Register to register move using ORR (shifted register with no shift). */
 static void tcg_out_movr(TCGContext *s, TCGType ext, TCGReg rd, TCGReg rm)
 {
@@ -682,6 +700,38 @@ static void tcg_out_ldst(TCGContext *s, AArch64Insn insn,
     tcg_out_ldst_r(s, insn, rd, rn, TCG_TYPE_I64, TCG_REG_TMP);
 }
 
+/* As above, for the 128-bit vector register RD.  */
+static void tcg_out_ldst_q(TCGContext *s, AArch64Insn insn,
+                           int rd, TCGReg rn, intptr_t offset)
+{
+    if (offset >= 0 && !(offset & 15) && offset >> 4 <= 0xfff) {
+        tcg_out_insn_3313(s, insn, rd, rn, offset >> 4);
+        return;
+    }
+    if (offset >= -256 && offset < 256) {
+        tcg_out_insn_3312(s, insn, rd, rn, offset);
+        return;
+    }
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, offset);
+    tcg_out_ldst_r(s, insn, rd, rn, TCG_TYPE_I64, TCG_REG_TMP);
+}
+
+/* The v128 operations work from and to memory, using v0 and v1, which
+   the register allocator never hands out, as scratch.  */
+#define TCG_VEC_TMP0  0
+#define TCG_VEC_TMP1  1
+
+static void tcg_out_v128(TCGContext *s, AArch64Insn insn, unsigned size,
+                         TCGReg base, intptr_t dofs, intptr_t aofs,
+                         intptr_t bofs)
+{
+    tcg_out_ldst_q(s, I3312_LDRQ, TCG_VEC_TMP0, base, aofs);
+    tcg_out_ldst_q(s, I3312_LDRQ, TCG_VEC_TMP1, base, bofs);
+    tcg_out_insn_3616(s, insn, 1, size, TCG_VEC_TMP0,
+                      TCG_VEC_TMP0, TCG_VEC_TMP1);
+    tcg_out_ldst_q(s, I3312_STRQ, TCG_VEC_TMP0, base, dofs);
+}
+
 static inline void tcg_out_mov(TCGContext *s,
                                TCGType type, TCGReg ret, TCGReg arg)
 {
@@ -834,8 +884,12 @@ void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr)
 {
     tcg_insn_unit *code_ptr = (tcg_insn_unit *)jmp_addr;
     tcg_insn_unit *target = (tcg_insn_unit *)addr;
+    ptrdiff_t offset = target - code_ptr;
 
-    reloc_pc26(code_ptr, target);
+    assert(offset == sextract64(offset, 0, 26));
+    /* A single aligned word store, so that vCPU threads executing the
+       TB concurrently see either the old or the new branch.  */
+    atomic_set(code_ptr, deposit32(*code_ptr, 0, 26, offset));
     flush_icache_range(jmp_addr, jmp_addr + 4);
 }
 
@@ -1624,6 +1678,25 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_insn(s, 3508, SMULH, TCG_TYPE_I64, a0, a1, a2);
         break;
 
+    case INDEX_op_add_v128:
+        tcg_out_v128(s, I3616_ADD, a1, a0, a2, args[3], args[4]);
+        break;
+    case INDEX_op_sub_v128:
+        tcg_out_v128(s, I3616_SUB, a1, a0, a2, args[3], args[4]);
+        break;
+    case INDEX_op_and_v128:
+        tcg_out_v128(s, I3616_AND, 0, a0, a2, args[3], args[4]);
+        break;
+    case INDEX_op_or_v128:
+        tcg_out_v128(s, I3616_ORR, 0, a0, a2, args[3], args[4]);
+        break;
+    case INDEX_op_xor_v128:
+        tcg_out_v128(s, I3616_EOR, 0, a0, a2, args[3], args[4]);
+        break;
+    case INDEX_op_andc_v128:
+        tcg_out_v128(s, I3616_BIC, 0, a0, a2, args[3], args[4]);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -1748,6 +1821,13 @@ static const TCGTargetOpDef aarch64_op_defs[] = {
     { INDEX_op_muluh_i64, { "r", "r", "r" } },
     { INDEX_op_mulsh_i64, { "r", "r", "r" } },
 
+    { INDEX_op_add_v128, { "r" } },
+    { INDEX_op_sub_v128, { "r" } },
+    { INDEX_op_and_v128, { "r" } },
+    { INDEX_op_or_v128, { "r" } },
+    { INDEX_op_xor_v128, { "r" } },
+    { INDEX_op_andc_v128, { "r" } },
+
     { -1 },
 };
 
@@ -15,6 +15,9 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE  4
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 24
+
+/* Direct jumps are patched with a single aligned store.  */
+#define TCG_TARGET_SUPPORTS_MTTCG 1
 #undef TCG_TARGET_STACK_GROWSUP
 
 typedef enum {
@@ -101,6 +104,8 @@ typedef enum {
 #define TCG_TARGET_HAS_muluh_i64        1
 #define TCG_TARGET_HAS_mulsh_i64        1
 
+#define TCG_TARGET_HAS_v128             1
+
 static inline void flush_icache_range(uintptr_t start, uintptr_t stop)
 {
     __builtin___clear_cache((char *)start, (char *)stop);
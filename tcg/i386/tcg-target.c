@@ -133,6 +133,9 @@ static bool have_movbe;
    it there.  Therefore we always define the variable.  */
 bool have_bmi1;
 
+/* Likewise for SSE2, which is always present on x86_64.  */
+bool have_sse2 = TCG_TARGET_REG_BITS == 64;
+
 #if defined(CONFIG_CPUID_H) && defined(bit_BMI2)
 static bool have_bmi2;
 #else
@@ -333,6 +336,21 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVUPS_LOAD (0x10 | P_EXT)
+#define OPC_MOVUPS_STORE (0x11 | P_EXT)
+#define OPC_NOP         (0x90)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -1754,6 +1772,20 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* The v128 operations work from and to memory, using %xmm0 and %xmm1,
+   which the register allocator never hands out, as scratch.  */
+#define TCG_VEC_TMP0  0
+#define TCG_VEC_TMP1  1
+
+static void tcg_out_v128(TCGContext *s, int opc, TCGReg base,
+                         intptr_t dofs, intptr_t aofs, intptr_t bofs)
+{
+    tcg_out_modrm_offset(s, OPC_MOVUPS_LOAD, TCG_VEC_TMP0, base, aofs);
+    tcg_out_modrm_offset(s, OPC_MOVUPS_LOAD, TCG_VEC_TMP1, base, bofs);
+    tcg_out_modrm(s, opc, TCG_VEC_TMP0, TCG_VEC_TMP1);
+    tcg_out_modrm_offset(s, OPC_MOVUPS_STORE, TCG_VEC_TMP0, base, dofs);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1777,6 +1809,11 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
+            /* align the displacement so that it can be patched atomically
+               while other threads may be executing this TB */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, OPC_NOP);
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = tcg_current_code_size(s);
             tcg_out32(s, 0);
@@ -2097,6 +2134,38 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_add_v128:
+        {
+            static const int add_insn[4] = {
+                OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+            };
+            tcg_out_v128(s, add_insn[args[1]], args[0],
+                         args[2], args[3], args[4]);
+        }
+        break;
+    case INDEX_op_sub_v128:
+        {
+            static const int sub_insn[4] = {
+                OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+            };
+            tcg_out_v128(s, sub_insn[args[1]], args[0],
+                         args[2], args[3], args[4]);
+        }
+        break;
+    case INDEX_op_and_v128:
+        tcg_out_v128(s, OPC_PAND, args[0], args[2], args[3], args[4]);
+        break;
+    case INDEX_op_or_v128:
+        tcg_out_v128(s, OPC_POR, args[0], args[2], args[3], args[4]);
+        break;
+    case INDEX_op_xor_v128:
+        tcg_out_v128(s, OPC_PXOR, args[0], args[2], args[3], args[4]);
+        break;
+    case INDEX_op_andc_v128:
+        /* pandn complements its destination operand.  */
+        tcg_out_v128(s, OPC_PANDN, args[0], args[2], args[4], args[3]);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2238,6 +2307,13 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_ld_i64, { "r", "r", "L", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L", "L", "L" } },
 #endif
+
+    { INDEX_op_add_v128, { "r" } },
+    { INDEX_op_sub_v128, { "r" } },
+    { INDEX_op_and_v128, { "r" } },
+    { INDEX_op_or_v128, { "r" } },
+    { INDEX_op_xor_v128, { "r" } },
+    { INDEX_op_andc_v128, { "r" } },
     { -1 },
 };
 
@@ -2343,6 +2419,11 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifdef bit_SSE2
+        if (TCG_TARGET_REG_BITS == 32) {
+            have_sse2 = (d & bit_SSE2) != 0;
+        }
 #endif
     }
 
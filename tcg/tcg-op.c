@@ -1829,6 +1829,174 @@ void tcg_gen_extr32_i64(TCGv_i64 lo, TCGv_i64 hi, TCGv_i64 arg)
     tcg_gen_shri_i64(hi, arg, 32);
 }
 
+/* Vector operations.  Whole 16-byte chunks go to the host vector unit
+   when there is one; the rest is expanded into 64-bit operations, with
+   the carries between lanes masked for element sizes below 64 bits.  */
+
+static const uint64_t gvec_sign_mask[3] = {
+    0x8080808080808080ull, 0x8000800080008000ull, 0x8000000080000000ull
+};
+
+static void gen_vec_add_i64(unsigned vece, TCGv_i64 d,
+                            TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    /* Add the low bits of each lane, which cannot carry out of the
+       lane, then fix up the sign bits by hand.  */
+    m = tcg_const_i64(gvec_sign_mask[vece]);
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_vec_sub_i64(unsigned vece, TCGv_i64 d,
+                            TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    /* Set the sign bit of each lane of A so that no borrow crosses into
+       the next lane, then fix up the sign bits by hand.  */
+    m = tcg_const_i64(gvec_sign_mask[vece]);
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_vec_and_i64(unsigned vece, TCGv_i64 d,
+                            TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_vec_or_i64(unsigned vece, TCGv_i64 d,
+                           TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_vec_xor_i64(unsigned vece, TCGv_i64 d,
+                            TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_vec_andc_i64(unsigned vece, TCGv_i64 d,
+                             TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void tcg_gen_gvec_3(TCGOpcode opc_v128,
+                           void (*fni8)(unsigned, TCGv_i64,
+                                        TCGv_i64, TCGv_i64),
+                           TCGv_ptr env, unsigned vece, uint32_t dofs,
+                           uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    uint32_t i = 0;
+
+    tcg_debug_assert(vece <= MO_64);
+    tcg_debug_assert((oprsz & 7) == 0);
+
+    if (TCG_TARGET_HAS_v128) {
+        for (; i + 16 <= oprsz; i += 16) {
+            tcg_gen_op5(&tcg_ctx, opc_v128, GET_TCGV_PTR(env), vece,
+                        dofs + i, aofs + i, bofs + i);
+        }
+    }
+
+    if (i < oprsz) {
+        TCGv_i64 t0 = tcg_temp_new_i64();
+        TCGv_i64 t1 = tcg_temp_new_i64();
+
+        for (; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(t0, env, aofs + i);
+            tcg_gen_ld_i64(t1, env, bofs + i);
+            fni8(vece, t0, t0, t1);
+            tcg_gen_st_i64(t0, env, dofs + i);
+        }
+
+        tcg_temp_free_i64(t0);
+        tcg_temp_free_i64(t1);
+    }
+}
+
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_add_v128, gen_vec_add_i64,
+                   env, vece, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_sub_v128, gen_vec_sub_i64,
+                   env, vece, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_and(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_and_v128, gen_vec_and_i64,
+                   env, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_or(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_or_v128, gen_vec_or_i64,
+                   env, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_xor_v128, gen_vec_xor_i64,
+                   env, MO_64, dofs, aofs, bofs, oprsz);
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz)
+{
+    tcg_gen_gvec_3(INDEX_op_andc_v128, gen_vec_andc_i64,
+                   env, MO_64, dofs, aofs, bofs, oprsz);
+}
+
 /* QEMU specific operations.  */
 
 void tcg_gen_goto_tb(unsigned idx)
@@ -173,6 +173,14 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* v128 */
+DEF(add_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+DEF(sub_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+DEF(and_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+DEF(or_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+DEF(xor_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+DEF(andc_v128, 0, 1, 4, TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_v128))
+
 #define TLADDR_ARGS  (TARGET_LONG_BITS <= TCG_TARGET_REG_BITS ? 1 : 2)
 #define DATA64_ARGS  (TCG_TARGET_REG_BITS == 64 ? 1 : 2)
 
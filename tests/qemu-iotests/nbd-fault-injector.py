@@ -35,6 +35,9 @@
 #
 # Other error injection actions could be added in the future.
 #
+# With --refuse-options the server behaves like older fixed newstyle servers:
+# it turns down any option other than NBD_OPT_EXPORT_NAME and then hangs up.
+#
 # Copyright Red Hat, Inc. 2014
 #
 # Authors:
@@ -61,6 +64,9 @@ NBD_PASSWD = 0x4e42444d41474943
 NBD_OPTS_MAGIC = 0x49484156454F5054
 NBD_CLIENT_MAGIC = 0x0000420281861253
 NBD_OPT_EXPORT_NAME = 1 << 0
+NBD_FLAG_FIXED_NEWSTYLE = 1 << 0
+NBD_REP_MAGIC = 0x3e889045565a9
+NBD_REP_ERR_UNSUP = (1 << 31) | 1
 
 # Protocol structs
 neg_classic_struct = struct.Struct('>QQQI124x')
@@ -68,6 +74,7 @@ neg1_struct = struct.Struct('>QQH')
 export_tuple = collections.namedtuple('Export', 'reserved magic opt len')
 export_struct = struct.Struct('>IQII')
 neg2_struct = struct.Struct('>QH124x')
+option_reply_struct = struct.Struct('>QIII')
 request_tuple = collections.namedtuple('Request', 'magic type handle from_ len')
 request_struct = struct.Struct('>IIQQI')
 reply_struct = struct.Struct('>IIQ')
@@ -135,28 +142,36 @@ def negotiate_classic(conn):
                                   FAKE_DISK_SIZE, 0)
     conn.send(buf, event='neg-classic')
 
-def negotiate_export(conn):
+def negotiate_export(conn, refuse_options):
     # Send negotiation part 1
-    buf = neg1_struct.pack(NBD_PASSWD, NBD_OPTS_MAGIC, 0)
+    flags = NBD_FLAG_FIXED_NEWSTYLE if refuse_options else 0
+    buf = neg1_struct.pack(NBD_PASSWD, NBD_OPTS_MAGIC, flags)
     conn.send(buf, event='neg1')
 
     # Receive export option
     buf = conn.recv(export_struct.size, event='export')
     export = export_tuple._make(export_struct.unpack(buf))
     assert export.magic == NBD_OPTS_MAGIC
+    if refuse_options and export.opt != NBD_OPT_EXPORT_NAME:
+        _ = conn.recv(export.len, event='option-data')
+        buf = option_reply_struct.pack(NBD_REP_MAGIC, export.opt,
+                                       NBD_REP_ERR_UNSUP, 0)
+        conn.send(buf, event='option-reply')
+        return False
     assert export.opt == NBD_OPT_EXPORT_NAME
     name = conn.recv(export.len, event='export-name')
 
     # Send negotiation part 2
     buf = neg2_struct.pack(FAKE_DISK_SIZE, 0)
     conn.send(buf, event='neg2')
+    return True
 
-def negotiate(conn, use_export):
-    '''Negotiate export with client'''
+def negotiate(conn, use_export, refuse_options):
+    '''Negotiate export with client, return False if it was turned away'''
     if use_export:
-        negotiate_export(conn)
-    else:
-        negotiate_classic(conn)
+        return negotiate_export(conn, refuse_options)
+    negotiate_classic(conn)
+    return True
 
 def read_request(conn):
     '''Parse NBD request from client'''
@@ -169,8 +184,11 @@ def write_reply(conn, error, handle):
     buf = reply_struct.pack(NBD_REPLY_MAGIC, error, handle)
     conn.send(buf, event='reply')
 
-def handle_connection(conn, use_export):
-    negotiate(conn, use_export)
+def handle_connection(conn, use_export, refuse_options):
+    if not negotiate(conn, use_export, refuse_options):
+        print 'Closing connection after refusing an option'
+        conn.close()
+        return
     while True:
         req = read_request(conn)
         if req.type == NBD_CMD_READ:
@@ -186,10 +204,11 @@ def handle_connection(conn, use_export):
             break
     conn.close()
 
-def run_server(sock, rules, use_export):
+def run_server(sock, rules, use_export, refuse_options):
     while True:
         conn, _ = sock.accept()
-        handle_connection(FaultInjectionSocket(conn, rules), use_export)
+        handle_connection(FaultInjectionSocket(conn, rules), use_export,
+                          refuse_options)
 
 def parse_inject_error(name, options):
     if 'event' not in options:
@@ -243,7 +262,7 @@ def open_socket(path):
     return sock
 
 def usage(args):
-    sys.stderr.write('usage: %s [--classic-negotiation] <tcp-port>|<unix-path> <config-file>\n' % args[0])
+    sys.stderr.write('usage: %s [--classic-negotiation|--refuse-options] <tcp-port>|<unix-path> <config-file>\n' % args[0])
     sys.stderr.write('Run an fault injector NBD server with rules defined in a config file.\n')
     sys.exit(1)
 
@@ -251,13 +270,20 @@ def main(args):
     if len(args) != 3 and len(args) != 4:
         usage(args)
     use_export = True
+    refuse_options = False
     if args[1] == '--classic-negotiation':
         use_export = False
+    elif args[1] == '--refuse-options':
+        refuse_options = True
     elif len(args) == 4:
         usage(args)
-    sock = open_socket(args[1 if use_export else 2])
-    rules = load_rules(args[2 if use_export else 3])
-    run_server(sock, rules, use_export)
+    if len(args) == 4:
+        args = args[1:]
+    elif args[1].startswith('--'):
+        usage(args)
+    sock = open_socket(args[1])
+    rules = load_rules(args[2])
+    run_server(sock, rules, use_export, refuse_options)
     return 0
 
 if __name__ == '__main__':
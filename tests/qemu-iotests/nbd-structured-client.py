@@ -0,0 +1,188 @@
+#!/usr/bin/env python
+# NBD client - exercise the structured reply and block status extensions
+#
+# Connects to a fixed newstyle NBD server, negotiates structured replies and
+# the "base:allocation" metadata context, then prints the server's replies to
+# a few requests in a form that does not depend on timing:
+#
+#   - an unknown option, which must be turned down without hanging up
+#   - NBD_CMD_BLOCK_STATUS over the whole export, with and without
+#     NBD_CMD_FLAG_REQ_ONE
+#   - NBD_CMD_READ of the given ranges, as a list of data and hole chunks
+#
+# Usage: nbd-structured-client.py <unix-path> <export-name> [<offset>:<len>...]
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import sys
+import socket
+import struct
+
+# Protocol constants
+NBD_CMD_READ = 0
+NBD_CMD_DISC = 2
+NBD_CMD_BLOCK_STATUS = 7
+NBD_CMD_FLAG_REQ_ONE = 1 << 19
+NBD_REQUEST_MAGIC = 0x25609513
+NBD_STRUCTURED_REPLY_MAGIC = 0x668e33ef
+NBD_PASSWD = 0x4e42444d41474943
+NBD_OPTS_MAGIC = 0x49484156454F5054
+NBD_REP_MAGIC = 0x3e889045565a9
+NBD_REP_META_CONTEXT = 4
+NBD_FLAG_FIXED_NEWSTYLE = 1 << 0
+NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0
+NBD_OPT_EXPORT_NAME = 1
+NBD_OPT_STRUCTURED_REPLY = 8
+NBD_OPT_SET_META_CONTEXT = 10
+NBD_OPT_UNKNOWN = 0x7f
+NBD_REPLY_FLAG_DONE = 1 << 0
+NBD_REPLY_TYPE_NONE = 0
+NBD_REPLY_TYPE_OFFSET_DATA = 1
+NBD_REPLY_TYPE_OFFSET_HOLE = 2
+NBD_REPLY_TYPE_BLOCK_STATUS = 5
+NBD_REPLY_TYPE_ERROR = (1 << 15) | 1
+
+BASE_ALLOCATION = b'base:allocation'
+
+rep_names = {
+    1: 'ack',
+    (1 << 31) | 1: 'error unsupported',
+    (1 << 31) | 3: 'error invalid',
+    (1 << 31) | 6: 'error unknown',
+}
+
+# Protocol structs
+neg1_struct = struct.Struct('>QQH')
+option_struct = struct.Struct('>QII')
+option_reply_struct = struct.Struct('>QIII')
+neg2_struct = struct.Struct('>QH124x')
+request_struct = struct.Struct('>IIQQI')
+chunk_struct = struct.Struct('>IHHQI')
+
+def recvall(sock, bufsize):
+    received = 0
+    chunks = []
+    while received < bufsize:
+        chunk = sock.recv(bufsize - received)
+        if len(chunk) == 0:
+            raise Exception('unexpected disconnect')
+        chunks.append(chunk)
+        received += len(chunk)
+    return b''.join(chunks)
+
+def send_option(sock, opt, data=b''):
+    sock.sendall(option_struct.pack(NBD_OPTS_MAGIC, opt, len(data)) + data)
+
+def receive_option_replies(sock, opt):
+    '''Print option replies up to the final one'''
+    while True:
+        buf = recvall(sock, option_reply_struct.size)
+        magic, reply_opt, type_, length = option_reply_struct.unpack(buf)
+        assert magic == NBD_REP_MAGIC
+        assert reply_opt == opt
+        data = recvall(sock, length)
+        if type_ == NBD_REP_META_CONTEXT:
+            print('option %#x: meta context %d %s' %
+                  (opt, struct.unpack('>I', data[:4])[0], data[4:].decode()))
+            continue
+        print('option %#x: %s' % (opt, rep_names.get(type_, hex(type_))))
+        return
+
+def negotiate(sock, name):
+    buf = recvall(sock, neg1_struct.size)
+    passwd, magic, flags = neg1_struct.unpack(buf)
+    assert passwd == NBD_PASSWD
+    assert magic == NBD_OPTS_MAGIC
+    assert flags & NBD_FLAG_FIXED_NEWSTYLE
+    sock.sendall(struct.pack('>I', NBD_FLAG_C_FIXED_NEWSTYLE))
+
+    send_option(sock, NBD_OPT_UNKNOWN, b'qemu')
+    receive_option_replies(sock, NBD_OPT_UNKNOWN)
+
+    send_option(sock, NBD_OPT_STRUCTURED_REPLY)
+    receive_option_replies(sock, NBD_OPT_STRUCTURED_REPLY)
+
+    data = struct.pack('>I', len(name)) + name + struct.pack('>II', 1,
+                       len(BASE_ALLOCATION)) + BASE_ALLOCATION
+    send_option(sock, NBD_OPT_SET_META_CONTEXT, data)
+    receive_option_replies(sock, NBD_OPT_SET_META_CONTEXT)
+
+    send_option(sock, NBD_OPT_EXPORT_NAME, name)
+    buf = recvall(sock, neg2_struct.size)
+    size, _ = neg2_struct.unpack(buf)
+    print('export size: %d' % size)
+    return size
+
+def send_request(sock, type_, handle, from_, len_):
+    sock.sendall(request_struct.pack(NBD_REQUEST_MAGIC, type_, handle,
+                                     from_, len_))
+
+def receive_chunks(sock, handle):
+    '''Print structured reply chunks up to the final one'''
+    while True:
+        buf = recvall(sock, chunk_struct.size)
+        magic, flags, type_, reply_handle, length = chunk_struct.unpack(buf)
+        assert magic == NBD_STRUCTURED_REPLY_MAGIC
+        assert reply_handle == handle
+        data = recvall(sock, length)
+        done = ' done' if flags & NBD_REPLY_FLAG_DONE else ''
+
+        if type_ == NBD_REPLY_TYPE_OFFSET_DATA:
+            offset = struct.unpack('>Q', data[:8])[0]
+            pattern = set(bytearray(data[8:]))
+            print('  data offset %d length %d pattern %s%s' %
+                  (offset, len(data) - 8,
+                   ','.join('%#x' % p for p in sorted(pattern)), done))
+        elif type_ == NBD_REPLY_TYPE_OFFSET_HOLE:
+            offset, size = struct.unpack('>QI', data)
+            print('  hole offset %d length %d%s' % (offset, size, done))
+        elif type_ == NBD_REPLY_TYPE_BLOCK_STATUS:
+            context_id = struct.unpack('>I', data[:4])[0]
+            print('  block status context %d%s' % (context_id, done))
+            for i in range(4, len(data), 8):
+                length, ext_flags = struct.unpack('>II', data[i:i + 8])
+                print('    length %d flags %#x' % (length, ext_flags))
+        elif type_ == NBD_REPLY_TYPE_ERROR:
+            error = struct.unpack('>I', data[:4])[0]
+            print('  error %d%s' % (error, done))
+        else:
+            print('  chunk type %#x%s' % (type_, done))
+
+        if flags & NBD_REPLY_FLAG_DONE:
+            return
+
+def main(args):
+    if len(args) < 3:
+        sys.stderr.write('usage: %s <unix-path> <export-name> '
+                         '[<offset>:<len>...]\n' % args[0])
+        return 1
+
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(args[1])
+    size = negotiate(sock, args[2].encode())
+
+    handle = 1
+    print('block status 0+%d:' % size)
+    send_request(sock, NBD_CMD_BLOCK_STATUS, handle, 0, size)
+    receive_chunks(sock, handle)
+
+    handle += 1
+    print('block status 0+%d, one extent:' % size)
+    send_request(sock, NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE, handle,
+                 0, size)
+    receive_chunks(sock, handle)
+
+    for arg in args[3:]:
+        offset, length = [int(x) for x in arg.split(':')]
+        handle += 1
+        print('read %d+%d:' % (offset, length))
+        send_request(sock, NBD_CMD_READ, handle, offset, length)
+        receive_chunks(sock, handle)
+
+    send_request(sock, NBD_CMD_DISC, 0, 0, 0)
+    sock.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
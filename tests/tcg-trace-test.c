@@ -0,0 +1,132 @@
+/*
+ * QTest testcase for TCG traces (-accel tcg,trace-threshold=N)
+ *
+ * Boots a sector with a hot loop, so that the loop body is retranslated
+ * as a trace that loops back to its own start, and checks the result.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "libqtest.h"
+
+#define LOW(x) ((x) & 0xff)
+#define HIGH(x) ((x) >> 8)
+
+#define SIGNATURE 0xdead
+#define SIGNATURE_OFFSET 0x40
+#define RESULT_OFFSET 0x42
+#define BOOT_SECTOR_ADDRESS 0x7c00
+
+#define INNER_LOOPS 50000
+#define OUTER_LOOPS 256
+/* 3 is added on each iteration of the inner loop */
+#define RESULT ((3 * INNER_LOOPS * OUTER_LOOPS) & 0xffff)
+
+/* Boot sector code: an inner loop whose body contains a forward jump,
+ * run OUTER_LOOPS times, then store the result and SIGNATURE and halt.
+ */
+static uint8_t boot_sector[0x7e000] = {
+    /* 7c00: xor %ax,%ax */
+    [0x00] = 0x31, [0x01] = 0xc0,
+    /* 7c02: mov $OUTER_LOOPS,%dx */
+    [0x02] = 0xba, [0x03] = LOW(OUTER_LOOPS), [0x04] = HIGH(OUTER_LOOPS),
+    /* 7c05: mov $INNER_LOOPS,%cx */
+    [0x05] = 0xb9, [0x06] = LOW(INNER_LOOPS), [0x07] = HIGH(INNER_LOOPS),
+    /* 7c08: add $3,%ax */
+    [0x08] = 0x05, [0x09] = 0x03, [0x0a] = 0x00,
+    /* 7c0b: jmp 0x7c0e, followed inline by the trace */
+    [0x0b] = 0xeb, [0x0c] = 0x01,
+    /* 7c0d: hlt, never reached */
+    [0x0d] = 0xf4,
+    /* 7c0e: dec %cx */
+    [0x0e] = 0x49,
+    /* 7c0f: jnz 0x7c08, back to the start of the trace */
+    [0x0f] = 0x75, [0x10] = LOW(-9),
+    /* 7c11: dec %dx */
+    [0x11] = 0x4a,
+    /* 7c12: jnz 0x7c05 */
+    [0x12] = 0x75, [0x13] = LOW(-15),
+    /* 7c14: mov %ax,0x7c42 */
+    [0x14] = 0xa3,
+    [0x15] = LOW(BOOT_SECTOR_ADDRESS + RESULT_OFFSET),
+    [0x16] = HIGH(BOOT_SECTOR_ADDRESS + RESULT_OFFSET),
+    /* 7c17: mov $0xdead,%ax */
+    [0x17] = 0xb8, [0x18] = LOW(SIGNATURE), [0x19] = HIGH(SIGNATURE),
+    /* 7c1a: mov %ax,0x7c40 */
+    [0x1a] = 0xa3,
+    [0x1b] = LOW(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET),
+    [0x1c] = HIGH(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET),
+    /* 7c1d: cli */
+    [0x1d] = 0xfa,
+    /* 7c1e: hlt */
+    [0x1e] = 0xf4,
+    /* 7c1f: jmp 0x7c1e */
+    [0x1f] = 0xeb, [0x20] = LOW(-3),
+    /* End of boot sector marker */
+    [0x1FE] = 0x55,
+    [0x1FF] = 0xAA,
+};
+
+static char disk[] = "/tmp/qtest-tcg-trace.XXXXXX";
+
+static void test_loop(gconstpointer data)
+{
+    const char *accel = data;
+    uint16_t signature;
+    char *args;
+    int i;
+
+    args = g_strdup_printf("-net none -display none %s "
+                           "-drive id=hd0,if=none,file=%s,format=raw "
+                           "-device ide-hd,drive=hd0", accel, disk);
+    qtest_start(args);
+
+    /* Wait at most 1 minute */
+#define TEST_DELAY (1 * G_USEC_PER_SEC / 10)
+#define TEST_CYCLES MAX((60 * G_USEC_PER_SEC / TEST_DELAY), 1)
+
+    for (i = 0; i < TEST_CYCLES; ++i) {
+        signature = readw(BOOT_SECTOR_ADDRESS + SIGNATURE_OFFSET);
+        if (signature == SIGNATURE) {
+            break;
+        }
+        g_usleep(TEST_DELAY);
+    }
+    g_assert_cmphex(signature, ==, SIGNATURE);
+    g_assert_cmphex(readw(BOOT_SECTOR_ADDRESS + RESULT_OFFSET), ==, RESULT);
+
+    qtest_quit(global_qtest);
+    g_free(args);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    fd = mkstemp(disk);
+    g_assert(fd >= 0);
+    g_assert(write(fd, boot_sector, sizeof(boot_sector)) ==
+             sizeof(boot_sector));
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* Supplying an accelerator overrides the default (qtest), so that
+     * the guest actually runs.
+     */
+    qtest_add_data_func("/tcg-trace/no-trace", "-machine accel=tcg",
+                        test_loop);
+    qtest_add_data_func("/tcg-trace/loop", "-accel tcg,trace-threshold=16",
+                        test_loop);
+    ret = g_test_run();
+
+    unlink(disk);
+    return ret;
+}
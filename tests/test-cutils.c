@@ -1432,6 +1432,56 @@ static void test_qemu_strtosz_suffix_unit(void)
     g_assert_cmpint(res, ==, 12345000);
 }
 
+#define NONZERO_BUF_SIZE 65536
+
+static uint8_t nonzero_buf[NONZERO_BUF_SIZE] __attribute__((aligned(4096)));
+
+static void test_buffer_find_nonzero_offset(void)
+{
+    uint8_t *buf = nonzero_buf;
+    size_t len, pos, ret;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        len = g_test_rand_int_range(0, NONZERO_BUF_SIZE / 128 + 1) * 128;
+        pos = g_test_rand_int_range(0, len + 1);
+        memset(buf, 0, len);
+        if (pos < len) {
+            buf[pos] = g_test_rand_int_range(1, 256);
+        }
+
+        do {
+            ret = buffer_find_nonzero_offset(buf, len);
+            if (pos == len) {
+                g_assert_cmpint(ret, ==, len);
+            } else {
+                g_assert_cmpint(ret, <=, pos);
+                g_assert_cmpint(ret % sizeof(VECTYPE), ==, 0);
+            }
+        } while (test_buffer_find_nonzero_offset_next_accel());
+    }
+}
+
+/* Throughput of the zero page check done by RAM migration */
+static void test_buffer_find_nonzero_offset_perf(void)
+{
+    uint8_t *buf = nonzero_buf;
+    double gbps;
+    int i;
+
+    memset(buf, 0, NONZERO_BUF_SIZE);
+    do {
+        g_test_timer_start();
+        for (i = 0; i < 20000; i++) {
+            g_assert(buffer_find_nonzero_offset(buf, NONZERO_BUF_SIZE)
+                     == NONZERO_BUF_SIZE);
+        }
+        gbps = 20000.0 * NONZERO_BUF_SIZE / g_test_timer_elapsed() / 1e9;
+        g_test_message("%s: %.2f GB/s", buffer_find_nonzero_offset_accel(),
+                       gbps);
+    } while (test_buffer_find_nonzero_offset_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1593,5 +1643,12 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/strtosz/suffix-unit",
                     test_qemu_strtosz_suffix_unit);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+    if (g_test_perf()) {
+        g_test_add_func("/cutils/perf/buffer_find_nonzero_offset",
+                        test_buffer_find_nonzero_offset_perf);
+    }
+
     return g_test_run();
 }
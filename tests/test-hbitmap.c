@@ -637,6 +637,65 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *copy;
+    uint8_t *buf;
+    uint64_t len;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 3);
+    hbitmap_test_set(data, L2 + 5, L1);
+    hbitmap_test_set(data, L3 + 22, 1);
+
+    len = hbitmap_serialization_size(data->hb);
+    g_assert_cmpint(len, ==, (L3 + 23 + 63) / 64 * 8);
+    buf = g_malloc(len);
+    hbitmap_serialize(data->hb, buf);
+
+    /* bit 0 is the least significant bit of the first byte */
+    g_assert_cmpint(buf[0], ==, 1);
+
+    copy = hbitmap_alloc(L3 + 23, 0);
+    hbitmap_set(copy, 100, 1000);
+    hbitmap_deserialize(copy, buf);
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check(data, L2);
+
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    HBitmap *copy;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, L2, 4);
+    hbitmap_set(data->hb, 0, 1);
+    hbitmap_set(data->hb, 1000, 100);
+
+    g_assert_cmpint(hbitmap_serialization_size(data->hb), ==,
+                    (L2 / 16 + 63) / 64 * 8);
+    buf = g_malloc(hbitmap_serialization_size(data->hb));
+    hbitmap_serialize(data->hb, buf);
+
+    copy = hbitmap_alloc(L2, 4);
+    hbitmap_deserialize(copy, buf);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+    g_assert(hbitmap_get(copy, 15));
+    g_assert(!hbitmap_get(copy, 16));
+    g_assert(hbitmap_get(copy, 1099));
+    g_assert(!hbitmap_get(copy, 1104));
+
+    hbitmap_free(copy);
+    g_free(buf);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -686,6 +745,10 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/general", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
     g_test_run();
 
     return 0;
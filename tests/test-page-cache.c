@@ -0,0 +1,133 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void check_page(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    g_assert(data);
+    fill_page(page, addr);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+}
+
+/* Pages that used to map to the same slot are cached together */
+static void test_collision(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        addr = (uint64_t)i * NUM_PAGES * PAGE_SIZE;
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, 0), ==, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        addr = (uint64_t)i * NUM_PAGES * PAGE_SIZE;
+        g_assert(cache_is_cached(cache, addr, 0));
+        check_page(cache, addr);
+    }
+    g_assert(!cache_is_cached(cache, 4 * NUM_PAGES * PAGE_SIZE, 0));
+    g_assert(!get_cached_data(cache, 4 * NUM_PAGES * PAGE_SIZE));
+
+    cache_fini(cache);
+}
+
+/* Fresh pages are kept, and hot pages are kept over cold ones */
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint64_t stride = (uint64_t)NUM_PAGES * PAGE_SIZE;
+    uint64_t age = 1;
+    int i, nr_ways = 0;
+
+    /* fill one set */
+    for (i = 0; i < NUM_PAGES; i++) {
+        fill_page(page, i * stride);
+        if (cache_insert(cache, i * stride, page, age) < 0) {
+            break;
+        }
+        nr_ways++;
+    }
+    g_assert_cmpint(nr_ways, >, 1);
+    g_assert_cmpint(nr_ways, <, NUM_PAGES);
+
+    /* the set is full of fresh pages */
+    fill_page(page, nr_ways * stride);
+    g_assert_cmpint(cache_insert(cache, nr_ways * stride, page, age), ==, -1);
+
+    /* everything but page 0 is hot, page 0 is used more recently */
+    for (i = 1; i < nr_ways; i++) {
+        int j;
+
+        for (j = 0; j < 64; j++) {
+            g_assert(cache_is_cached(cache, i * stride, 2));
+        }
+    }
+    g_assert(cache_is_cached(cache, 0, 4));
+
+    /* page 0 is the victim */
+    age = 6;
+    g_assert_cmpint(cache_insert(cache, nr_ways * stride, page, age), ==, 0);
+    g_assert(!cache_is_cached(cache, 0, age));
+    for (i = 1; i <= nr_ways; i++) {
+        check_page(cache, i * stride);
+    }
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < NUM_PAGES; i++) {
+        fill_page(page, i * PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, i * PAGE_SIZE, page, i), ==, 0);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 4), ==, NUM_PAGES * 4);
+    for (i = 0; i < NUM_PAGES; i++) {
+        check_page(cache, i * PAGE_SIZE);
+    }
+
+    /* the most recently used pages survive shrinking */
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+    for (i = NUM_PAGES / 2; i < NUM_PAGES; i++) {
+        check_page(cache, i * PAGE_SIZE);
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/collision", test_collision);
+    g_test_add_func("/page-cache/eviction", test_eviction);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
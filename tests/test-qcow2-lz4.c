@@ -0,0 +1,172 @@
+/*
+ * Built-in LZ4 block codec unit tests
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/qcow2.h"
+
+#define CLUSTER_SIZE 65536
+
+/* Worst case size of an LZ4 block for CLUSTER_SIZE bytes of input */
+#define BOUND_SIZE (CLUSTER_SIZE + CLUSTER_SIZE / 255 + 16)
+
+static void fill_random(uint8_t *buf, size_t len, uint32_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+/* Compress @src into a buffer of @dest_size bytes and decompress it again */
+static ssize_t round_trip(const uint8_t *src, size_t src_size,
+                          size_t dest_size)
+{
+    uint8_t *dest = g_malloc(dest_size);
+    uint8_t *out = g_malloc(src_size);
+    ssize_t ret;
+
+    ret = qcow2_lz4_compress(dest, dest_size, src, src_size);
+    if (ret >= 0) {
+        g_assert(ret <= dest_size);
+        g_assert_cmpint(qcow2_lz4_decompress(out, src_size, dest, ret), ==, 0);
+        g_assert(memcmp(src, out, src_size) == 0);
+    }
+
+    g_free(dest);
+    g_free(out);
+    return ret;
+}
+
+static void test_compressible(void)
+{
+    uint8_t *src = g_malloc(CLUSTER_SIZE);
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < CLUSTER_SIZE; i++) {
+        src[i] = "The quick brown fox jumps over the lazy dog. "[i % 45];
+    }
+    ret = round_trip(src, CLUSTER_SIZE, CLUSTER_SIZE);
+    g_assert_cmpint(ret, >, 0);
+    g_assert_cmpint(ret, <, CLUSTER_SIZE / 16);
+
+    g_free(src);
+}
+
+static void test_incompressible(void)
+{
+    uint8_t *src = g_malloc(CLUSTER_SIZE);
+
+    fill_random(src, CLUSTER_SIZE, 1);
+
+    /* Random data does not fit into less space than it takes itself */
+    g_assert_cmpint(round_trip(src, CLUSTER_SIZE, CLUSTER_SIZE - 1), ==,
+                    -ENOSPC);
+
+    /* But it is stored as literals if there is room for the overhead */
+    g_assert_cmpint(round_trip(src, CLUSTER_SIZE, BOUND_SIZE), >=,
+                    CLUSTER_SIZE);
+
+    g_free(src);
+}
+
+static void test_max_length_match(void)
+{
+    uint8_t *src = g_malloc0(CLUSTER_SIZE);
+    ssize_t ret;
+
+    /* One literal, then a single match that spans nearly the whole cluster
+     * and needs a long run of 255 length bytes */
+    ret = round_trip(src, CLUSTER_SIZE, CLUSTER_SIZE);
+    g_assert_cmpint(ret, >, CLUSTER_SIZE / 255);
+    g_assert_cmpint(ret, <, CLUSTER_SIZE / 255 + 32);
+
+    /* Literal runs whose length bytes end exactly at 255 */
+    fill_random(src, 15 + 255, 2);
+    g_assert_cmpint(round_trip(src, CLUSTER_SIZE, BOUND_SIZE), >, 0);
+    fill_random(src, 15 + 2 * 255, 3);
+    g_assert_cmpint(round_trip(src, CLUSTER_SIZE, BOUND_SIZE), >, 0);
+
+    g_free(src);
+}
+
+static void test_small_inputs(void)
+{
+    uint8_t src[32];
+    size_t len;
+
+    memset(src, 'x', sizeof(src));
+    for (len = 1; len <= sizeof(src); len++) {
+        g_assert_cmpint(round_trip(src, len, BOUND_SIZE), >, 0);
+    }
+}
+
+static void test_trailing_bytes(void)
+{
+    uint8_t *src = g_malloc(CLUSTER_SIZE);
+    uint8_t *dest = g_malloc(BOUND_SIZE + 512);
+    uint8_t *out = g_malloc(CLUSTER_SIZE);
+    ssize_t ret;
+
+    fill_random(src, CLUSTER_SIZE / 2, 4);
+    memset(src + CLUSTER_SIZE / 2, 0, CLUSTER_SIZE / 2);
+    ret = qcow2_lz4_compress(dest, BOUND_SIZE, src, CLUSTER_SIZE);
+    g_assert_cmpint(ret, >, 0);
+
+    /* Compressed clusters are read in whole sectors, so the block may be
+     * followed by the start of the next one */
+    memset(dest + ret, 0xff, 512);
+    g_assert_cmpint(qcow2_lz4_decompress(out, CLUSTER_SIZE, dest, ret + 512),
+                    ==, 0);
+    g_assert(memcmp(src, out, CLUSTER_SIZE) == 0);
+
+    /* A truncated block is an error */
+    g_assert_cmpint(qcow2_lz4_decompress(out, CLUSTER_SIZE, dest, ret - 1),
+                    ==, -EIO);
+
+    g_free(src);
+    g_free(dest);
+    g_free(out);
+}
+
+static void test_reference_block(void)
+{
+    /* Literal 'a', a 19 byte match at offset 1, then literals "bcdef", as
+     * produced by liblz4 */
+    static const uint8_t block[] = {
+        0x1f, 'a', 0x01, 0x00, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f',
+    };
+    static const uint8_t bad_offset[] = {
+        0x1f, 'a', 0x00, 0x00, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f',
+    };
+    uint8_t out[25];
+
+    g_assert_cmpint(qcow2_lz4_decompress(out, sizeof(out),
+                                         block, sizeof(block)), ==, 0);
+    g_assert(memcmp(out, "aaaaaaaaaaaaaaaaaaaabcdef", sizeof(out)) == 0);
+
+    g_assert_cmpint(qcow2_lz4_decompress(out, sizeof(out),
+                                         bad_offset, sizeof(bad_offset)),
+                    ==, -EIO);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2-lz4/compressible", test_compressible);
+    g_test_add_func("/qcow2-lz4/incompressible", test_incompressible);
+    g_test_add_func("/qcow2-lz4/max-length-match", test_max_length_match);
+    g_test_add_func("/qcow2-lz4/small-inputs", test_small_inputs);
+    g_test_add_func("/qcow2-lz4/trailing-bytes", test_trailing_bytes);
+    g_test_add_func("/qcow2-lz4/reference-block", test_reference_block);
+    return g_test_run();
+}
@@ -0,0 +1,156 @@
+/*
+ * QHT hash table tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/osdep.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+
+#define N 5000
+
+static struct qht ht;
+static int32_t arr[N * 2];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* few distinct hashes, so that long bucket chains get exercised */
+static uint32_t hash_of(int32_t val, bool collide)
+{
+    return collide ? val % 7 : val * 2654435761u;
+}
+
+static void insert(int a, int b, bool collide)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_of(i, collide)));
+        /* duplicates are rejected */
+        g_assert(!qht_insert(&ht, &arr[i], hash_of(i, collide)));
+    }
+}
+
+static void rm(int a, int b, bool collide)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_of(i, collide)));
+        g_assert(!qht_remove(&ht, &arr[i], hash_of(i, collide)));
+    }
+}
+
+static void check(int a, int b, bool expected, bool collide)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = a; i < b; i++) {
+        int32_t val = i;
+        void *p = qht_lookup(&ht, is_equal, &val, hash_of(i, collide));
+
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void count_func(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    size_t *count = userp;
+
+    (*count)++;
+}
+
+static void check_n(size_t expected)
+{
+    struct qht_stats stats;
+    size_t count = 0;
+
+    qht_iter(&ht, count_func, &count);
+    g_assert_cmpuint(count, ==, expected);
+
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.entries, ==, expected);
+    g_assert_cmpuint(stats.used_head_buckets, <=, stats.head_buckets);
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries, bool collide)
+{
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N, collide);
+    check(0, N, true, collide);
+    check_n(N);
+    check(-N, -1, false, collide);
+
+    /* removing from the middle of chains keeps the rest reachable */
+    rm(N / 4, N / 2, collide);
+    check(0, N / 4, true, collide);
+    check(N / 4, N / 2, false, collide);
+    check(N / 2, N, true, collide);
+    check_n(N - N / 4);
+
+    insert(N / 4, N / 2, collide);
+    insert(N, N * 2, collide);
+    check(0, N * 2, true, collide);
+    check_n(N * 2);
+
+    qht_resize(&ht, N * 4);
+    check(0, N * 2, true, collide);
+    check_n(N * 2);
+
+    rm(0, N, collide);
+    check(0, N, false, collide);
+    check(N, N * 2, true, collide);
+    check_n(N);
+
+    qht_reset_size(&ht, 0);
+    check(0, N * 2, false, collide);
+    check_n(0);
+
+    insert(0, N, collide);
+    qht_reset(&ht);
+    check_n(0);
+    check(0, N, false, collide);
+
+    qht_destroy(&ht);
+}
+
+static void test_default(void)
+{
+    qht_do_test(0, N, false);
+}
+
+static void test_resize(void)
+{
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0, false);
+}
+
+static void test_collisions(void)
+{
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0, true);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/mode/collisions", test_collisions);
+    return g_test_run();
+}
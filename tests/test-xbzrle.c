@@ -177,6 +177,108 @@ static void test_encode_decode(void)
     }
 }
 
+/* Dirty a page the way a guest would: a few runs of changed bytes */
+static void dirty_page(uint8_t *page, int nr_runs)
+{
+    int i, j, start, len;
+
+    for (i = 0; i < nr_runs; i++) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, 64);
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            page[j] ^= g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/* Every encoder must produce the same output as the generic one */
+static void test_encode_accel(void)
+{
+    uint8_t *old_page = g_malloc(PAGE_SIZE);
+    uint8_t *new_page = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, dlen, expected_len, rc;
+
+    for (i = 0; i < 1000; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old_page[j] = g_test_rand_int();
+        }
+        memcpy(new_page, old_page, PAGE_SIZE);
+        dirty_page(new_page, g_test_rand_int_range(0, 128));
+        dlen = g_test_rand_int_range(1, PAGE_SIZE + 1);
+
+        /* the generic encoder is the last one */
+        while (strcmp(xbzrle_encode_accel(), "generic")) {
+            g_assert(test_xbzrle_encode_next_accel());
+        }
+        expected_len = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                            expected, dlen);
+        g_assert(!test_xbzrle_encode_next_accel());
+
+        do {
+            rc = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                      compressed, dlen);
+            g_assert_cmpint(rc, ==, expected_len);
+            g_assert(rc <= 0 || memcmp(compressed, expected, rc) == 0);
+        } while (test_xbzrle_encode_next_accel());
+    }
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(expected);
+    g_free(compressed);
+}
+
+#define PERF_PAGES 256
+#define PERF_LOOPS 200
+
+static double encode_perf(uint8_t *old_pages, uint8_t *new_pages,
+                          uint8_t *compressed)
+{
+    int i, j;
+
+    g_test_timer_start();
+    for (i = 0; i < PERF_LOOPS; i++) {
+        for (j = 0; j < PERF_PAGES; j++) {
+            xbzrle_encode_buffer(old_pages + j * PAGE_SIZE,
+                                 new_pages + j * PAGE_SIZE, PAGE_SIZE,
+                                 compressed, PAGE_SIZE);
+        }
+    }
+    return (double)PERF_LOOPS * PERF_PAGES * PAGE_SIZE /
+           g_test_timer_elapsed() / 1e9;
+}
+
+/* Encoder throughput for unchanged pages and for lightly dirtied pages */
+static void test_encode_perf(void)
+{
+    uint8_t *old_pages = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double unchanged, dirty;
+    int i;
+
+    for (i = 0; i < PERF_PAGES * PAGE_SIZE; i++) {
+        old_pages[i] = g_test_rand_int();
+    }
+    memcpy(new_pages, old_pages, PERF_PAGES * PAGE_SIZE);
+    for (i = 0; i < PERF_PAGES; i++) {
+        dirty_page(new_pages + i * PAGE_SIZE, 8);
+    }
+
+    do {
+        unchanged = encode_perf(old_pages, old_pages, compressed);
+        dirty = encode_perf(old_pages, new_pages, compressed);
+        g_test_message("%s: unchanged %.2f GB/s, dirty %.2f GB/s",
+                       xbzrle_encode_accel(), unchanged, dirty);
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -189,6 +291,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", test_encode_perf);
+    }
 
     return g_test_run();
 }
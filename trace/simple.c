@@ -11,12 +11,15 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #ifndef _WIN32
 #include <signal.h>
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -48,14 +51,44 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,              /* per thread, a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_SPARE_BUFFERS = 8,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
-static volatile gint dropped_events;
+/*
+ * Each thread records into a ring buffer of its own, so tracing threads do
+ * not contend with each other.  Only the owning thread (and signal handlers
+ * that interrupt it) reserve space, the writeout thread alone consumes it.
+ * Records start at 8-byte aligned positions so that the event ID, which
+ * carries the valid flag, is never split by the end of the ring.
+ *
+ * Buffers are kept on a list that threads push onto without locking; the
+ * writeout thread recycles buffers of exited threads once they are empty.
+ *
+ * A thread's first tracepoint may run in a signal handler, so it must not
+ * allocate memory.  Instead it claims one of the spare buffers that the
+ * writeout thread keeps allocated.  If none is left the event is dropped.
+ */
+struct TraceThreadBuffer {
+    TraceThreadBuffer *next;
+    Notifier exit_notifier;
+    bool exited;
+    unsigned int reserve_idx;   /* bytes claimed by the owning thread */
+    unsigned int writeout_idx;  /* bytes consumed by the writeout thread */
+    int dropped_events;
+    uint64_t buf[TRACE_BUF_LEN / sizeof(uint64_t)];
+};
+
+static TraceThreadBuffer *trace_buffers;
+static __thread TraceThreadBuffer *trace_thread_buffer;
+static TraceThreadBuffer *trace_spare_buffers[TRACE_SPARE_BUFFERS];
+static bool trace_spare_needed;
+static int trace_unbuffered_dropped_events; /* no spare buffer was left */
+
+/* Records are copied here and written out in batches */
+static uint8_t writeout_buf[TRACE_BUF_LEN];
+
 static uint32_t trace_pid;
 static FILE *trace_fp;
 static char *trace_file_name;
@@ -75,54 +108,46 @@ typedef struct {
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
+/* Space taken by a record in the ring buffer */
+#define TRACE_RECORD_SPACE(len) (((len) + 7) & ~7u)
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    uint8_t *buf = (uint8_t *)tb->buf;
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, buf + off, n);
+    memcpy((uint8_t *)dataptr + n, buf, size - n);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static unsigned int write_to_buffer(TraceThreadBuffer *tb, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
-    }
+    uint8_t *buf = (uint8_t *)tb->buf;
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t n = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(buf + off, dataptr, n);
+    memcpy(buf, (const uint8_t *)dataptr + n, size - n);
+    return idx + size; /* most callers wants to know where to write next */
 }
-/**
- * Read a trace record from the trace buffer
- *
- * @idx         Trace buffer index
- * @record      Trace record to fill
- *
- * Returns false if the record is not valid.
- */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+
+static void clear_buffer_range(TraceThreadBuffer *tb, unsigned int idx,
+                               size_t len)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
+    uint8_t *buf = (uint8_t *)tb->buf;
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t n = MIN(len, TRACE_BUF_LEN - off);
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
-    }
+    memset(buf + off, 0, n);
+    memset(buf, 0, len - n);
+}
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+static uint64_t *trace_record_event(TraceThreadBuffer *tb, unsigned int idx)
+{
+    return &tb->buf[(idx % TRACE_BUF_LEN) / sizeof(uint64_t)];
 }
 
 /**
@@ -154,125 +179,290 @@ static void wait_for_trace_records_available(void)
     g_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+static size_t writeout_flush(size_t len)
 {
-    TraceRecord *recordptr;
+    size_t unused __attribute__ ((unused));
+
+    if (len) {
+        unused = fwrite(writeout_buf, len, 1, trace_fp);
+    }
+    return 0;
+}
+
+/**
+ * Batch a "dropped events" record for the count in @counter, and reset it
+ */
+static size_t writeout_dropped_events(int *counter, size_t len)
+{
+    int dropped_count = atomic_xchg(counter, 0);
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
-    int dropped_count;
-    size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    if (!dropped_count) {
+        return len;
+    }
+
+    dropped.rec.event = DROPPED_EVENT_ID;
+    dropped.rec.timestamp_ns = get_clock();
+    dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t);
+    dropped.rec.pid = trace_pid;
+    dropped.rec.arguments[0] = dropped_count;
+    if (len + dropped.rec.length > sizeof(writeout_buf)) {
+        len = writeout_flush(len);
+    }
+    memcpy(writeout_buf + len, &dropped, dropped.rec.length);
+    return len + dropped.rec.length;
+}
+
+/**
+ * Copy the completed records of one thread's buffer to the trace file
+ *
+ * @len         Bytes already batched in writeout_buf
+ *
+ * Returns the number of bytes batched in writeout_buf afterwards.
+ */
+static size_t writeout_thread_buffer(TraceThreadBuffer *tb, size_t len)
+{
+    unsigned int idx = tb->writeout_idx;
+    unsigned int end = atomic_read(&tb->reserve_idx);
+    TraceRecord record;
+
+    len = writeout_dropped_events(&tb->dropped_events, len);
 
-        if (g_atomic_int_get(&dropped_events)) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(uint64_t),
-            dropped.rec.pid = trace_pid;
-            do {
-                dropped_count = g_atomic_int_get(&dropped_events);
-            } while (!g_atomic_int_compare_and_exchange(&dropped_events,
-                                                        dropped_count, 0));
-            dropped.rec.arguments[0] = dropped_count;
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+    while (idx != end) {
+        /* read the event flag to see if its a valid record */
+        if (!(atomic_read(trace_record_event(tb, idx)) & TRACE_RECORD_VALID)) {
+            break;
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        smp_rmb(); /* read memory barrier before accessing record */
+        /* read the record header to know record length */
+        read_from_buffer(tb, idx, &record, sizeof(TraceRecord));
+        if (len + record.length > sizeof(writeout_buf)) {
+            len = writeout_flush(len);
         }
+        read_from_buffer(tb, idx, writeout_buf + len, record.length);
+        record.event &= ~TRACE_RECORD_VALID;
+        memcpy(writeout_buf + len, &record.event, sizeof(record.event));
+        len += record.length;
+
+        /* clear the trace buffer range for consumed record otherwise any
+         * byte with its MSB set may be considered as a valid event id when
+         * the thread crosses this range of buffer again.
+         */
+        clear_buffer_range(tb, idx, TRACE_RECORD_SPACE(record.length));
+        idx += TRACE_RECORD_SPACE(record.length);
+    }
+
+    smp_mb(); /* clear the range before handing it back to the thread */
+    atomic_set(&tb->writeout_idx, idx);
+    return len;
+}
+
+/**
+ * Put an unused buffer in a free spare slot
+ *
+ * Returns false if all slots are taken.
+ */
+static bool put_spare_buffer(TraceThreadBuffer *tb)
+{
+    int i;
+
+    memset(tb, 0, offsetof(TraceThreadBuffer, buf));
+    for (i = 0; i < TRACE_SPARE_BUFFERS; i++) {
+        if (!atomic_read(&trace_spare_buffers[i]) &&
+            atomic_cmpxchg(&trace_spare_buffers[i], NULL, tb) == NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Refill the spare slots that threads have claimed */
+static void refill_spare_buffers(void)
+{
+    TraceThreadBuffer *tb;
+    int i;
+
+    atomic_set(&trace_spare_needed, false);
+    for (i = 0; i < TRACE_SPARE_BUFFERS; i++) {
+        if (atomic_read(&trace_spare_buffers[i])) {
+            continue;
+        }
+        /* dont use g_malloc, can deadlock when traced */
+        tb = calloc(1, sizeof(*tb));
+        if (!tb || !put_spare_buffer(tb)) {
+            free(tb);
+            return;
+        }
+    }
+}
+
+static gpointer writeout_thread(gpointer opaque)
+{
+    TraceThreadBuffer *tb, *prev, *next;
+    size_t len;
+    bool exited;
+
+    for (;;) {
+        wait_for_trace_records_available();
+
+        refill_spare_buffers();
+        len = writeout_dropped_events(&trace_unbuffered_dropped_events, 0);
+        prev = NULL;
+        for (tb = atomic_read(&trace_buffers); tb; tb = next) {
+            next = tb->next;
+            exited = atomic_read(&tb->exited);
+            smp_rmb(); /* the thread wrote its last record before exiting */
+            len = writeout_thread_buffer(tb, len);
+
+            if (!exited || tb->writeout_idx != tb->reserve_idx) {
+                prev = tb;
+                continue;
+            }
+
+            /* Only this thread unlinks buffers, others only push new ones */
+            if (prev) {
+                prev->next = next;
+            } else if (atomic_cmpxchg(&trace_buffers, tb, next) != tb) {
+                for (prev = atomic_read(&trace_buffers); prev->next != tb;
+                     prev = prev->next) {
+                    /* find the buffer pushed in front of this one */
+                }
+                prev->next = next;
+            }
+            /* The buffer is empty, so its contents are all zero */
+            if (!put_spare_buffer(tb)) {
+                free(tb); /* dont use g_free, can deadlock when traced */
+            }
+        }
+        writeout_flush(len);
 
         fflush(trace_fp);
     }
     return NULL;
 }
 
+static void trace_thread_exit(Notifier *notifier, void *data)
+{
+    TraceThreadBuffer *tb = container_of(notifier, TraceThreadBuffer,
+                                         exit_notifier);
+
+    trace_thread_buffer = NULL;
+    smp_wmb(); /* records before the exit flag */
+    atomic_set(&tb->exited, true);
+    flush_trace_file(false);
+}
+
+/* Claim a spare buffer for this thread, without allocating memory */
+static TraceThreadBuffer *get_trace_thread_buffer(void)
+{
+    TraceThreadBuffer *tb = trace_thread_buffer;
+    int i;
+#ifndef _WIN32
+    sigset_t set, oldset;
+#endif
+
+    if (likely(tb)) {
+        return tb;
+    }
+
+#ifndef _WIN32
+    /* A signal handler must not set up a second buffer under our feet */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+#endif
+
+    tb = trace_thread_buffer;
+    for (i = 0; !tb && i < TRACE_SPARE_BUFFERS; i++) {
+        tb = atomic_xchg(&trace_spare_buffers[i], NULL);
+        if (!tb) {
+            continue;
+        }
+
+        tb->exit_notifier.notify = trace_thread_exit;
+        qemu_thread_atexit_add(&tb->exit_notifier);
+
+        do {
+            tb->next = atomic_read(&trace_buffers);
+        } while (atomic_cmpxchg(&trace_buffers, tb->next, tb) != tb->next);
+
+        trace_thread_buffer = tb;
+
+        /* Have the writeout thread replace the spare */
+        atomic_set(&trace_spare_needed, true);
+    }
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+    return tb;
+}
+
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuffer *tb;
+    unsigned int old_idx, new_idx;
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
+    TraceRecord record = {
+        .event = event,
+        .timestamp_ns = get_clock(),
+        .length = rec_len,
+        .pid = trace_pid,
+    };
+
+    tb = get_trace_thread_buffer();
+    if (!tb) {
+        atomic_inc(&trace_unbuffered_dropped_events);
+        return -ENOSPC;
+    }
 
+    /* Only signal handlers can race with us here, so this is uncontended */
     do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
+        old_idx = atomic_read(&tb->reserve_idx);
+        new_idx = old_idx + TRACE_RECORD_SPACE(rec_len);
 
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
+        if (new_idx - atomic_read(&tb->writeout_idx) > TRACE_BUF_LEN) {
             /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
+            atomic_inc(&tb->dropped_events);
             return -ENOSPC;
         }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    } while (atomic_cmpxchg(&tb->reserve_idx, old_idx, new_idx) != old_idx);
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
-
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->tbuf = tb;
+    rec->tbuf_idx = old_idx;
+    rec->rec_off = write_to_buffer(tb, old_idx, &record, sizeof(record));
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuffer *tb = rec->tbuf;
+    uint64_t *event = trace_record_event(tb, rec->tbuf_idx);
+
     smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    atomic_set(event, *event | TRACE_RECORD_VALID);
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if ((atomic_read(&tb->reserve_idx) - atomic_read(&tb->writeout_idx)
+         > TRACE_BUF_FLUSH_THRESHOLD || atomic_read(&trace_spare_needed)) &&
+        !atomic_read(&trace_available)) {
         flush_trace_file(false);
     }
 }
@@ -378,6 +568,7 @@ bool st_init(const char *file)
     GThread *thread;
 
     trace_pid = getpid();
+    refill_spare_buffers();
 
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
@@ -127,36 +127,28 @@ static void *l1_map[V_L1_SIZE];
 TCGContext tcg_ctx;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
@@ -311,10 +303,13 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
         if (tb->cflags & CF_NOCACHE) {
-            /* one-shot translation, invalidate it immediately */
+            /* one-shot translation, invalidate it immediately.  We are
+               called from the TB itself, so tb_lock cannot be held.  */
             cpu->current_tb = NULL;
+            tb_lock();
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
+            tb_unlock();
         }
         return true;
     }
@@ -741,6 +736,12 @@ static inline void code_gen_alloc(size_t tb_size)
     qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
 }
 
+static void tb_htable_init(void)
+{
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
+}
+
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
    (in bytes) allocated to the translation buffer. Zero means default
    size. */
@@ -748,6 +749,7 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     page_init();
+    tb_htable_init();
     code_gen_alloc(tb_size);
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
@@ -829,8 +831,7 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(CPUState *cpu)
 {
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -849,7 +850,7 @@ void tb_flush(CPUState *cpu)
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
@@ -858,61 +859,88 @@ void tb_flush(CPUState *cpu)
     tcg_ctx.tb_ctx.tb_flush_count++;
 }
 
-#ifdef DEBUG_TB_CHECK
+#ifdef CONFIG_SOFTMMU
+typedef struct TBFlushWork {
+    CPUState *cpu;
+    int flush_count;
+} TBFlushWork;
 
-static void tb_invalidate_check(target_ulong address)
+static void tb_flush_safe_work(void *data)
 {
-    TranslationBlock *tb;
-    int i;
+    TBFlushWork *work = data;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    tb_lock();
+    /* If several vCPUs asked for a flush, only the first one has any
+       work to do.  */
+    if (tcg_ctx.tb_ctx.tb_flush_count == work->flush_count) {
+        do_tb_flush(work->cpu);
     }
+    tb_unlock();
+    g_free(work);
 }
+#endif
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* With multi-threaded TCG other vCPUs may be executing code from the
+ * buffer, so the flush is deferred until all of them have left
+ * cpu_exec(); callers inside cpu_exec() must then leave it as well.
+ */
+void tb_flush(CPUState *cpu)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
+#ifdef CONFIG_SOFTMMU
+    if (qemu_tcg_mttcg_enabled()) {
+        TBFlushWork *work = g_new(TBFlushWork, 1);
+
+        work->cpu = cpu ? cpu : first_cpu;
+        work->flush_count = tcg_ctx.tb_ctx.tb_flush_count;
+        async_safe_run_on_cpu(work->cpu, tb_flush_safe_work, work);
+        return;
     }
+#endif
+    do_tb_flush(cpu);
 }
 
-#endif
+#ifdef DEBUG_TB_CHECK
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void do_tb_page_check(struct qht *ht, void *p, uint32_t hash,
+                             void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
+    }
+}
+
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -972,13 +1000,17 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
+    uint32_t hash;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    /* Lock-free lookups may still find the TB until it is removed below */
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    hash = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, hash);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -997,8 +1029,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1072,12 +1104,25 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (parallel_cpus) {
+        cflags |= CF_PARALLEL;
+    }
+#ifdef TARGET_SUPPORTS_TB_TRACE
+    if (tb_trace_threshold && !(cflags & (CF_TRACE | CF_NOCACHE))) {
+        cflags |= CF_COUNT_HOT;
+    }
+#endif
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
         /* flush must be done */
         tb_flush(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The flush runs once every vCPU has left cpu_exec(); leave
+               it too, and translate again afterwards.  */
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1090,6 +1135,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->invalid = false;
+    tb->hot_count = tb_trace_threshold;
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1100,6 +1147,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_func_start(&tcg_ctx);
 
     gen_intermediate_code(env, tb);
+    if ((cflags & CF_COUNT_HOT) && !(tb->cflags & CF_TRACE_JUMP)) {
+        /* The trace would be the same code; don't even count */
+        tb->hot_count = -1;
+    }
 
     trace_translate_block(tb, tb->pc, tb->tc_ptr);
 
@@ -1475,14 +1526,13 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t hash;
 
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    /* add in the physical hash table; one-shot TBs are never looked up */
+    if (!(tb->cflags & CF_NOCACHE)) {
+        hash = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+        qht_insert(&tcg_ctx.tb_ctx.htable, tb, hash);
+    }
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1558,7 +1608,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1599,6 +1651,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1654,7 +1707,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
        Better would be to execute just this insn uncached, or generate a
-       second new TB.  */
+       second new TB.  cpu_exec drops tb_lock after the longjmp.  */
     cpu_resume_from_signal(cpu, NULL);
 }
 
@@ -1677,7 +1730,11 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int vtlb_max_entries;
+    uint64_t vtlb_hits, vtlb_misses;
     TranslationBlock *tb;
+    struct qht_stats hst;
+    CPUState *cpu;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -1728,11 +1785,40 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash chain len   %0.2f avg, %zu max (buckets)\n",
+                hst.used_head_buckets ?
+                (double)hst.chain_buckets / hst.used_head_buckets : 0,
+                hst.max_chain);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+
+    vtlb_hits = vtlb_misses = 0;
+    vtlb_max_entries = 0;
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        vtlb_hits += atomic_read(&env->vtlb_hit_count);
+        vtlb_misses += atomic_read(&env->vtlb_miss_count);
+        for (i = 0; i < NB_MMU_MODES; i++) {
+            vtlb_max_entries = MAX(vtlb_max_entries,
+                                   CPU_VTLB_ENTRIES(env, i));
+        }
+    }
+    cpu_fprintf(f, "victim TLB hits     %" PRIu64 " (%d%%)\n", vtlb_hits,
+                vtlb_hits + vtlb_misses ?
+                (int)(vtlb_hits * 100 / (vtlb_hits + vtlb_misses)) : 0);
+    cpu_fprintf(f, "victim TLB misses   %" PRIu64 "\n", vtlb_misses);
+    cpu_fprintf(f, "victim TLB size     %d/%d max entries\n",
+                vtlb_max_entries, CPU_VTLB_SIZE);
     tcg_dump_info(f, cpu_fprintf);
 }
 
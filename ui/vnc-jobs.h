@@ -44,7 +44,13 @@ void vnc_start_worker_thread(void);
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    int ret = qemu_mutex_trylock(&vd->mutex);
+
+    if (!ret && atomic_read(&vd->nr_encoders)) {
+        qemu_mutex_unlock(&vd->mutex);
+        ret = -EBUSY;
+    }
+    return ret;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -57,6 +63,23 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/*
+ * Worker threads only read the server surface, so several of them can
+ * encode updates for clients of the same display at the same time.
+ * vnc_trylock_display() fails while any of them is running.
+ */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    atomic_inc(&vd->nr_encoders);
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    atomic_dec(&vd->nr_encoders);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
@@ -2868,6 +2868,29 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Compares one dirty chunk of the guest and server surfaces.  The chunks
+ * are short, so comparing whole vectors inline is cheaper than calling
+ * memcmp() for each of them.
+ */
+static inline bool vnc_chunk_equal(const uint8_t *a, const uint8_t *b,
+                                   int len)
+{
+    const VECTYPE *va = (const VECTYPE *)a;
+    const VECTYPE *vb = (const VECTYPE *)b;
+    int i;
+
+    if (((uintptr_t)a | (uintptr_t)b | len) & (sizeof(VECTYPE) - 1)) {
+        return memcmp(a, b, len) == 0;
+    }
+    for (i = 0; i < len / sizeof(VECTYPE); i++) {
+        if (!ALL_EQ(va[i], vb[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2942,7 +2965,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (vnc_chunk_equal(server_ptr, guest_ptr, _cmp_bytes)) {
                 continue;
             }
             memcpy(server_ptr, guest_ptr, _cmp_bytes);
@@ -3103,6 +3126,9 @@ void vnc_init_state(VncState *vs)
     QTAILQ_INSERT_TAIL(&vd->clients, vs, next);
     if (first_client) {
         vnc_update_server_surface(vd);
+    } else {
+        /* Let the clients of this display be encoded in parallel */
+        vnc_start_worker_thread();
     }
 
     graphic_hw_update(vd->dcl.con);
@@ -31,6 +31,10 @@
 #include "qemu/iov.h"
 #include "net/net.h"
 
+#ifdef CONFIG_AVX2_OPT
+#include <cpuid.h>
+#endif
+
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
     int len = qemu_strnlen(str, buf_size);
@@ -162,37 +166,40 @@ int qemu_fdatasync(int fd)
 }
 
 /*
- * Searches for an area with non-zero content in a buffer
- *
- * Attention! The len must be a multiple of
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * and addr must be a multiple of sizeof(VECTYPE) due to
- * restriction of optimizations in this function.
- *
- * can_use_buffer_find_nonzero_offset() can be used to check
- * these requirements.
- *
- * The return value is the offset of the non-zero area rounded
- * down to a multiple of sizeof(VECTYPE) for the first
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
- * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
- *
- * If the buffer is all zero the return value is equal to len.
+ * Returns true if the host CPU and OS support AVX2, so that code compiled
+ * for it can be selected at runtime.  XGETBV is used to check that the OS
+ * saves the YMM registers on context switch.
  */
+#ifdef CONFIG_AVX2_OPT
+bool host_cpu_has_avx2(void)
+{
+    unsigned a, b, c, d, lo, hi;
+    int max = __get_cpuid_max(0, 0);
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+    if (max < 7) {
+        return false;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    if ((lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+}
+#endif
+
+static size_t buffer_find_nonzero_offset_vector(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
-    if (!len) {
-        return 0;
-    }
-
     for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
         if (!ALL_EQ(p[i], zero)) {
             return i * sizeof(VECTYPE);
@@ -216,6 +223,127 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define AVX2_NONZERO_CHUNK \
+    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(__m256i))
+
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!_mm256_testz_si256(p[i], p[i])) {
+            return i * sizeof(__m256i);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(__m256i);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        __m256i tmp0 = _mm256_or_si256(p[i + 0], p[i + 1]);
+        __m256i tmp1 = _mm256_or_si256(p[i + 2], p[i + 3]);
+        __m256i tmp2 = _mm256_or_si256(p[i + 4], p[i + 5]);
+        __m256i tmp3 = _mm256_or_si256(p[i + 6], p[i + 7]);
+        __m256i tmp01 = _mm256_or_si256(tmp0, tmp1);
+        __m256i tmp23 = _mm256_or_si256(tmp2, tmp3);
+        __m256i tmp = _mm256_or_si256(tmp01, tmp23);
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * sizeof(__m256i);
+}
+
+#pragma GCC pop_options
+
+static bool use_avx2;
+#endif
+
+static void __attribute__((constructor)) init_buffer_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    use_avx2 = host_cpu_has_avx2();
+#endif
+}
+
+/*
+ * Switches buffer_find_nonzero_offset() to the next slower implementation,
+ * for tests and benchmarks.  Returns false, after going back to the best
+ * implementation, when there is none left.
+ */
+bool test_buffer_find_nonzero_offset_next_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (use_avx2) {
+        use_avx2 = false;
+        return true;
+    }
+#endif
+    init_buffer_accel();
+    return false;
+}
+
+const char *buffer_find_nonzero_offset_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (use_avx2) {
+        return "avx2";
+    }
+#endif
+#if defined(__ALTIVEC__)
+    return "altivec";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "generic";
+#endif
+}
+
+/*
+ * Searches for an area with non-zero content in a buffer
+ *
+ * Attention! The len must be a multiple of
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
+ * and addr must be a multiple of sizeof(VECTYPE) due to
+ * restriction of optimizations in this function.
+ *
+ * can_use_buffer_find_nonzero_offset() can be used to check
+ * these requirements.
+ *
+ * The return value is the offset of the non-zero area rounded
+ * down to a multiple of sizeof(VECTYPE) for the first
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
+ * afterwards.  When the host supports AVX2 and the buffer is suitably
+ * aligned, the offset may be rounded down further, to twice these sizes.
+ *
+ * If the buffer is all zero the return value is equal to len.
+ */
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    if (!len) {
+        return 0;
+    }
+
+#ifdef CONFIG_AVX2_OPT
+    if (use_avx2 && ((uintptr_t) buf) % sizeof(__m256i) == 0
+        && len % AVX2_NONZERO_CHUNK == 0) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
+    }
+#endif
+
+    return buffer_find_nonzero_offset_vector(buf, len);
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
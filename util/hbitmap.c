@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -493,3 +494,67 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 
     return true;
 }
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->size, 64) * 8;
+}
+
+/* A little-endian array of 32-bit words is also one of 64-bit words, so
+ * the bottom level can be converted one unsigned long at a time.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf)
+{
+    const unsigned long *cur = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i, pos = 0;
+
+    for (i = 0; pos < len; i++, pos += sizeof(unsigned long)) {
+        /* with 32-bit longs, the last 64-bit word may be half outside */
+        unsigned long w = i < hb->sizes[HBITMAP_LEVELS - 1] ? cur[i] : 0;
+
+        if (BITS_PER_LONG == 32) {
+            stl_le_p(buf + pos, w);
+        } else {
+            stq_le_p(buf + pos, w);
+        }
+    }
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf)
+{
+    unsigned long *cur = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t len = hbitmap_serialization_size(hb);
+    uint64_t i, j, n = 0, pos;
+    int level;
+
+    hbitmap_reset_all(hb);
+    for (pos = 0; pos < len && n < hb->sizes[HBITMAP_LEVELS - 1];
+         n++, pos += sizeof(unsigned long)) {
+        if (BITS_PER_LONG == 32) {
+            cur[n] = ldl_le_p(buf + pos);
+        } else {
+            cur[n] = ldq_le_p(buf + pos);
+        }
+    }
+
+    /* Ignore any garbage past the end of the bitmap */
+    for (i = hb->size; i < n * BITS_PER_LONG; i++) {
+        cur[i >> BITS_PER_LEVEL] &= ~(1UL << (i & (BITS_PER_LONG - 1)));
+    }
+
+    hb->count = 0;
+    for (i = 0; i < n; i++) {
+        hb->count += ctpopl(cur[i]);
+    }
+
+    /* Rebuild the upper levels from the bottom one */
+    for (level = HBITMAP_LEVELS - 1; level > 0; level--) {
+        for (j = 0; j < hb->sizes[level]; j++) {
+            if (hb->levels[level][j]) {
+                hb->levels[level - 1][j >> BITS_PER_LEVEL] |=
+                    1UL << (j & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+}
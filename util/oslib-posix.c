@@ -58,6 +58,8 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
@@ -333,7 +335,21 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Report progress about once a second while preallocating */
+#define MEM_PREALLOC_PROGRESS_MS 1000
+
+typedef struct MemPreallocThread {
+    QemuThread thread;
+    int index;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    size_t touched;
+    const MemPreallocParams *params;
+    QemuSemaphore *done;
+} MemPreallocThread;
+
+static __thread sigjmp_buf sigjump;
 
 static void sigbus_handler(int signal)
 {
@@ -360,48 +376,127 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+static void *do_touch_pages(void *arg)
 {
-    int ret;
-    struct sigaction act, oldact;
-    sigset_t set, oldset;
-
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = &sigbus_handler;
-    act.sa_flags = 0;
+    MemPreallocThread *t = arg;
+    const MemPreallocParams *params = t->params;
+    sigset_t set;
+    size_t i;
 
-    ret = sigaction(SIGBUS, &act, &oldact);
-    if (ret) {
-        perror("os_mem_prealloc: failed to install signal handler");
-        exit(1);
+    if (params && params->thread_init) {
+        params->thread_init(t->index, params->opaque);
     }
 
     /* unblock SIGBUS */
     sigemptyset(&set);
     sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
     if (sigsetjmp(sigjump, 1)) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
+    }
+
+    /* MAP_POPULATE silently ignores failures */
+    for (i = 0; i < t->numpages; i++) {
+        memset(t->addr + (t->hpagesize * i), 0, 1);
+        atomic_set(&t->touched, i + 1);
+    }
+
+    qemu_sem_post(t->done);
+    return NULL;
+}
+
+static int mem_prealloc_nr_threads(const MemPreallocParams *params,
+                                   size_t numpages)
+{
+    long nr_threads;
+
+    if (params && params->threads) {
+        nr_threads = params->threads;
     } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+        nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_threads = MIN(nr_threads, MEM_PREALLOC_MAX_THREADS);
+    }
+    return MAX(MIN(nr_threads, numpages), 1);
+}
 
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
+/*
+ * Touches every page of @area from several threads, so that the host
+ * allocates them now rather than when the guest first uses them.
+ * Exits if the host runs out of memory.
+ */
+void os_mem_prealloc(int fd, char *area, size_t memory,
+                     const MemPreallocParams *params)
+{
+    int ret, i, nr_threads, finished = 0;
+    struct sigaction act, oldact;
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    size_t pages_per_thread, touched;
+    MemPreallocThread *threads;
+    QemuSemaphore done;
+    char *addr = area;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &sigbus_handler;
+    act.sa_flags = 0;
+
+    ret = sigaction(SIGBUS, &act, &oldact);
+    if (ret) {
+        perror("os_mem_prealloc: failed to install signal handler");
+        exit(1);
+    }
+
+    nr_threads = mem_prealloc_nr_threads(params, numpages);
+    threads = g_new0(MemPreallocThread, nr_threads);
+    qemu_sem_init(&done, 0);
+
+    pages_per_thread = numpages / nr_threads;
+    for (i = 0; i < nr_threads; i++) {
+        MemPreallocThread *t = &threads[i];
+
+        t->index = i;
+        t->addr = addr;
+        t->numpages = pages_per_thread + (i < numpages % nr_threads);
+        t->hpagesize = hpagesize;
+        t->params = params;
+        t->done = &done;
+        addr += t->numpages * hpagesize;
+        qemu_thread_create(&t->thread, "mem-prealloc", do_touch_pages, t,
+                           QEMU_THREAD_JOINABLE);
+    }
 
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
+    while (finished < nr_threads) {
+        if (qemu_sem_timedwait(&done, MEM_PREALLOC_PROGRESS_MS) == 0) {
+            finished++;
+            continue;
         }
+        if (params && params->progress) {
+            touched = 0;
+            for (i = 0; i < nr_threads; i++) {
+                touched += atomic_read(&threads[i].touched);
+            }
+            params->progress(MIN(touched * hpagesize, memory), memory,
+                             params->opaque);
+        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+    }
+    qemu_sem_destroy(&done);
+    g_free(threads);
+
+    if (params && params->progress) {
+        params->progress(memory, memory, params->opaque);
+    }
+
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
 
@@ -462,7 +462,8 @@ size_t getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory,
+                     const MemPreallocParams *params)
 {
     int i;
     size_t pagesize = getpagesize();
@@ -471,6 +472,9 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
     for (i = 0; i < memory / pagesize; i++) {
         memset(area + pagesize * i, 0, 1);
     }
+    if (params && params->progress) {
+        params->progress(memory, memory, params->opaque);
+    }
 }
 
 
@@ -0,0 +1,616 @@
+/*
+ * QHT: a resizable, RCU-protected hash table with lock-free lookups
+ *
+ * Copyright (c) 2016 The QEMU Project
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include <string.h>
+#include <assert.h>
+#include <glib.h>
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/host-utils.h"
+
+/* The table is an array of head buckets, each of which may be followed by
+ * a chain of overflow buckets.  A bucket holds a few (hash, pointer) pairs
+ * and fits in a single cache line, so that a lookup usually touches one
+ * line only and compares full 32-bit hashes before calling back into the
+ * user's comparison function.
+ *
+ * Writers serialize on the spinlock of the head bucket; chained buckets
+ * are covered by the lock of their head.  Readers take no locks: they
+ * retry the walk of a chain if the sequence counter of its head bucket
+ * changed while they were reading, which is the same protocol as
+ * QemuSeqLock without the mutex pointer that would not fit in the line.
+ *
+ * Entries in a chain are always packed towards its head: the first empty
+ * slot marks the end of the chain, and removals fill the hole with the
+ * last entry of the chain.
+ *
+ * Resizing allocates a new map, copies all the entries into it while
+ * holding every head bucket lock of the old map, and then publishes the
+ * new map with RCU.  Writers that raced with a resize notice that the map
+ * they locked is stale and retry under ht->lock.
+ */
+
+#define QHT_BUCKET_ALIGN 64
+
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+struct qht_bucket {
+    QemuSpin lock;
+    unsigned sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct qht_bucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
+
+/* Grow the table once more than 1/QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV of
+ * the head buckets had to be chained.
+ */
+#define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+struct qht_map {
+    struct rcu_head rcu;
+    struct qht_bucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+};
+
+static inline void qht_bucket_write_begin(struct qht_bucket *head)
+{
+    atomic_set(&head->sequence, head->sequence + 1);
+    smp_wmb();
+}
+
+static inline void qht_bucket_write_end(struct qht_bucket *head)
+{
+    smp_wmb();
+    atomic_set(&head->sequence, head->sequence + 1);
+}
+
+static inline unsigned qht_bucket_read_begin(struct qht_bucket *head)
+{
+    /* Always fail if a write is in progress.  */
+    unsigned ret = atomic_read(&head->sequence);
+
+    smp_rmb();
+    return ret & ~1;
+}
+
+static inline bool qht_bucket_read_retry(struct qht_bucket *head,
+                                         unsigned start)
+{
+    smp_rmb();
+    return unlikely(atomic_read(&head->sequence) != start);
+}
+
+static inline size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n = n_elems / QHT_BUCKET_ENTRIES;
+
+    return n ? pow2ceil(n) : 1;
+}
+
+static inline struct qht_bucket *qht_map_to_bucket(struct qht_map *map,
+                                                   uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline bool qht_map_needs_resize(struct qht_map *map)
+{
+    return atomic_read(&map->n_added_buckets) >
+           map->n_added_buckets_threshold;
+}
+
+static void qht_bucket_init(struct qht_bucket *b)
+{
+    memset(b, 0, sizeof(*b));
+    qemu_spin_init(&b->lock);
+}
+
+static struct qht_map *qht_map_create(size_t n_buckets)
+{
+    struct qht_map *map;
+    size_t i;
+
+    map = g_new(struct qht_map, 1);
+    map->n_buckets = n_buckets;
+    map->n_added_buckets = 0;
+    map->n_added_buckets_threshold = n_buckets /
+        QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
+    /* let tiny maps grow too */
+    if (map->n_added_buckets_threshold == 0) {
+        map->n_added_buckets_threshold = 1;
+    }
+
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 sizeof(*map->buckets) * n_buckets);
+    for (i = 0; i < n_buckets; i++) {
+        qht_bucket_init(&map->buckets[i]);
+    }
+    return map;
+}
+
+static void qht_map_destroy(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = map->buckets[i].next;
+
+        while (b) {
+            struct qht_bucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static void qht_map_lock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_lock(&map->buckets[i].lock);
+    }
+}
+
+static void qht_map_unlock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_unlock(&map->buckets[i].lock);
+    }
+}
+
+/* Lock the head bucket for @hash in the current map.  Must be called
+ * within an RCU read-side critical section.
+ */
+static struct qht_bucket *qht_bucket_lock(struct qht *ht, uint32_t hash,
+                                          struct qht_map **pmap)
+{
+    struct qht_map *map;
+    struct qht_bucket *b;
+
+    map = atomic_rcu_read(&ht->map);
+    b = qht_map_to_bucket(map, hash);
+    qemu_spin_lock(&b->lock);
+    if (likely(map == atomic_read(&ht->map))) {
+        *pmap = map;
+        return b;
+    }
+    qemu_spin_unlock(&b->lock);
+
+    /* We raced with a resize; ht->lock gives us the up-to-date map.  */
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    b = qht_map_to_bucket(map, hash);
+    qemu_spin_lock(&b->lock);
+    qemu_mutex_unlock(&ht->lock);
+    *pmap = map;
+    return b;
+}
+
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
+{
+    struct qht_map *map;
+
+    ht->mode = mode;
+    qemu_mutex_init(&ht->lock);
+    map = qht_map_create(qht_elems_to_buckets(n_elems));
+    atomic_rcu_set(&ht->map, map);
+}
+
+void qht_destroy(struct qht *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+static void qht_do_lookup_chain(struct qht_bucket *head,
+                                qht_lookup_func_t func, const void *userp,
+                                uint32_t hash, void **ret)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                void *p = atomic_rcu_read(&b->pointers[i]);
+
+                if (likely(p) && likely(func(p, userp))) {
+                    *ret = p;
+                    return;
+                }
+            }
+        }
+        b = atomic_rcu_read(&b->next);
+    } while (b);
+    *ret = NULL;
+}
+
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    struct qht_map *map;
+    struct qht_bucket *head;
+    unsigned version;
+    void *ret;
+
+    map = atomic_rcu_read(&ht->map);
+    head = qht_map_to_bucket(map, hash);
+    do {
+        version = qht_bucket_read_begin(head);
+        qht_do_lookup_chain(head, func, userp, hash, &ret);
+    } while (qht_bucket_read_retry(head, version));
+    return ret;
+}
+
+/* Called with the lock of @head held, or on a map that is not visible to
+ * other threads yet.
+ */
+static bool qht_insert__locked(struct qht_map *map, struct qht_bucket *head,
+                               void *p, uint32_t hash, bool *needs_resize)
+{
+    struct qht_bucket *b = head;
+    struct qht_bucket *prev = NULL;
+    struct qht_bucket *new = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+            if (unlikely(b->pointers[i] == p)) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+    qht_bucket_init(b);
+    new = b;
+    i = 0;
+    atomic_inc(&map->n_added_buckets);
+    if (unlikely(qht_map_needs_resize(map)) && needs_resize) {
+        *needs_resize = true;
+    }
+
+ found:
+    qht_bucket_write_begin(head);
+    if (new) {
+        atomic_rcu_set(&prev->next, b);
+    }
+    atomic_set(&b->hashes[i], hash);
+    atomic_rcu_set(&b->pointers[i], p);
+    qht_bucket_write_end(head);
+    return true;
+}
+
+static void qht_do_resize(struct qht *ht, struct qht_map *new);
+
+static void qht_grow_maybe(struct qht *ht)
+{
+    struct qht_map *map;
+
+    /* If somebody else holds the lock, a resize is probably under way.  */
+    if (qemu_mutex_trylock(&ht->lock)) {
+        return;
+    }
+    map = ht->map;
+    if (qht_map_needs_resize(map)) {
+        qht_do_resize(ht, qht_map_create(map->n_buckets * 2));
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_insert(struct qht *ht, void *p, uint32_t hash)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+    bool needs_resize = false;
+    bool ret;
+
+    /* NULL pointers are not supported */
+    assert(p);
+
+    rcu_read_lock();
+    b = qht_bucket_lock(ht, hash, &map);
+    ret = qht_insert__locked(map, b, p, hash, &needs_resize);
+    qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
+
+    if (unlikely(needs_resize) && (ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_grow_maybe(ht);
+    }
+    return ret;
+}
+
+static inline bool qht_entry_is_last(struct qht_bucket *b, int pos)
+{
+    if (pos == QHT_BUCKET_ENTRIES - 1) {
+        return b->next == NULL || b->next->pointers[0] == NULL;
+    }
+    return b->pointers[pos + 1] == NULL;
+}
+
+static void qht_entry_move(struct qht_bucket *to, int i,
+                           struct qht_bucket *from, int j)
+{
+    atomic_set(&to->hashes[i], from->hashes[j]);
+    atomic_set(&to->pointers[i], from->pointers[j]);
+
+    atomic_set(&from->hashes[j], 0);
+    atomic_set(&from->pointers[j], NULL);
+}
+
+/* Fill the hole at @orig[@pos] with the last entry of the chain, keeping
+ * the chain packed.
+ */
+static void qht_bucket_remove_entry(struct qht_bucket *orig, int pos)
+{
+    struct qht_bucket *b = orig;
+    struct qht_bucket *prev = NULL;
+    int i;
+
+    if (qht_entry_is_last(orig, pos)) {
+        atomic_set(&orig->hashes[pos], 0);
+        atomic_set(&orig->pointers[pos], NULL);
+        return;
+    }
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i]) {
+                continue;
+            }
+            if (i > 0) {
+                qht_entry_move(orig, pos, b, i - 1);
+            } else {
+                qht_entry_move(orig, pos, prev, QHT_BUCKET_ENTRIES - 1);
+            }
+            return;
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+    /* all the buckets in the chain are full */
+    qht_entry_move(orig, pos, prev, QHT_BUCKET_ENTRIES - 1);
+}
+
+static bool qht_remove__locked(struct qht_bucket *head, const void *p,
+                               uint32_t hash)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *q = b->pointers[i];
+
+            if (unlikely(q == NULL)) {
+                return false;
+            }
+            if (q == p) {
+                assert(b->hashes[i] == hash);
+                qht_bucket_write_begin(head);
+                qht_bucket_remove_entry(b, i);
+                qht_bucket_write_end(head);
+                return true;
+            }
+        }
+        b = b->next;
+    } while (b);
+    return false;
+}
+
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
+{
+    struct qht_bucket *b;
+    struct qht_map *map;
+    bool ret;
+
+    /* NULL pointers are not supported */
+    assert(p);
+
+    rcu_read_lock();
+    b = qht_bucket_lock(ht, hash, &map);
+    ret = qht_remove__locked(b, p, hash);
+    qemu_spin_unlock(&b->lock);
+    rcu_read_unlock();
+    return ret;
+}
+
+static void qht_bucket_reset__locked(struct qht_bucket *head)
+{
+    struct qht_bucket *b = head;
+    int i;
+
+    qht_bucket_write_begin(head);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            atomic_set(&b->hashes[i], 0);
+            atomic_set(&b->pointers[i], NULL);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    qht_bucket_write_end(head);
+}
+
+/* Called with ht->lock held */
+static void qht_map_reset__locked(struct qht_map *map)
+{
+    size_t i;
+
+    qht_map_lock_buckets(map);
+    for (i = 0; i < map->n_buckets; i++) {
+        qht_bucket_reset__locked(&map->buckets[i]);
+    }
+    qht_map_unlock_buckets(map);
+}
+
+void qht_reset(struct qht *ht)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_map_reset__locked(ht->map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_reset_size(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool resize = false;
+
+    qemu_mutex_lock(&ht->lock);
+    qht_map_reset__locked(ht->map);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, qht_map_create(n_buckets));
+        resize = true;
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return resize;
+}
+
+/* Called with all the head bucket locks of @map held */
+static void qht_map_iter__all_locked(struct qht *ht, struct qht_map *map,
+                                     qht_iter_func_t func, void *userp)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *b = &map->buckets[i];
+        int j;
+
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (b->pointers[j] == NULL) {
+                    break;
+                }
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+            b = b->next;
+        } while (b && j == QHT_BUCKET_ENTRIES);
+    }
+}
+
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
+{
+    struct qht_map *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    qht_map_iter__all_locked(ht, map, func, userp);
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+static void qht_map_copy(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    struct qht_map *new = userp;
+    struct qht_bucket *b = qht_map_to_bucket(new, hash);
+
+    /* no other thread can see @new yet, so b->lock need not be taken */
+    qht_insert__locked(new, b, p, hash, NULL);
+}
+
+/* Called with ht->lock held */
+static void qht_do_resize(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+
+    qht_map_lock_buckets(old);
+    qht_map_iter__all_locked(ht, old, qht_map_copy, new);
+    atomic_rcu_set(&ht->map, new);
+    qht_map_unlock_buckets(old);
+    call_rcu(old, qht_map_destroy, rcu);
+}
+
+bool qht_resize(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    bool ret = false;
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, qht_map_create(n_buckets));
+        ret = true;
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+void qht_statistics(struct qht *ht, struct qht_stats *stats)
+{
+    struct qht_map *map;
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    stats->head_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        struct qht_bucket *head = &map->buckets[i];
+        struct qht_bucket *b;
+        unsigned version;
+        size_t buckets;
+        size_t entries;
+        int j;
+
+        do {
+            version = qht_bucket_read_begin(head);
+            buckets = 0;
+            entries = 0;
+            b = head;
+            do {
+                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                    if (atomic_read(&b->pointers[j]) == NULL) {
+                        break;
+                    }
+                    entries++;
+                }
+                if (j > 0) {
+                    buckets++;
+                }
+                b = atomic_rcu_read(&b->next);
+            } while (b && j == QHT_BUCKET_ENTRIES);
+        } while (qht_bucket_read_retry(head, version));
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->chain_buckets += buckets;
+            if (buckets > stats->max_chain) {
+                stats->max_chain = buckets;
+            }
+        }
+    }
+    rcu_read_unlock();
+}
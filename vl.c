@@ -316,6 +316,29 @@ static QemuOptsList qemu_machine_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .merge_lists = true,
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Enable/disable multi-threaded TCG",
+        }, {
+            .name = "trace-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Executions after which a TB is retranslated as a trace",
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_boot_opts = {
     .name = "boot-opts",
     .implied_opt_name = "order",
@@ -3025,6 +3048,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_trace_opts);
     qemu_add_opts(&qemu_option_rom_opts);
     qemu_add_opts(&qemu_machine_opts);
+    qemu_add_opts(&qemu_accel_opts);
     qemu_add_opts(&qemu_mem_opts);
     qemu_add_opts(&qemu_smp_opts);
     qemu_add_opts(&qemu_boot_opts);
@@ -3675,6 +3699,22 @@ int main(int argc, char **argv, char **envp)
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse_noisily(olist, "accel=kvm", false);
                 break;
+            case QEMU_OPTION_accel: {
+                char *accel_arg;
+
+                opts = qemu_opts_parse_noisily(qemu_find_opts("accel"),
+                                               optarg, true);
+                if (!opts || !qemu_opt_get(opts, "accel")) {
+                    error_report("no accelerator specified with -accel");
+                    exit(1);
+                }
+                accel_arg = g_strdup_printf("accel=%s",
+                                            qemu_opt_get(opts, "accel"));
+                olist = qemu_find_opts("machine");
+                qemu_opts_parse_noisily(olist, accel_arg, false);
+                g_free(accel_arg);
+                break;
+            }
             case QEMU_OPTION_M:
             case QEMU_OPTION_machine:
                 olist = qemu_find_opts("machine");
@@ -4417,6 +4457,11 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (tcg_enabled()) {
+        qemu_tcg_configure(qemu_opts_find(qemu_find_opts("accel"), NULL),
+                           &error_fatal);
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4449,6 +4494,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     blk_mig_init();
+    dirty_bitmap_mig_init();
     ram_mig_init();
 
     /* If the currently selected machine wishes to override the units-per-bus